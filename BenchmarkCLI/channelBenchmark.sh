@@ -0,0 +1,214 @@
+#!/bin/sh
+#
+#   Copyright 2023 Trail of Bits
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+# Measures the covert channel between the writer and the listener: runs
+# the listener alone as a control, then again while the writer is writing
+# the canary on the same device, and compares the listeners' JSON
+# summaries. See README.md for the options.
+
+set -u
+
+usage() {
+  cat <<EOF
+usage: $0 [options]
+  --api opencl|vulkan     Tools to benchmark (default: opencl)
+  -d, --device N          Device id, as the tools' --list numbers them (default: 0)
+  --device-name REGEX     Use the first device whose name matches instead
+  --cpu                   Use the CPU stand-in: pocl for OpenCL, lavapipe for Vulkan
+  --duration SECONDS      How long the listener runs, per run (default: 10)
+  --warmup SECONDS        Time the writer runs before the listener starts (default: 1)
+  -c, --canary N          Canary value (default: 123)
+  --no-control            Skip the run without the writer
+  --listener PATH         Listener binary (default: the one built in this repository)
+  --writer PATH           Writer binary (default: the one built in this repository)
+  --listener-args ARGS    Extra arguments for the listener
+  --writer-args ARGS      Extra arguments for the writer
+  -o, --output FILE       Also write the JSON summary to FILE
+  --expect-mitigated      Exit with status 3 if the listener observed the canary
+  -h, --help              Print usage
+EOF
+}
+
+fail() {
+  echo "$0: $*" >&2
+  exit 1
+}
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+
+api=opencl
+device=0
+deviceName=
+cpu=0
+duration=10
+warmup=1
+canary=123
+control=1
+listener=
+writer=
+listenerArgs=
+writerArgs=
+output=
+expectMitigated=0
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --api) api=$2; shift ;;
+    -d|--device) device=$2; shift ;;
+    --device-name) deviceName=$2; shift ;;
+    --cpu) cpu=1 ;;
+    --duration) duration=$2; shift ;;
+    --warmup) warmup=$2; shift ;;
+    -c|--canary) canary=$2; shift ;;
+    --no-control) control=0 ;;
+    --listener) listener=$2; shift ;;
+    --writer) writer=$2; shift ;;
+    --listener-args) listenerArgs=$2; shift ;;
+    --writer-args) writerArgs=$2; shift ;;
+    -o|--output) output=$2; shift ;;
+    --expect-mitigated) expectMitigated=1 ;;
+    -h|--help) usage; exit 0 ;;
+    *) usage >&2; exit 1 ;;
+  esac
+  shift
+done
+
+case "$api" in
+  opencl)
+    [ -n "$listener" ] || listener=$root/OpenCLCLI/covertCLListener/build/covertCLListener
+    [ -n "$writer" ] || writer=$root/OpenCLCLI/covertCLWriter/build/covertCLWriter
+    # pocl names its devices after the driver and the host CPU
+    cpuDevices='^(pthread|cpu)'
+    ;;
+  vulkan)
+    [ -n "$listener" ] || listener=$root/VulkanCLI/covertListener/build/covertListener
+    [ -n "$writer" ] || writer=$root/VulkanCLI/covertWriter/build/covertWriter
+    cpuDevices='llvmpipe'
+    ;;
+  *) fail "unknown api: $api" ;;
+esac
+[ -x "$listener" ] || fail "no listener at $listener, build it first"
+[ -x "$writer" ] || fail "no writer at $writer, build it first"
+
+if [ "$cpu" = 1 ] && [ -z "$deviceName" ]; then
+  deviceName=$cpuDevices
+fi
+
+tmp=$(mktemp -d) || fail "cannot create a temporary directory"
+writerPid=
+cleanup() {
+  if [ -n "$writerPid" ]; then
+    kill "$writerPid" 2>/dev/null
+    wait "$writerPid" 2>/dev/null
+  fi
+  rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+# Both tools number the devices the same way; the OpenCL ones print
+# "  device N: NAME" and the Vulkan ones "N: NAME"
+if [ -n "$deviceName" ]; then
+  "$listener" --list > "$tmp/devices" 2>&1 || fail "$listener --list failed"
+  device=$(sed -n 's/^ *\(device \)\{0,1\}\([0-9][0-9]*\): \(.*\)$/\2 \3/p' "$tmp/devices" |
+	     while read -r id name; do
+	       if printf '%s\n' "$name" | grep -Eq -- "$deviceName"; then
+		 echo "$id"
+		 break
+	       fi
+	     done)
+  [ -n "$device" ] || fail "no device matches '$deviceName'"
+fi
+
+# Last value of a field of the listener's JSON summary
+field() {
+  sed -n "s/^ *\"$1\": \([^,]*\),\{0,1\}\$/\1/p" "$2" | tail -n 1
+}
+
+# Runs the listener for the duration and leaves its output in $tmp/$1
+listen() {
+  # shellcheck disable=SC2086
+  "$listener" -d "$device" -c "$canary" --duration "$duration" $listenerArgs > "$tmp/$1" 2>&1 ||
+    { cat "$tmp/$1" >&2; fail "the listener failed"; }
+  grep -q '"canary_iterations"' "$tmp/$1" || { cat "$tmp/$1" >&2; fail "the listener printed no summary"; }
+}
+
+# The metrics of one run as a JSON object
+summary() {
+  values=$(field values "$tmp/$1")
+  ratio=$(field non_zero_ratio "$tmp/$1")
+  awk -v values="$values" -v ratio="$ratio" \
+      -v hits="$(field canary_hits "$tmp/$1")" \
+      -v hitRate="$(field canary_hits_per_second "$tmp/$1")" \
+      -v canaryIterations="$(field canary_iterations "$tmp/$1")" \
+      -v iterations="$(field iterations "$tmp/$1")" \
+      -v seconds="$(field seconds "$tmp/$1")" \
+      -v first="$(field first_canary_seconds "$tmp/$1")" '
+    BEGIN {
+      s = seconds > 0 ? seconds : 1e-9
+      printf "{\"iterations\": %d, \"seconds\": %.3f, ", iterations, seconds
+      printf "\"bytes_observed\": %.0f, \"non_zero_bytes\": %.0f, ", values * 4, values * ratio * 4
+      printf "\"canary_hits\": %d, \"canary_hits_per_second\": %.3f, ", hits, hitRate
+      printf "\"canary_iterations\": %d, \"canary_iterations_per_second\": %.3f, ", canaryIterations, canaryIterations / s
+      printf "\"first_canary_seconds\": %s}", first
+    }'
+}
+
+echo "benchmarking the $api channel on device $device for $duration s" >&2
+
+if [ "$control" = 1 ]; then
+  echo "control run, without the writer" >&2
+  listen control
+fi
+
+echo "starting the writer" >&2
+# shellcheck disable=SC2086
+"$writer" -d "$device" -c "$canary" $writerArgs > "$tmp/writer.log" 2>&1 &
+writerPid=$!
+# Building the kernel can take a while on a cold cache
+waited=0
+until grep -q "entering writing loop" "$tmp/writer.log"; do
+  kill -0 "$writerPid" 2>/dev/null || { cat "$tmp/writer.log" >&2; fail "the writer exited"; }
+  [ "$waited" -lt 600 ] || fail "the writer did not start"
+  sleep 0.1
+  waited=$((waited + 1))
+done
+sleep "$warmup"
+
+echo "run with the writer" >&2
+listen channel
+kill -0 "$writerPid" 2>/dev/null || { cat "$tmp/writer.log" >&2; fail "the writer exited during the run"; }
+
+deviceLabel=$(sed -n 's/^ *"device": "\(.*\)",$/\1/p' "$tmp/channel" | tail -n 1)
+{
+  printf '{\n  "api": "%s",\n  "device": "%s",\n  "device_id": %s,\n' "$api" "$deviceLabel" "$device"
+  printf '  "canary": %s,\n  "duration": %s,\n' "$canary" "$duration"
+  if [ "$control" = 1 ]; then
+    printf '  "control": %s,\n' "$(summary control)"
+  fi
+  printf '  "with_writer": %s\n}\n' "$(summary channel)"
+} > "$tmp/summary"
+
+cat "$tmp/summary"
+if [ -n "$output" ]; then
+  cp "$tmp/summary" "$output" || fail "cannot write $output"
+fi
+
+if [ "$expectMitigated" = 1 ] && [ "$(field canary_iterations "$tmp/channel")" != 0 ]; then
+  echo "the listener observed the canary" >&2
+  exit 3
+fi
+exit 0
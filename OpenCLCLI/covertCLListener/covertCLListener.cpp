@@ -20,36 +20,379 @@
 #include <vector>
 #include <algorithm>
 #include <fstream>
+#include <thread>
+#include <chrono>
+#include <memory>
 
 // For command line
 #include "cxxopts.hpp"
 
-// Should be in common.h but it doesn't like to compile for AMD
-// devices. 
+// Histogram of the observed values
+#include <histogram.h>
 
-// common.h start
+// Summary of bounded runs
+#include <report.h>
 
-#define MAX_SHMEM_SIZE 65536
 
-#if !defined(SHARED_MEMORY_SIZE) 
-#define SHARED_MEMORY_SIZE_INT (MAX_SHMEM_SIZE/4)
-#endif
+#include <CL/opencl.hpp>
+using namespace cl;
+
+// Device enumeration and the per-process context and program cache
+#include <cldevices.h>
+
+// Tuned launch configurations
+#include <profile.h>
+
+// Compressed recordings of the dumps
+#include <recording.h>
+
+// The kernel source, embedded by the Makefile
+const std::string kernelSource =
+#include "covertCLListener.clh"
+  ;
+
+// The kernel never reads A or B and overwrites every element of C, so
+// resetting them is only kept for parity with the original listener.
+enum ResetMode { RESET_HOST, RESET_FILL, RESET_NONE };
+
+struct ListenerConfig {
+  int gridSize;
+  int workgroupSize;
+  int ringDepth;
+  ResetMode resetMode;
+  bool reportBytes;
+  // Bounds of the run; negative and zero mean unbounded
+  long iterations;
+  double duration;
+  uint32_t canary;
+  // Bytes of local memory per workgroup, 0 for all the device has
+  long localMem;
+  bool useCache;
+  // Every dump is written to this file when set
+  std::string recordPath;
+};
+
+// The local array is sized when the kernel is built
+std::string buildOptions(long localMem) {
+  return "-DSHARED_MEMORY_SIZE_INT=" + std::to_string(localMem / 4);
+}
+
+// Runs the listener on one device with the context, queue and program
+// cached for it. An unbounded run goes on forever and prints the
+// histogram of every dump; a bounded one prints nothing and accumulates
+// the dumps, timings and canary hits into the report.
+void listen(Device d, const std::string &source, const ListenerConfig &cfg, leftoverlocals::Report &report) {
+  bool interactive = cfg.iterations < 0 && cfg.duration <= 0;
+  report.name = d.getInfo<CL_DEVICE_NAME>();
+
+  leftoverlocals::DeviceCache &cache = leftoverlocals::DeviceCache::shared();
+  Context context = cache.context(d);
+
+  long localMem = cfg.localMem > 0 ? cfg.localMem : (long) d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  int localInts = localMem / 4;
+
+  Program program;
+  std::string buildLog;
+  if(cache.program(d, source, buildOptions(localMem), program, buildLog, cfg.useCache)!=CL_SUCCESS){
+    report.error = "Error building: " + buildLog;
+    if (interactive) {
+      std::cout<<" "<<report.error<<"\n";
+      exit(1);
+    }
+    return;
+  }
+
+  int globalSize = cfg.gridSize*cfg.workgroupSize;
+  int size_int = localInts * cfg.gridSize;
+  int size = size_int * 4;
+
+  std::unique_ptr<leftoverlocals::Recorder> recorder;
+  if (!cfg.recordPath.empty()) {
+    recorder.reset(new leftoverlocals::Recorder(cfg.recordPath,
+      "api=opencl\ndevice=" + report.name +
+      "\nworkgroup-size=" + std::to_string(cfg.workgroupSize) +
+      "\ngrid-size=" + std::to_string(cfg.gridSize) +
+      "\nlocal-mem=" + std::to_string(localMem) +
+      "\ncanary=" + std::to_string(cfg.canary) + "\n"));
+    if (!recorder->ok()) {
+      report.error = "cannot write " + cfg.recordPath;
+      if (interactive) {
+	std::cout << report.error << std::endl;
+	exit(1);
+      }
+      return;
+    }
+  }
+  ResetMode resetMode = cfg.resetMode;
 
-// In case we want to try out of bounds accesses
-#if !defined(SHARED_MEMORY_SIZE_TRAVERSED) 
-#define SHARED_MEMORY_SIZE_TRAVERSED (SHARED_MEMORY_SIZE_INT)
-#endif
+  long bytesUploaded = resetMode == RESET_HOST ? 3L * size : 0;
+  long bytesReadBack = size;
+  if (cfg.reportBytes && interactive) {
+    std::cout << "bytes moved per iteration: " << bytesUploaded << " uploaded, " << bytesReadBack << " read back" << std::endl;
+  }
 
-// common.h end
+  // Profiling gives the device-side duration of every dispatch
+  CommandQueue queue = cache.queue(d, interactive ? 0 : CL_QUEUE_PROFILING_ENABLE);
+
+  // Each slot of the ring owns a full set of buffers so that the
+  // histogram of one iteration can be computed on the host while the
+  // following iterations are still running on the device.
+  struct Slot {
+    Buffer buffer_A;
+    Buffer buffer_B;
+    Buffer buffer_C;
+    int * A;
+    int * B;
+    int * C;
+    Kernel kernel;
+    Event launched;
+    Event done;
+  };
+  std::vector<Slot> ring(cfg.ringDepth);
+
+  for (auto &s : ring) {
+    // create buffers on the device
+    s.buffer_A = Buffer(context,CL_MEM_READ_WRITE,size);
+    s.buffer_B = Buffer(context,CL_MEM_READ_WRITE,size);
+    s.buffer_C = Buffer(context,CL_MEM_READ_WRITE,size);
+
+    // Host copies of A and B are only needed to upload zeros
+    s.A = s.B = nullptr;
+    if (resetMode == RESET_HOST) {
+      s.A = (int*) malloc(size);
+      s.B = (int*) malloc(size);
+    }
+    s.C = (int*) malloc(size);
 
+    s.kernel = cl::Kernel(program,"covertListener");
+    s.kernel.setArg(0,s.buffer_A);
+    s.kernel.setArg(1,s.buffer_B);
+    s.kernel.setArg(2,s.buffer_C);
+  }
 
-#include <CL/opencl.hpp>
-using namespace cl;
+  long enqueued = 0;
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  // A failed enqueue, e.g. a launch the kernel cannot run, ends the run
+  // with an error; the slots already handed out are still drained
+  auto failed = [&](cl_int err, const char *what) {
+    if (err == CL_SUCCESS) {
+      return false;
+    }
+    if (report.error.empty()) {
+      report.error = std::string(what) + " failed with error " + std::to_string(err);
+    }
+    return true;
+  };
+
+  // Queue one iteration on a slot without blocking. The slot's event
+  // fires once C has been read back into host memory.
+  auto enqueueSlot = [&](Slot &s) {
+    if ((cfg.iterations >= 0 && enqueued >= cfg.iterations) ||
+	(cfg.duration > 0 && elapsed() >= cfg.duration) ||
+	!report.error.empty()) {
+      return;
+    }
+
+    if (resetMode == RESET_HOST) {
+      for (int i = 0; i < size_int; i++) {
+	s.A[i] = s.B[i] = s.C[i] = 0;
+      }
+
+      if (failed(queue.enqueueWriteBuffer(s.buffer_A, CL_FALSE, 0, size, s.A), "clEnqueueWriteBuffer") ||
+	  failed(queue.enqueueWriteBuffer(s.buffer_B, CL_FALSE, 0, size, s.B), "clEnqueueWriteBuffer") ||
+	  failed(queue.enqueueWriteBuffer(s.buffer_C, CL_FALSE, 0, size, s.C), "clEnqueueWriteBuffer")) {
+	return;
+      }
+    }
+    else if (resetMode == RESET_FILL) {
+      if (failed(queue.enqueueFillBuffer(s.buffer_A, 0, 0, size), "clEnqueueFillBuffer") ||
+	  failed(queue.enqueueFillBuffer(s.buffer_B, 0, 0, size), "clEnqueueFillBuffer") ||
+	  failed(queue.enqueueFillBuffer(s.buffer_C, 0, 0, size), "clEnqueueFillBuffer")) {
+	return;
+      }
+    }
+
+    if (failed(queue.enqueueNDRangeKernel(s.kernel, 0, NDRange(globalSize),NDRange(cfg.workgroupSize), nullptr, &s.launched), "clEnqueueNDRangeKernel") ||
+	failed(queue.enqueueReadBuffer(s.buffer_C, CL_FALSE, 0, size, s.C, nullptr, &s.done), "clEnqueueReadBuffer") ||
+	failed(queue.flush(), "clFlush")) {
+      return;
+    }
+    // Only iterations whose read back was queued are drained
+    enqueued++;
+  };
+
+  long iters = 0;
+
+  // Sized for the dump so counting never has to grow the table
+  leftoverlocals::Histogram observations(size_int);
+  if (!interactive) {
+    report.observations.reserve(size_int);
+  }
 
-// for sorting the histogram
-bool cmp(std::pair<int, int> a,
-	 std::pair<int, int> b) {
-    return a.second > b.second;
+  if (interactive) {
+    std::cout << "printing out a histogram of observations. "<< std::endl;
+    std::cout << "---------" << std::endl;
+  }
+
+  for (auto &s : ring) {
+    enqueueSlot(s);
+  }
+
+  // Every slot that was handed out gets drained, bounded runs stop
+  // enqueueing once they are over
+  while (iters < enqueued) {
+    Slot &s = ring[iters % cfg.ringDepth];
+    iters++;
+
+    if (interactive && iters %100 == 0) {
+      printf("iteration %ld\n", iters);
+      if (cfg.reportBytes) {
+	printf("bytes moved so far: %ld\n", iters * (bytesUploaded + bytesReadBack));
+      }
+    }
+
+    if (failed(s.done.wait(), "clWaitForEvents")) {
+      break;
+    }
+    // A kernel that fails on the device leaves C as it was; its status is
+    // then the (negative) error code
+    cl_int status = s.launched.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+    if (failed(status < 0 ? status : CL_SUCCESS, "the kernel")) {
+      break;
+    }
+    int * C = s.C;
+
+    if (recorder) {
+      recorder->record(iters - 1, (const uint32_t *) C, size_int);
+    }
+
+    // Check the return values
+    if (interactive) {
+      observations.clear();
+      observations.addAll(C, size_int);
+      observations.printTop(10);
+      std::cout << "------------\nNext iteration starting" << std::endl;
+    }
+    else {
+      uint64_t hits = report.observations.count(cfg.canary);
+      report.observations.addAll(C, size_int);
+      if (report.observations.count(cfg.canary) != hits) {
+	report.canaryIterations++;
+	if (report.firstCanarySeconds < 0) {
+	  report.firstCanarySeconds = elapsed();
+	}
+      }
+      cl_ulong begin = s.launched.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      cl_ulong end = s.launched.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+      report.dispatchMicros.push_back((end - begin) / 1000.0);
+    }
+
+    // The histogram is done with this slot's data, hand it back to the device
+    enqueueSlot(s);
+  }
+
+  report.iterations = iters;
+  report.seconds = elapsed();
+  report.bytesScanned = (uint64_t) iters * size;
+  if (cfg.reportBytes) {
+    report.countsBytesMoved = true;
+    report.bytesUploaded = (uint64_t) iters * bytesUploaded;
+    report.bytesReadBack = (uint64_t) iters * bytesReadBack;
+  }
+  queue.finish();
+  if (recorder) {
+    recorder->close();
+    if (!recorder->ok()) {
+      report.error = "error writing " + cfg.recordPath;
+    }
+  }
+  for (auto &s : ring) {
+    free(s.A);
+    free(s.B);
+    free(s.C);
+  }
+}
+
+// Names the device and driver in the autotuner's profiles
+std::string profilePath(const Device &d) {
+  return leftoverlocals::Profile::path("opencl", d.getInfo<CL_DEVICE_NAME>() + "\n" +
+				       d.getInfo<CL_DEVICE_VENDOR>() + "\n" +
+				       d.getInfo<CL_DRIVER_VERSION>());
+}
+
+// Launch sizes given on the command line win over the device's profile
+ListenerConfig deviceConfig(const Device &d, ListenerConfig cfg, const cxxopts::ParseResult &result) {
+  leftoverlocals::Profile profile;
+  if (result.count("no-profile") || !profile.load(profilePath(d))) {
+    return cfg;
+  }
+  if (!result.count("workgroup-size")) {
+    cfg.workgroupSize = profile.workgroupSize;
+  }
+  if (!result.count("grid-size")) {
+    cfg.gridSize = profile.gridSize;
+  }
+  return cfg;
+}
+
+// Runs every (workgroup size, grid size) pair for a fixed time and saves
+// the one that samples the most local memory per second as the device's
+// profile.
+void autotune(Device d, const std::string &source, ListenerConfig cfg, double seconds) {
+  long localMem = cfg.localMem > 0 ? cfg.localMem : (long) d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  int maxWorkgroupSize = std::min<size_t>(1024, d.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+  // The kernel's own limit can be lower than the device's, e.g. because of
+  // its registers; larger workgroups fail to launch
+  Program program;
+  std::string buildLog;
+  if (leftoverlocals::DeviceCache::shared().program(d, source, buildOptions(localMem), program, buildLog, cfg.useCache) == CL_SUCCESS) {
+    size_t kernelMax = Kernel(program, "covertListener").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(d);
+    maxWorkgroupSize = std::min<size_t>(maxWorkgroupSize, kernelMax);
+  }
+  // Keep each dump within a single allocation
+  int maxGridSize = std::max<long>(1, std::min<long>(1024, d.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / std::max(1L, localMem)));
+
+  std::cout << "autotuning " << d.getInfo<CL_DEVICE_NAME>() << ", " << seconds << " s per configuration" << std::endl;
+  printf("%6s %6s %12s %14s\n", "wgs", "gs", "iterations", "MB/s sampled");
+
+  cfg.iterations = -1;
+  cfg.duration = seconds;
+  // Tuning runs are throwaway
+  cfg.recordPath.clear();
+  leftoverlocals::Profile best;
+  for (int wgs : leftoverlocals::powersOfTwo(32, maxWorkgroupSize)) {
+    for (int gs : leftoverlocals::powersOfTwo(1, maxGridSize)) {
+      cfg.workgroupSize = wgs;
+      cfg.gridSize = gs;
+      leftoverlocals::Report report;
+      listen(d, source, cfg, report);
+      if (!report.error.empty() || report.seconds <= 0) {
+	printf("%6d %6d %12s %14s\n", wgs, gs, "-", "failed");
+	continue;
+      }
+      double bytesPerSecond = report.bytesScanned / report.seconds;
+      printf("%6d %6d %12ld %14.1f\n", wgs, gs, report.iterations, bytesPerSecond / 1e6);
+      if (bytesPerSecond > best.bytesPerSecond) {
+	best.workgroupSize = wgs;
+	best.gridSize = gs;
+	best.bytesPerSecond = bytesPerSecond;
+      }
+    }
+  }
+
+  if (best.bytesPerSecond <= 0) {
+    std::cout << "no configuration ran" << std::endl;
+    return;
+  }
+  std::string path = profilePath(d);
+  printf("best: --workgroup-size %d --grid-size %d (%.1f MB/s)\n", best.workgroupSize, best.gridSize, best.bytesPerSecond / 1e6);
+  if (best.save(path)) {
+    std::cout << "saved profile to " << path << std::endl;
+  }
 }
 
 int main(int argc, char* argv[]) {
@@ -64,6 +407,19 @@ int main(int argc, char* argv[]) {
     ("wgs, workgroup-size", "Number of threads in the workgroup", cxxopts::value<int>()->default_value("256"))
     ("gs, grid-size", "Number of workgroups per grid", cxxopts::value<int>()->default_value("32"))
     ("d,device", "Device id (int)", cxxopts::value<int>()->default_value("0"))
+    ("r,ring", "Number of buffer sets kept in flight on the device", cxxopts::value<int>()->default_value("2"))
+    ("reset", "How buffers are reset before each launch: host (upload zeros), fill (device-side clear) or none", cxxopts::value<std::string>()->default_value("fill"))
+    ("report-bytes", "Report the bytes moved between host and device per iteration")
+    ("a,all-devices", "Scan every device of every platform in parallel, one worker per device, and print one report")
+    ("i,iterations", "Stop after this many iterations per device and print a JSON summary (default with --all-devices: 100)", cxxopts::value<long>())
+    ("duration", "Stop after this many seconds per device and print a JSON summary", cxxopts::value<double>())
+    ("c,canary", "Canary value counted in the summary", cxxopts::value<uint32_t>()->default_value("123"))
+    ("m,local-mem", "Bytes of local memory dumped per workgroup (default: all the device reports)", cxxopts::value<long>()->default_value("0"))
+    ("no-cache", "Always compile the kernel instead of loading it from the kernel cache")
+    ("autotune", "Benchmark workgroup and grid sizes on the device (every device with --all-devices) and save the fastest as its profile")
+    ("tune-seconds", "Seconds each configuration runs for when autotuning", cxxopts::value<double>()->default_value("0.5"))
+    ("no-profile", "Ignore the tuned profile and use the default workgroup and grid sizes")
+    ("record", "Write every dump to this file, compressed and indexed (one file per device with --all-devices, suffixed with the device id)", cxxopts::value<std::string>())
     ("h,help", "Print usage");
 
 
@@ -74,141 +430,115 @@ int main(int argc, char* argv[]) {
       exit(0);
   }
 
-  vector<Platform> platforms;
-  Platform::get(&platforms);
-
-  std::vector<cl::Device> all_devices;
-  int id = 0;
-
-  for (auto p: platforms) {
-    std::vector<Device> local_devices;
-    p.getDevices(CL_DEVICE_TYPE_ALL, &local_devices);
-    for (auto d: local_devices) {
-      all_devices.push_back(d);
-      id++;
-    }
-  }     
-
-  id = 0;
   if (result.count("list")) {
-    for (auto p: platforms) {
-      std::cout << "platform: " << p.getInfo<CL_PLATFORM_NAME>() << std::endl;
-      std::vector<Device> local_devices;
-      p.getDevices(CL_DEVICE_TYPE_ALL, &local_devices);
-      for (auto d: local_devices) {
-	std::cout << "  device " << id << ": " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
-	std::cout << "   local memory size: " << d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << " type: " << d.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() << std::endl;
-	all_devices.push_back(d);
-	id++;
-      }
-      std::cout << std::endl;
-      
-    }
-    
+    leftoverlocals::listDevices();
     exit(0);
   }
 
-  int deviceID = result["device"].as<int>();
-  Device d = all_devices[deviceID];
-
-  std::cout << "using device: " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
-
-  Context context({d});
-  Program::Sources sources;
-
-  std::ifstream t("covertCLListener.cl");
-  std::stringstream buffer;
-  buffer << t.rdbuf();
-
-  sources.push_back({buffer.str().c_str(),buffer.str().length()});
-
-  Program program(context,sources);
-  if(program.build({d})!=CL_SUCCESS){
-    std::cout<<" Error building: "<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(d)<<"\n";
+  std::vector<cl::Device> all_devices = leftoverlocals::allDevices();
+  const std::string &source = kernelSource;
+
+  ListenerConfig cfg;
+  cfg.gridSize = result["grid-size"].as<int>();
+  cfg.workgroupSize = result["workgroup-size"].as<int>();
+  cfg.ringDepth = std::max(1, result["ring"].as<int>());
+  cfg.reportBytes = result.count("report-bytes");
+  cfg.iterations = result.count("iterations") ? result["iterations"].as<long>() : -1;
+  cfg.duration = result.count("duration") ? result["duration"].as<double>() : 0;
+  cfg.canary = result["canary"].as<uint32_t>();
+  cfg.localMem = result["local-mem"].as<long>();
+  cfg.useCache = !result.count("no-cache");
+  cfg.recordPath = result.count("record") ? result["record"].as<std::string>() : "";
+
+  std::string resetArg = result["reset"].as<std::string>();
+  if (resetArg == "host") {
+    cfg.resetMode = RESET_HOST;
+  }
+  else if (resetArg == "fill") {
+    cfg.resetMode = RESET_FILL;
+  }
+  else if (resetArg == "none") {
+    cfg.resetMode = RESET_NONE;
+  }
+  else {
+    std::cout << "unknown reset mode: " << resetArg << std::endl;
     exit(1);
   }
 
-  int gridSize = result["grid-size"].as<int>();
-  int workgroupSize = result["workgroup-size"].as<int>();
-  int globalSize = gridSize*workgroupSize;
-  int size = MAX_SHMEM_SIZE * gridSize;
-  int size_int = size/4;
-
-  // create buffers on the device
-  Buffer buffer_A(context,CL_MEM_READ_WRITE,size);
-  Buffer buffer_B(context,CL_MEM_READ_WRITE,size);
-  Buffer buffer_C(context,CL_MEM_READ_WRITE,size);
-
-  int * A = (int*) malloc(size);
-  int * B = (int*) malloc(size);
-  int * C = (int*) malloc(size);
-
-  CommandQueue queue(context,d);
-
-  int iters = 0;
-
-  Kernel covertListener=cl::Kernel(program,"covertListener");
-  covertListener.setArg(0,buffer_A);
-  covertListener.setArg(1,buffer_B);
-  covertListener.setArg(2,buffer_C);
-
-  std::cout << "printing out a histogram of observations. "<< std::endl;
-  std::cout << "---------" << std::endl;
-  
-
-  while (1) {
-    iters++;
-
-    for (int i = 0; i < size_int; i++) {
-      A[i] = B[i] = C[i] = 0;
+  if (result.count("autotune")) {
+    std::vector<Device> devices(1, all_devices.at(result["device"].as<int>()));
+    if (result.count("all-devices")) {
+      devices = all_devices;
+    }
+    for (auto &d : devices) {
+      autotune(d, source, cfg, result["tune-seconds"].as<double>());
     }
+    exit(0);
+  }
 
-    if (iters %100 == 0)
-      printf("iteration %d\n", iters);
+  if (result.count("all-devices")) {
+    // Scanning is always bounded
+    if (cfg.iterations < 0 && cfg.duration <= 0) {
+      cfg.iterations = 100;
+    }
+    std::cout << "scanning " << all_devices.size() << " devices" << std::endl;
+
+    std::vector<leftoverlocals::Report> reports(all_devices.size());
+    std::vector<ListenerConfig> cfgs;
+    for (auto &d : all_devices) {
+      cfgs.push_back(deviceConfig(d, cfg, result));
+      if (!cfg.recordPath.empty()) {
+	cfgs.back().recordPath += "." + std::to_string(cfgs.size() - 1);
+      }
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < all_devices.size(); i++) {
+      workers.push_back(std::thread(listen, all_devices[i], std::cref(source), std::cref(cfgs[i]), std::ref(reports[i])));
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
 
-    queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, size, A);
-    queue.enqueueWriteBuffer(buffer_B, CL_TRUE, 0, size, B);
-    queue.enqueueWriteBuffer(buffer_C, CL_TRUE, 0, size, C);
+    leftoverlocals::Report all;
+    all.name = "all devices combined";
+    std::cout << "---------" << std::endl;
+    for (size_t i = 0; i < reports.size(); i++) {
+      std::cout << "device " << i << ": ";
+      reports[i].print();
+      std::cout << "------------" << std::endl;
+      all.merge(reports[i]);
+    }
+    all.print();
 
-    queue.enqueueNDRangeKernel(covertListener, 0, NDRange(globalSize),NDRange(workgroupSize));
-    queue.finish();
+    printf("{\n  \"devices\": [\n");
+    for (size_t i = 0; i < reports.size(); i++) {
+      reports[i].printJson(cfg.canary, stdout, "    ");
+      printf(i + 1 < reports.size() ? ",\n" : "\n");
+    }
+    printf("  ],\n  \"combined\":\n");
+    all.printJson(cfg.canary, stdout, "  ");
+    printf("\n}\n");
+    exit(0);
+  }
 
-    queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, size, C);
+  int deviceID = result["device"].as<int>();
+  Device d = all_devices[deviceID];
 
-    // Check the return values
-    std::unordered_map<int, int> observations;
-    //int nonZeros = 0;
-    for(int i = 0; i < SHARED_MEMORY_SIZE_TRAVERSED*result["grid-size"].as<int>(); i++) {
-      unsigned v = C[i];
-            
-      if (observations.find(v) == observations.end()) {
-	observations[v] = 1;
-      }
-      else {
-	observations[v]++;
-      }
-    }
+  // a bounded run leaves stdout to the JSON summary
+  bool interactive = cfg.iterations < 0 && cfg.duration <= 0;
+  std::ostream &info = interactive ? std::cout : std::cerr;
 
-    std::vector<std::pair<uint, uint> > keyValues;
-    
-    for (auto i : observations) {
-      keyValues.push_back(i);
-    }
+  info << "using device: " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
 
-    std::sort(keyValues.begin(), keyValues.end(), cmp);
+  cfg = deviceConfig(d, cfg, result);
+  info << "workgroup size: " << cfg.workgroupSize << ", grid size: " << cfg.gridSize << std::endl;
 
-    printf("top 10 observations:\n");
-    int obs = 0;
-    for (auto i : keyValues) {
-      if (obs < 10) {
-	std::cout << "(" << i.first << "," << i.second << ")" << std::endl;
-        obs++;
-      }
-      else {
-        break;
-      }
-    }
-    std::cout << "------------\nNext iteration starting" << std::endl;
+  leftoverlocals::Report report;
+  listen(d, source, cfg, report);
+  if (!report.error.empty()) {
+    std::cerr << " " << report.error << "\n";
+    exit(1);
   }
-  
+  report.printJson(cfg.canary);
+  printf("\n");
 }
@@ -22,7 +22,8 @@
 
 #define MAX_SHMEM_SIZE 65536
 
-#if !defined(SHARED_MEMORY_SIZE) 
+// The host passes the size of the device's local memory with -D
+#if !defined(SHARED_MEMORY_SIZE_INT) 
 #define SHARED_MEMORY_SIZE_INT (MAX_SHMEM_SIZE/4)
 #endif
 
@@ -24,27 +24,17 @@
 // For command line
 #include "cxxopts.hpp"
 
-// Should be in common.h but it doesn't like to compile for AMD
-// devices. 
-
-// common.h start
-
-#define MAX_SHMEM_SIZE 65536
-
-#if !defined(SHARED_MEMORY_SIZE) 
-#define SHARED_MEMORY_SIZE_INT (MAX_SHMEM_SIZE/4)
-#endif
-
-// In case we want to try out of bounds accesses
-#if !defined(SHARED_MEMORY_SIZE_TRAVERSED) 
-#define SHARED_MEMORY_SIZE_TRAVERSED (SHARED_MEMORY_SIZE_INT)
-#endif
-
-// common.h end
-
 #include <CL/opencl.hpp>
 using namespace cl;
 
+// Device enumeration and the per-process context and program cache
+#include <cldevices.h>
+
+// The kernel source, embedded by the Makefile
+const std::string kernelSource =
+#include "covertCLWriter.clh"
+  ;
+
 // for sorting the histogram
 bool cmp(std::pair<int, int> a,
 	 std::pair<int, int> b) {
@@ -64,6 +54,8 @@ int main(int argc, char* argv[]) {
     ("gs, grid-size", "Number of workgroups per grid", cxxopts::value<int>()->default_value("32"))
     ("d,device", "Device id (int)", cxxopts::value<int>()->default_value("0"))
     ("c,canary", "Canary value (int)", cxxopts::value<int>()->default_value("123"))
+    ("m,local-mem", "Bytes of local memory written per workgroup (default: all the device reports)", cxxopts::value<long>()->default_value("0"))
+    ("no-cache", "Always compile the kernel instead of loading it from the kernel cache")
     ("h,help", "Print usage");
   
   
@@ -74,62 +66,40 @@ int main(int argc, char* argv[]) {
     exit(0);
   }
 
-  vector<Platform> platforms;
-  Platform::get(&platforms);
-
-  std::vector<cl::Device> all_devices;
-  int id = 0;
-
-  for (auto p: platforms) {
-    std::vector<Device> local_devices;
-    p.getDevices(CL_DEVICE_TYPE_ALL, &local_devices);
-    for (auto d: local_devices) {
-      all_devices.push_back(d);
-      id++;
-    }
-  }     
-
-  id = 0;
   if (result.count("list")) {
-    for (auto p: platforms) {
-      std::cout << "platform: " << p.getInfo<CL_PLATFORM_NAME>() << std::endl;
-      std::vector<Device> local_devices;
-      p.getDevices(CL_DEVICE_TYPE_ALL, &local_devices);
-      for (auto d: local_devices) {
-	std::cout << "  device " << id << ": " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
-	std::cout << "   local memory size: " << d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << " type: " << d.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() << std::endl;
-	all_devices.push_back(d);
-	id++;
-      }
-      std::cout << std::endl;      
-    }    
+    leftoverlocals::listDevices();
     exit(0);
   }
 
+  std::vector<cl::Device> all_devices = leftoverlocals::allDevices();
+
   int deviceID = result["device"].as<int>();
   Device d = all_devices[deviceID];
 
   std::cout << "using device: " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
 
-  Context context({d});
-  Program::Sources sources;
-
-  std::ifstream t("covertCLWriter.cl");
-  std::stringstream buffer;
-  buffer << t.rdbuf();
+  leftoverlocals::DeviceCache &cache = leftoverlocals::DeviceCache::shared();
+  Context context = cache.context(d);
 
-  sources.push_back({buffer.str().c_str(),buffer.str().length()});
+  // The local array is sized when the kernel is built
+  long localMem = result["local-mem"].as<long>();
+  if (localMem <= 0) {
+    localMem = d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  }
+  int localInts = localMem / 4;
+  std::string buildOptions = "-DSHARED_MEMORY_SIZE_INT=" + std::to_string(localInts);
 
-  Program program(context,sources);
-  if(program.build({d})!=CL_SUCCESS){
-    std::cout<<" Error building: "<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(d)<<"\n";
+  Program program;
+  std::string buildLog;
+  if(cache.program(d, kernelSource, buildOptions, program, buildLog, !result.count("no-cache"))!=CL_SUCCESS){
+    std::cout<<" Error building: "<<buildLog<<"\n";
     exit(1);
   }
 
   int gridSize = result["grid-size"].as<int>();
   int workgroupSize = result["workgroup-size"].as<int>();
   int globalSize = gridSize*workgroupSize;
-  int size = MAX_SHMEM_SIZE * gridSize;
+  int size = localInts * 4 * gridSize;
   int size_float = size/4;
 
   // create buffers on the device
@@ -141,7 +111,7 @@ int main(int argc, char* argv[]) {
   int * B = (int*) malloc(size);
   int * C = (int*) malloc(size);
 
-  CommandQueue queue(context,d);
+  CommandQueue queue = cache.queue(d);
 
   string fname = "readValues";
   int iters = 0;
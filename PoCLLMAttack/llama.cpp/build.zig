@@ -15,6 +15,7 @@ pub fn build(b: *std.build.Builder) void {
     lib.addIncludePath("./examples");
     lib.addCSourceFiles(&.{
         "ggml.c",
+        "ggml-alloc.c",
     }, &.{"-std=c11"});
     lib.addCSourceFiles(&.{
         "llama.cpp",
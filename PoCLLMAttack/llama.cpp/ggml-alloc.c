@@ -0,0 +1,399 @@
+#include "ggml-alloc.h"
+#include "ggml.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+//#define GGML_ALLOCATOR_DEBUG
+
+#define MAX_FREE_BLOCKS 256
+
+// larger than the nodes and leafs of a graph together, and prime
+#define GGML_ALLOCR_HASH_SIZE 8273
+
+// the measure allocator places its tensors from here on, so that no tensor ends up at NULL
+#define GGML_ALLOCR_MEASURE_BASE 0x1000
+
+struct free_block {
+    size_t offset; // from the start of the buffer
+    size_t size;
+};
+
+// what the allocator knows about one tensor of the graph
+struct hash_node {
+    struct ggml_tensor * t;
+    int n_children; // nodes that read the tensor and have not been reached yet
+    int n_views;    // views of the tensor (or of its views) that are still read
+    bool owned;     // the tensor's data is in the buffer, rather than set by the user
+};
+
+struct ggml_allocr {
+    void * data;
+    size_t size;
+    size_t alignment;
+    int n_free_blocks;
+    struct free_block free_blocks[MAX_FREE_BLOCKS]; // sorted by address
+    struct hash_node hash_table[GGML_ALLOCR_HASH_SIZE];
+    size_t max_size;
+    bool measure;
+};
+
+static size_t aligned_offset(const void * buffer, size_t offset, size_t alignment) {
+    GGML_ASSERT(alignment && !(alignment & (alignment - 1))); // power of 2
+    const size_t align = (alignment - (((uintptr_t) buffer + offset) % alignment)) % alignment;
+    return offset + align;
+}
+
+static struct hash_node * hash_get(struct ggml_allocr * alloc, struct ggml_tensor * t) {
+    size_t i = (size_t)(uintptr_t) t % GGML_ALLOCR_HASH_SIZE;
+    while (alloc->hash_table[i].t != NULL && alloc->hash_table[i].t != t) {
+        i = (i + 1) % GGML_ALLOCR_HASH_SIZE;
+    }
+    alloc->hash_table[i].t = t;
+    return &alloc->hash_table[i];
+}
+
+static bool ggml_is_view(const struct ggml_tensor * t) {
+    return t->op == GGML_OP_RESHAPE || t->op == GGML_OP_VIEW || t->op == GGML_OP_TRANSPOSE ||
+           t->op == GGML_OP_PERMUTE || t->op == GGML_OP_CPY;
+}
+
+// the tensor whose data a view looks at; ggml_cpy returns a view of its destination
+static struct ggml_tensor * get_view_parent(struct ggml_tensor * t) {
+    return t->op == GGML_OP_CPY ? t->src1 : t->src0;
+}
+
+static struct ggml_tensor * get_view_source(struct ggml_tensor * t) {
+    struct ggml_tensor * parent = t;
+    do {
+        parent = get_view_parent(parent);
+    } while (ggml_is_view(parent));
+    return parent;
+}
+
+// the byte offset of a view in its parent, which ggml_view_* keep in opt[0]
+static size_t get_view_offset(const struct ggml_tensor * t) {
+    size_t offset = 0;
+    if (t->op == GGML_OP_VIEW) {
+        memcpy(&offset, t->opt[0]->data, 2*sizeof(int32_t));
+    }
+    return offset;
+}
+
+static bool ggml_are_same_layout(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->type != b->type) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        if (a->ne[i] != b->ne[i] || a->nb[i] != b->nb[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ops whose kernels read each element of their sources before they write it to the destination
+static bool ggml_op_can_inplace(enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_ABS:
+        case GGML_OP_SGN:
+        case GGML_OP_NEG:
+        case GGML_OP_STEP:
+        case GGML_OP_RELU:
+        case GGML_OP_GELU:
+        case GGML_OP_GELU_QUICK:
+        case GGML_OP_SILU:
+        case GGML_OP_SILU_MUL:
+        case GGML_OP_RMS_NORM_MUL:
+        case GGML_OP_SCALE:
+        case GGML_OP_DIAG_MASK_INF:
+        case GGML_OP_DIAG_MASK_ZERO:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// the measure buffer has a made-up address and graphs may run past the end of a buffer, so the
+// addresses cannot tell whose data a tensor has
+static bool ggml_allocr_is_own(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    return hash_get(alloc, tensor)->owned;
+}
+
+static size_t ggml_allocr_get_alloc_size(struct ggml_allocr * alloc, const struct ggml_tensor * tensor) {
+    return aligned_offset(NULL, ggml_nbytes(tensor), alloc->alignment);
+}
+
+// places the tensor in the smallest free block it fits in; the last block runs past the end of the
+// buffer, so this does not fail, and max_size tells whether the buffer was large enough
+static void ggml_allocr_alloc_impl(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    const size_t size = ggml_allocr_get_alloc_size(alloc, tensor);
+
+    int best_fit = alloc->n_free_blocks - 1;
+    for (int i = 0; i < alloc->n_free_blocks - 1; i++) {
+        const struct free_block * block = &alloc->free_blocks[i];
+        if (block->size >= size && block->size < alloc->free_blocks[best_fit].size) {
+            best_fit = i;
+        }
+    }
+
+    struct free_block * block = &alloc->free_blocks[best_fit];
+    const size_t offset = block->offset;
+    block->offset += size;
+    block->size   -= size;
+    if (block->size == 0) {
+        alloc->n_free_blocks--;
+        for (int j = best_fit; j < alloc->n_free_blocks; j++) {
+            alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+        }
+    }
+
+#ifdef GGML_ALLOCATOR_DEBUG
+    printf("%s: %s: %zu bytes at offset %zu\n", __func__, tensor->name, size, offset);
+#endif
+
+    tensor->data = (char *) alloc->data + offset;
+    hash_get(alloc, tensor)->owned = true;
+
+    alloc->max_size = MAX(alloc->max_size, offset + size);
+}
+
+void ggml_allocr_alloc(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    ggml_allocr_alloc_impl(alloc, tensor);
+
+    if (!alloc->measure && alloc->max_size > alloc->size) {
+        fprintf(stderr, "%s: not enough space in the buffer for %s (needed %zu, buffer size %zu)\n",
+                __func__, tensor->name, alloc->max_size, alloc->size);
+        GGML_ASSERT(!"not enough space in the buffer");
+    }
+}
+
+static void ggml_allocr_free_tensor(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    const size_t offset = (size_t)((char *) tensor->data - (char *) alloc->data);
+    const size_t size   = ggml_allocr_get_alloc_size(alloc, tensor);
+
+    hash_get(alloc, tensor)->owned = false;
+
+#ifdef GGML_ALLOCATOR_DEBUG
+    printf("%s: %s: %zu bytes at offset %zu\n", __func__, tensor->name, size, offset);
+#endif
+
+    // merge with the blocks right before and right after it, if any
+    int i = 0;
+    while (i < alloc->n_free_blocks && alloc->free_blocks[i].offset < offset) {
+        i++;
+    }
+
+    const bool merge_prev = i > 0 && alloc->free_blocks[i - 1].offset + alloc->free_blocks[i - 1].size == offset;
+    const bool merge_next = i < alloc->n_free_blocks && offset + size == alloc->free_blocks[i].offset;
+
+    if (merge_prev && merge_next) {
+        alloc->free_blocks[i - 1].size += size + alloc->free_blocks[i].size;
+        alloc->n_free_blocks--;
+        for (int j = i; j < alloc->n_free_blocks; j++) {
+            alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+        }
+    } else if (merge_prev) {
+        alloc->free_blocks[i - 1].size += size;
+    } else if (merge_next) {
+        alloc->free_blocks[i].offset  = offset;
+        alloc->free_blocks[i].size   += size;
+    } else {
+        GGML_ASSERT(alloc->n_free_blocks < MAX_FREE_BLOCKS && "too many free blocks");
+        for (int j = alloc->n_free_blocks; j > i; j--) {
+            alloc->free_blocks[j] = alloc->free_blocks[j - 1];
+        }
+        alloc->free_blocks[i].offset = offset;
+        alloc->free_blocks[i].size   = size;
+        alloc->n_free_blocks++;
+    }
+}
+
+void ggml_allocr_reset(struct ggml_allocr * alloc) {
+    alloc->n_free_blocks = 1;
+    alloc->free_blocks[0].offset = aligned_offset(alloc->data, 0, alloc->alignment);
+    alloc->free_blocks[0].size   = SIZE_MAX/2;
+    alloc->max_size = 0;
+    memset(alloc->hash_table, 0, sizeof(alloc->hash_table));
+}
+
+struct ggml_allocr * ggml_allocr_new(void * data, size_t size, size_t alignment) {
+    struct ggml_allocr * alloc = (struct ggml_allocr *) malloc(sizeof(struct ggml_allocr));
+    GGML_ASSERT(alloc != NULL);
+
+    *alloc = (struct ggml_allocr) {
+        /*.data          =*/ data,
+        /*.size          =*/ size,
+        /*.alignment     =*/ alignment,
+        /*.n_free_blocks =*/ 0,
+        /*.free_blocks   =*/ {{0}},
+        /*.hash_table    =*/ {{0}},
+        /*.max_size      =*/ 0,
+        /*.measure       =*/ false,
+    };
+
+    ggml_allocr_reset(alloc);
+
+    return alloc;
+}
+
+struct ggml_allocr * ggml_allocr_new_measure(size_t alignment) {
+    // an empty buffer at an address that is not NULL, of which only the size used is kept
+    struct ggml_allocr * alloc = ggml_allocr_new((void *) GGML_ALLOCR_MEASURE_BASE, 0, alignment);
+    alloc->measure = true;
+
+    return alloc;
+}
+
+void ggml_allocr_free(struct ggml_allocr * alloc) {
+    free(alloc);
+}
+
+bool ggml_allocr_is_measure(struct ggml_allocr * alloc) {
+    return alloc->measure;
+}
+
+// views are created with the data of their parent at the time, which has none in a no_alloc
+// context, so their data is worked out again once the parent has been placed
+static void ggml_allocr_init_view(struct ggml_tensor * view) {
+    struct ggml_tensor * parent = get_view_parent(view);
+    GGML_ASSERT(parent->data != NULL);
+    view->data = (char *) parent->data + get_view_offset(view);
+}
+
+static void allocate_node(struct ggml_allocr * alloc, struct ggml_tensor * node) {
+    if (ggml_is_view(node)) {
+        ggml_allocr_init_view(node);
+        return;
+    }
+
+    if (node->data != NULL) {
+        return;
+    }
+
+    // reuse the memory of a parent that only this node still reads
+    if (ggml_op_can_inplace(node->op)) {
+        struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int i = 0; i < GGML_MAX_OPT; i++) {
+            srcs[2 + i] = node->opt[i];
+        }
+
+        for (int i = 0; i < 2 + GGML_MAX_OPT; i++) {
+            struct ggml_tensor * parent = srcs[i];
+            if (parent == NULL || !ggml_are_same_layout(node, parent)) {
+                continue;
+            }
+
+            struct hash_node * p_hn = hash_get(alloc, parent);
+            if (p_hn->n_children != 1 || p_hn->n_views != 0) {
+                continue;
+            }
+
+            if (ggml_is_view(parent)) {
+                // a view covering all of its source, which nothing else looks at
+                struct ggml_tensor * view_src = get_view_source(parent);
+                struct hash_node * view_src_hn = hash_get(alloc, view_src);
+                if (view_src_hn->n_views == 1 && view_src_hn->n_children == 0 &&
+                    view_src->data == parent->data && ggml_allocr_is_own(alloc, view_src)) {
+                    node->data = parent->data;
+                    hash_get(alloc, node)->owned = true;
+                    return;
+                }
+            } else if (ggml_allocr_is_own(alloc, parent)) {
+                node->data = parent->data;
+                hash_get(alloc, node)->owned = true;
+                return;
+            }
+        }
+    }
+
+    ggml_allocr_alloc_impl(alloc, node);
+}
+
+size_t ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * graph) {
+    // count the children and the views of every tensor
+    for (int i = 0; i < graph->n_nodes; i++) {
+        struct ggml_tensor * node = graph->nodes[i];
+
+        if (ggml_is_view(node)) {
+            hash_get(alloc, get_view_source(node))->n_views += 1;
+        }
+
+        struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; j++) {
+            srcs[2 + j] = node->opt[j];
+        }
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (srcs[j] != NULL) {
+                hash_get(alloc, srcs[j])->n_children += 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < graph->n_nodes; i++) {
+        struct ggml_tensor * node = graph->nodes[i];
+
+        struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; j++) {
+            srcs[2 + j] = node->opt[j];
+        }
+
+        // leafs are placed when the first node that reads them is reached
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            struct ggml_tensor * parent = srcs[j];
+            if (parent != NULL && parent->data == NULL && parent->op == GGML_OP_NONE) {
+                allocate_node(alloc, parent);
+            }
+        }
+
+        allocate_node(alloc, node);
+
+        // give back the memory of the parents this node was the last to read
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            struct ggml_tensor * parent = srcs[j];
+            if (parent == NULL) {
+                continue;
+            }
+
+            struct hash_node * p_hn = hash_get(alloc, parent);
+            p_hn->n_children -= 1;
+
+            if (p_hn->n_children != 0 || p_hn->n_views != 0) {
+                continue;
+            }
+
+            if (ggml_is_view(parent)) {
+                struct ggml_tensor * view_src = get_view_source(parent);
+                struct hash_node * view_src_hn = hash_get(alloc, view_src);
+                view_src_hn->n_views -= 1;
+                if (view_src_hn->n_views == 0 && view_src_hn->n_children == 0 &&
+                    view_src->data != node->data && ggml_allocr_is_own(alloc, view_src)) {
+                    ggml_allocr_free_tensor(alloc, view_src);
+                }
+            } else if (parent->data != node->data && ggml_allocr_is_own(alloc, parent)) {
+                ggml_allocr_free_tensor(alloc, parent);
+            }
+        }
+    }
+
+    return alloc->max_size;
+}
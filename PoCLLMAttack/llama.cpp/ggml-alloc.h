@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ggml.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+// Places the tensors of a graph built in a no_alloc context in a single buffer.
+//
+// The graph is walked in the order it is computed: a tensor is given memory when the first node
+// that needs it is reached and gives it back once its last child and its last view have been
+// reached, so that later tensors reuse it. Ops that can run in place take over the memory of a
+// parent that nothing else reads anymore. Views, reshapes, permutes and copies get the data of
+// the tensor they look at. Tensors that already have data (weights, the KV cache, parameters
+// created with the scratch saved) are left alone and are never freed.
+//
+// A measure allocator does not touch memory: it places the tensors at made-up addresses and
+// returns the size of the buffer the graph needs, to size a real allocator with.
+
+struct ggml_allocr;
+
+GGML_API struct ggml_allocr * ggml_allocr_new(void * data, size_t size, size_t alignment);
+GGML_API struct ggml_allocr * ggml_allocr_new_measure(size_t alignment);
+
+GGML_API void   ggml_allocr_free      (struct ggml_allocr * alloc);
+GGML_API bool   ggml_allocr_is_measure(struct ggml_allocr * alloc);
+
+// forgets every tensor placed so far, the whole buffer is free again; needed before each graph
+GGML_API void   ggml_allocr_reset     (struct ggml_allocr * alloc);
+
+// places one tensor, e.g. a graph input that is written before the graph is allocated
+GGML_API void   ggml_allocr_alloc     (struct ggml_allocr * alloc, struct ggml_tensor * tensor);
+
+// places the tensors of the graph and returns the size of the buffer they need
+// a graph smaller than the one a buffer was measured with can still need more, as it fragments the
+// buffer differently: when the size returned is larger than the buffer, some tensors were placed past
+// its end and the graph has to be built again and placed in a larger buffer before it is computed
+GGML_API size_t ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * graph);
+
+#ifdef  __cplusplus
+}
+#endif
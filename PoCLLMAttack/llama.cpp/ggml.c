@@ -61,6 +61,14 @@ static LONG atomic_fetch_add(atomic_int* ptr, LONG inc) {
 static LONG atomic_fetch_sub(atomic_int* ptr, LONG dec) {
     return atomic_fetch_add(ptr, -(dec));
 }
+static bool atomic_compare_exchange_strong(atomic_int* ptr, int* expected, int desired) {
+    const LONG old = InterlockedCompareExchange(ptr, desired, *expected);
+    if (old == *expected) {
+        return true;
+    }
+    *expected = old;
+    return false;
+}
 
 typedef HANDLE pthread_t;
 
@@ -96,6 +104,11 @@ typedef void* thread_ret_t;
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #endif
 
 // __FMA__ and __F16C__ are not defined in MSVC, however they are implied with AVX2/AVX512
@@ -3461,6 +3474,38 @@ inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #endif
 }
 
+// y = (x*v)*w, the rows of ggml_rms_norm_mul
+inline static void ggml_vec_scale_mul_f32(const int n, float * y, const float * x, const float v, const float * w) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC vx = GGML_F32_VEC_SET1(v);
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+    GGML_F32_VEC aw[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR);
+            aw[j] = GGML_F32_VEC_LOAD(w + i + j*GGML_F32_EPR);
+            ax[j] = GGML_F32_VEC_MUL(GGML_F32_VEC_MUL(ax[j], vx), aw[j]);
+
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ax[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] = (x[i]*v)*w[i];
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        y[i] = (x[i]*v)*w[i];
+    }
+#endif
+}
+
 inline static void ggml_vec_norm_f32 (const int n, float * s, const float * x) { ggml_vec_dot_f32(n, s, x, x); *s = sqrtf(*s);   }
 inline static void ggml_vec_sqr_f32  (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = x[i]*x[i];   }
 inline static void ggml_vec_sqrt_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = sqrtf(x[i]); }
@@ -3561,6 +3606,24 @@ inline static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
 }
 #endif
 
+// y = silu(x)*g, the same silu as ggml_vec_silu_f32
+#ifdef GGML_SILU_FP16
+inline static void ggml_vec_silu_mul_f32(const int n, float * y, const float * x, const float * g) {
+    uint16_t t;
+    for (int i = 0; i < n; ++i) {
+        ggml_fp16_t fp16 = GGML_FP32_TO_FP16(x[i]);
+        memcpy(&t, &fp16, sizeof(uint16_t));
+        y[i] = GGML_FP16_TO_FP32(table_silu_f16[t])*g[i];
+    }
+}
+#else
+inline static void ggml_vec_silu_mul_f32(const int n, float * y, const float * x, const float * g) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = ggml_silu_f32(x[i])*g[i];
+    }
+}
+#endif
+
 inline static float ggml_silu_backward_f32(float x, float dy) {
     const float s = 1.0f/(1.0f + expf(-x));
     return dy*s*(1.0f + x*(1.0f - s));
@@ -3798,9 +3861,12 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
 
     "CROSS_ENTROPY_LOSS",
     "CROSS_ENTROPY_LOSS_BACK",
+
+    "RMS_NORM_MUL",
+    "SILU_MUL",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3876,9 +3942,12 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
 
     "cross_entropy_loss(x,y)",
     "cross_entropy_loss_back(x,y)",
+
+    "rms_norm(x)*y",
+    "silu(x)*y",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -6008,6 +6077,53 @@ struct ggml_tensor * ggml_rms_norm_back(
     return result;
 }
 
+// ggml_rms_norm_mul
+
+struct ggml_tensor * ggml_rms_norm_mul(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_can_repeat_rows(b, a));
+
+    if (a->grad || b->grad) {
+        // the fused op is for inference, the unfused ops have a backward pass
+        // ggml_mul has none for broadcasting, so b is repeated
+        return ggml_mul(ctx, ggml_rms_norm(ctx, a), ggml_are_same_shape(a, b) ? b : ggml_repeat(ctx, b, a));
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op   = GGML_OP_RMS_NORM_MUL;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
+// ggml_silu_mul
+
+struct ggml_tensor * ggml_silu_mul(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_are_same_shape(a, b));
+
+    if (a->grad || b->grad) {
+        // the fused op is for inference, the unfused ops have a backward pass
+        return ggml_mul(ctx, ggml_silu(ctx, a), b);
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op   = GGML_OP_SILU_MUL;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
 
 // ggml_mul_mat
 
@@ -10162,6 +10278,60 @@ static void ggml_compute_forward_silu(
     }
 }
 
+// ggml_compute_forward_silu_mul
+
+static void ggml_compute_forward_silu_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous(src0));
+    GGML_ASSERT(ggml_is_contiguous(src1));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        ggml_vec_silu_mul_f32(nc,
+                (float *) ((char *) dst->data  + i1*( dst->nb[1])),
+                (float *) ((char *) src0->data + i1*(src0->nb[1])),
+                (float *) ((char *) src1->data + i1*(src1->nb[1])));
+    }
+}
+
+static void ggml_compute_forward_silu_mul(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_silu_mul_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 
 // ggml_compute_forward_silu_back
 
@@ -10532,6 +10702,66 @@ static void ggml_compute_forward_rms_norm_back(
     }
 }
 
+// ggml_compute_forward_rms_norm_mul
+
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_can_repeat_rows(src1, src0) && ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS;
+
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT( nb0 == sizeof(float));
+
+    const float eps = 1e-6f; // same as ggml_compute_forward_rms_norm_f32
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                float sum;
+                ggml_vec_dot_f32(ne00, &sum, x, x);
+
+                const float scale = 1.0f/sqrtf(sum/ne00 + eps);
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                ggml_vec_scale_mul_f32(ne00, y, x, scale, w);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_rms_norm_mul(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 
 // ggml_compute_forward_mul_mat
 
@@ -11473,11 +11703,11 @@ static void ggml_compute_forward_diag_mask_f32(
     const int nth = params->nth;
 
     const int  n_past  =       ((int32_t *) src1->data)[0];
-    const bool inplace = (bool)((int32_t *) src1->data)[1];
 
     GGML_ASSERT(n_past >= 0);
 
-    if (!inplace && (params->type == GGML_TASK_INIT)) {
+    // an inplace mask may still have been given its own memory by ggml-alloc
+    if (dst->data != src0->data && (params->type == GGML_TASK_INIT)) {
         // memcpy needs to be synchronized across threads to avoid race conditions.
         // => do it in INIT phase
         GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
@@ -14730,6 +14960,14 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_rms_norm_back(params, tensor->src0, tensor->src1, tensor);
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_mul(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_SILU_MUL:
+            {
+                ggml_compute_forward_silu_mul(params, tensor->src0, tensor->src1, tensor);
+            } break;
         case GGML_OP_MUL_MAT:
             {
                 ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
@@ -15182,6 +15420,11 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+        case GGML_OP_SILU_MUL:
+            {
+                GGML_ASSERT(false); // never built with gradients, they are decomposed into the unfused ops
+            } break;
         case GGML_OP_MUL_MAT:
             {
                 // https://cs231n.github.io/optimization-2/#staged
@@ -15814,6 +16057,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_threads    =*/ GGML_DEFAULT_N_THREADS,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
+        /*.threadpool   =*/ NULL,
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
@@ -15983,507 +16227,1198 @@ void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); U
 void clear_numa_thread_affinity(void) {}
 #endif
 
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+#define ggml_spin_pause() _mm_pause()
+#else
+#define ggml_spin_pause()
+#endif
+
+//
+// graph scheduler
+//
+// with more than one thread a node starts as soon as the nodes it depends on are done, instead of
+// all threads stepping through the graph one node at a time, so that independent branches (the Q, K
+// and V projections, the two halves of the feed forward) run side by side and views cost nothing.
+//
+// a node depends on the earlier nodes it reads (src0, src1, opt) and on the earlier nodes whose
+// memory overlaps what it reads or writes: the src links alone do not show that the KV cache is
+// written through a view and read through another one, or that a scratch buffer is reused by the
+// next layer. only the last GGML_SCHED_WINDOW nodes are checked, and a node does not start before
+// every node older than that is done, which keeps building the graph linear in its size.
+//
+// ready work is split into (node, task) items on per thread Chase-Lev deques: a thread pops the
+// newest item of its own deque and idle threads steal the oldest items of the others
+//
+// the dependencies are kept in the plan and only worked out again for the nodes near one whose
+// sources, memory or work buffer slot changed, so a plan run once per token or per batch does not
+// rebuild them every time
+//
+
+#define GGML_SCHED_WINDOW     16           // at most 32, the successors of a node are a bit mask
+#define GGML_SCHED_MAX_SLOTS  8            // work buffer copies, so that nodes using it can overlap
+#define GGML_SCHED_SLOTS_SIZE (1024*1024)  // only split the work buffer when a slot is this small
+#define GGML_SCHED_START      0xffff       // task of the item that starts a node
+#define GGML_SCHED_EMPTY      -1
+
+struct ggml_sched_deque {
+    atomic_int top;
+    char       pad0[CACHE_LINE_SIZE - sizeof(atomic_int)];
+    atomic_int bottom;
+    char       pad1[CACHE_LINE_SIZE - sizeof(atomic_int)];
+
+    atomic_int * items;
+    int mask;
+};
+
+struct ggml_sched {
+    int n_nodes;
+    int n_threads;
+    int max_nodes; // room in the arrays below
+
+    // what the dependencies were worked out from, and the next graph's to compare with it
+    struct ggml_sched_access * access;
+    struct ggml_sched_access * access_next;
+    int8_t * work_slot;
+
+    uint32_t   * succ;      // bit d-1 is set if node i+d depends on node i
+    int        * n_deps;    // initial value of pending
+    atomic_int * pending;   // dependencies not done yet, +1 while nodes older than the window are running
+    atomic_int * remaining; // tasks not done yet
+    atomic_int * done;
+
+    int64_t * perf_start_cycles;
+    int64_t * perf_start_time_us;
+
+    atomic_int n_completed;
+    atomic_int prefix; // nodes before it are all done
+
+    struct ggml_sched_deque * deques;
+};
+
 struct ggml_compute_state_shared {
     struct ggml_cgraph * cgraph;
-
-    int64_t perf_node_start_cycles;
-    int64_t perf_node_start_time_us;
+    struct ggml_cplan  * cplan;
 
     int n_threads;
 
-    // synchronization primitives
-    atomic_int n_active; // num active threads
-    atomic_int node_n;   // active graph node
+    struct ggml_sched * sched; // NULL with a single thread
 };
 
 struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool;
 };
 
-static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
-    int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
-    int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
+static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, int64_t start_cycles, int64_t start_time_us) {
+    int64_t cycles_cur  = ggml_perf_cycles()  - start_cycles;
+    int64_t time_us_cur = ggml_perf_time_us() - start_time_us;
 
     node->perf_runs++;
     node->perf_cycles  += cycles_cur;
     node->perf_time_us += time_us_cur;
 }
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
-    struct ggml_cgraph * cgraph = state->shared->cgraph;
+static inline bool ggml_sched_is_nop(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
 
-    const int n_threads = state->shared->n_threads;
-    set_numa_thread_affinity(state->ith, n_threads);
+// nodes that may run on the GPU go one at a time, the GPU backends are not thread safe
+static bool ggml_sched_is_serial(struct ggml_tensor * node) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+    if (node->backend != GGML_BACKEND_CPU ||
+        (node->src0 != NULL && node->src0->backend != GGML_BACKEND_CPU) ||
+        (node->src1 != NULL && node->src1->backend != GGML_BACKEND_CPU)) {
+        return true;
+    }
+    if (node->op == GGML_OP_MUL_MAT) {
+#if defined(GGML_USE_CUBLAS)
+        return ggml_cuda_can_mul_mat(node->src0, node->src1, node);
+#else
+        return ggml_cl_can_mul_mat(node->src0, node->src1, node);
+#endif
+    }
+#else
+    UNUSED(node);
+#endif
+    return false;
+}
 
-    int node_n = -1;
+// the bytes a tensor covers, following its strides; ggml_nbytes is wrong for permuted views
+static void ggml_sched_range(const struct ggml_tensor * t, const char ** begin, const char ** end) {
+    *begin = *end = NULL;
+    if (t == NULL || t->data == NULL || ggml_nelements(t) == 0) {
+        return;
+    }
 
-    while (true) {
-        if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
-            // all other threads are finished and spinning
-            // do finalize and init here so we don't have synchronize again
-            struct ggml_compute_params params = {
-                /*.type  =*/ GGML_TASK_FINALIZE,
-                /*.ith   =*/ 0,
-                /*.nth   =*/ 0,
-                /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
-            };
+    size_t size = GGML_TYPE_SIZE[t->type] + (t->ne[0]/GGML_BLCK_SIZE[t->type] - 1)*t->nb[0];
+    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+        size += (t->ne[i] - 1)*t->nb[i];
+    }
 
-            if (node_n != -1) {
-                /* FINALIZE */
-                struct ggml_tensor * node = state->shared->cgraph->nodes[node_n];
-                if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = node->n_tasks;
-                    ggml_compute_forward(&params, node);
-                    ggml_graph_compute_perf_stats_node(node, state->shared);
-                }
-            }
+    *begin = (const char *) t->data;
+    *end   = *begin + size;
+}
 
-            // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
-                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
+struct ggml_sched_access {
+    const struct ggml_tensor * node;
+    const struct ggml_tensor * src[2 + GGML_MAX_OPT];
+    const char * write[2];
+    const char * read[2 + GGML_MAX_OPT][2];
+    bool serial;
+};
 
-                struct ggml_tensor * node = cgraph->nodes[node_n];
+static inline bool ggml_sched_overlap(const char * const a[2], const char * const b[2]) {
+    return a[0] != NULL && b[0] != NULL && a[0] < b[1] && b[0] < a[1];
+}
 
-                state->shared->perf_node_start_cycles  = ggml_perf_cycles();
-                state->shared->perf_node_start_time_us = ggml_perf_time_us();
+static bool ggml_sched_depends(const struct ggml_sched_access * access, const int8_t * slot, int i, int j) {
+    if (access[i].serial || access[j].serial) {
+        return true;
+    }
+    for (int k = 0; k < 2 + GGML_MAX_OPT; k++) {
+        if (access[j].src[k] == access[i].node) {
+            return true;
+        }
+    }
+    if (slot[i] >= 0 && slot[i] == slot[j]) {
+        return true;
+    }
 
-                params.nth = node->n_tasks;
+    // write after write, read after write, write after read
+    if (ggml_sched_overlap(access[j].write, access[i].write)) {
+        return true;
+    }
+    for (int k = 0; k < 2 + GGML_MAX_OPT; k++) {
+        if (ggml_sched_overlap(access[j].read[k], access[i].write) ||
+            ggml_sched_overlap(access[j].write,   access[i].read[k])) {
+            return true;
+        }
+    }
 
-                /* INIT */
-                if (GGML_OP_HAS_INIT[node->op]) {
-                    params.type = GGML_TASK_INIT;
-                    ggml_compute_forward(&params, node);
-                }
+    return false;
+}
 
-                if (node->n_tasks == 1) {
-                    // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
-                    // they do something more efficient than spinning (?)
-                    params.type = GGML_TASK_COMPUTE;
-                    ggml_compute_forward(&params, node);
+static void ggml_sched_push(struct ggml_sched_deque * q, int item) {
+    const int b = atomic_load(&q->bottom);
+    atomic_store(&q->items[b & q->mask], item);
+    atomic_store(&q->bottom, b + 1);
+}
 
-                    if (GGML_OP_HAS_FINALIZE[node->op]) {
-                        params.type = GGML_TASK_FINALIZE;
-                        ggml_compute_forward(&params, node);
-                        ggml_graph_compute_perf_stats_node(node, state->shared);
-                    }
-                } else {
-                    break;
-                }
-            }
+// the owner's end of the deque
+static int ggml_sched_pop(struct ggml_sched_deque * q) {
+    const int b = atomic_load(&q->bottom) - 1;
+    atomic_store(&q->bottom, b);
+    int t = atomic_load(&q->top);
 
-            atomic_store(&state->shared->n_active, n_threads);
-            atomic_store(&state->shared->node_n,   node_n);
-        } else {
-            // wait for other threads to finish
-            const int last = node_n;
-            do {
+    if (t > b) {
+        atomic_store(&q->bottom, b + 1);
+        return GGML_SCHED_EMPTY;
+    }
+
+    int item = atomic_load(&q->items[b & q->mask]);
+    if (t == b) {
+        // last item, race the thieves for it
+        if (!atomic_compare_exchange_strong(&q->top, &t, t + 1)) {
+            item = GGML_SCHED_EMPTY;
+        }
+        atomic_store(&q->bottom, b + 1);
+    }
+    return item;
+}
+
+static int ggml_sched_steal(struct ggml_sched_deque * q) {
+    int t = atomic_load(&q->top);
+    const int b = atomic_load(&q->bottom);
+
+    if (t >= b) {
+        return GGML_SCHED_EMPTY;
+    }
+
+    const int item = atomic_load(&q->items[t & q->mask]);
+    if (!atomic_compare_exchange_strong(&q->top, &t, t + 1)) {
+        return GGML_SCHED_EMPTY;
+    }
+    return item;
+}
+
+static struct ggml_sched * ggml_sched_new(int max_nodes, int n_threads) {
+    GGML_ASSERT(n_threads < GGML_SCHED_START);
+
+    struct ggml_sched * sched = malloc(sizeof(struct ggml_sched));
+    GGML_ASSERT(sched != NULL);
+
+    sched->n_nodes            = 0;
+    sched->n_threads          = n_threads;
+    sched->max_nodes          = max_nodes;
+    sched->access             = malloc(sizeof(struct ggml_sched_access)*max_nodes);
+    sched->access_next        = malloc(sizeof(struct ggml_sched_access)*max_nodes);
+    sched->work_slot          = malloc(sizeof(int8_t)*max_nodes);
+    sched->succ               = malloc(sizeof(uint32_t)*max_nodes);
+    sched->n_deps             = malloc(sizeof(int)*max_nodes);
+    sched->pending            = malloc(sizeof(atomic_int)*max_nodes);
+    sched->remaining          = malloc(sizeof(atomic_int)*max_nodes);
+    sched->done               = malloc(sizeof(atomic_int)*max_nodes);
+    sched->perf_start_cycles  = malloc(sizeof(int64_t)*max_nodes);
+    sched->perf_start_time_us = malloc(sizeof(int64_t)*max_nodes);
+    sched->deques             = malloc(sizeof(struct ggml_sched_deque)*n_threads);
+
+    GGML_ASSERT(sched->access != NULL && sched->access_next != NULL && sched->work_slot != NULL &&
+                sched->succ != NULL && sched->n_deps != NULL && sched->pending != NULL && sched->remaining != NULL &&
+                sched->done != NULL && sched->perf_start_cycles != NULL && sched->perf_start_time_us != NULL &&
+                sched->deques != NULL);
+
+    // at most GGML_SCHED_WINDOW + 1 nodes are started and not done, and each queues less than one
+    // item per thread
+    int capacity = 2;
+    while (capacity < (GGML_SCHED_WINDOW + 1)*(n_threads + 1)) {
+        capacity *= 2;
+    }
+    for (int j = 0; j < n_threads; j++) {
+        struct ggml_sched_deque * q = &sched->deques[j];
+        q->items = malloc(sizeof(atomic_int)*capacity);
+        q->mask  = capacity - 1;
+        GGML_ASSERT(q->items != NULL);
+    }
+
+    return sched;
+}
+
+static void ggml_sched_free(struct ggml_sched * sched) {
+    for (int j = 0; j < sched->n_threads; j++) {
+        free(sched->deques[j].items);
+    }
+    free(sched->deques);
+    free(sched->perf_start_time_us);
+    free(sched->perf_start_cycles);
+    free(sched->done);
+    free(sched->remaining);
+    free(sched->pending);
+    free(sched->n_deps);
+    free(sched->succ);
+    free(sched->work_slot);
+    free(sched->access_next);
+    free(sched->access);
+    free(sched);
+}
+
+// works out the dependencies again where the graph is not the one they were worked out for, then
+// gets the scheduler ready to run it
+static void ggml_sched_prepare(struct ggml_sched * sched, const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan) {
+    const int n_nodes   = cgraph->n_nodes;
+    const int n_threads = sched->n_threads;
+
+    GGML_ASSERT(n_nodes <= sched->max_nodes);
+
+    // zeroed first so that the padding compares equal too
+    struct ggml_sched_access * access = sched->access_next;
+    memset(access, 0, sizeof(struct ggml_sched_access)*n_nodes);
+
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        struct ggml_sched_access * a = &access[i];
+
+        a->node   = node;
+        a->src[0] = node->src0;
+        a->src[1] = node->src1;
+        for (int k = 0; k < GGML_MAX_OPT; k++) {
+            a->src[2 + k] = node->opt[k];
+        }
+        a->serial = ggml_sched_is_serial(node);
+
+        // a view reads and writes nothing, but the nodes using it still depend on its sources through it
+        if (!ggml_sched_is_nop(node->op)) {
+            ggml_sched_range(node,       &a->write[0],   &a->write[1]);
+            ggml_sched_range(node->src0, &a->read[0][0], &a->read[0][1]);
+            ggml_sched_range(node->src1, &a->read[1][0], &a->read[1][1]);
+            for (int k = 0; k < GGML_MAX_OPT; k++) {
+                ggml_sched_range(node->opt[k], &a->read[2 + k][0], &a->read[2 + k][1]);
+            }
+        }
+    }
+
+    // a node is checked again if it or one of the nodes it is checked against has changed
+    const bool same_nodes = n_nodes == sched->n_nodes;
+    if (!same_nodes) {
+        memset(sched->succ, 0, sizeof(uint32_t)*n_nodes);
+    }
+
+    int last_changed = -GGML_SCHED_WINDOW - 1;
+    for (int j = 0; j < n_nodes; j++) {
+        if (!same_nodes || cplan->work_slot[j] != sched->work_slot[j] ||
+            memcmp(&access[j], &sched->access[j], sizeof(struct ggml_sched_access)) != 0) {
+            last_changed = j;
+        }
+        if (j - last_changed > GGML_SCHED_WINDOW) {
+            continue;
+        }
+
+        // the window token, given back once the nodes older than the window are done
+        int n_deps = j > GGML_SCHED_WINDOW ? 1 : 0;
+        for (int i = MAX(0, j - GGML_SCHED_WINDOW); i < j; i++) {
+            const uint32_t bit = 1u << (j - i - 1);
+            if (ggml_sched_depends(access, cplan->work_slot, i, j)) {
+                sched->succ[i] |= bit;
+                n_deps++;
+            } else {
+                sched->succ[i] &= ~bit;
+            }
+        }
+        sched->n_deps[j] = n_deps;
+    }
+
+    sched->access_next = sched->access;
+    sched->access      = access;
+    sched->n_nodes     = n_nodes;
+    memcpy(sched->work_slot, cplan->work_slot, sizeof(int8_t)*n_nodes);
+
+    atomic_store(&sched->n_completed, 0);
+    atomic_store(&sched->prefix,      0);
+
+    for (int j = 0; j < n_nodes; j++) {
+        atomic_store(&sched->pending[j],   sched->n_deps[j]);
+        atomic_store(&sched->remaining[j], 0);
+        atomic_store(&sched->done[j],      0);
+    }
+
+    for (int j = 0; j < n_threads; j++) {
+        atomic_store(&sched->deques[j].top,    0);
+        atomic_store(&sched->deques[j].bottom, 0);
+    }
+
+    // spread the nodes that are ready from the start over the threads
+    int n_ready = 0;
+    for (int j = 0; j < n_nodes; j++) {
+        if (sched->n_deps[j] == 0) {
+            ggml_sched_push(&sched->deques[n_ready++ % n_threads], (j << 16) | GGML_SCHED_START);
+        }
+    }
+}
+
+static inline void ggml_sched_release(struct ggml_sched * sched, int ith, int j) {
+    if (atomic_fetch_sub(&sched->pending[j], 1) == 1) {
+        ggml_sched_push(&sched->deques[ith], (j << 16) | GGML_SCHED_START);
+    }
+}
+
+static void ggml_sched_complete(struct ggml_compute_state_shared * shared, int ith, int j) {
+    struct ggml_sched * sched = shared->sched;
+
+    ggml_graph_compute_perf_stats_node(shared->cgraph->nodes[j], sched->perf_start_cycles[j], sched->perf_start_time_us[j]);
+
+    for (int d = 1; d <= GGML_SCHED_WINDOW; d++) {
+        if (sched->succ[j] & (1u << (d - 1))) {
+            ggml_sched_release(sched, ith, j + d);
+        }
+    }
+
+    atomic_store(&sched->done[j], 1);
+
+    // move the prefix past the nodes that are done and hand the next nodes their window token
+    while (true) {
+        int p = atomic_load(&sched->prefix);
+        if (p >= sched->n_nodes || !atomic_load(&sched->done[p])) {
+            break;
+        }
+        if (atomic_compare_exchange_strong(&sched->prefix, &p, p + 1) && p + 1 + GGML_SCHED_WINDOW < sched->n_nodes) {
+            ggml_sched_release(sched, ith, p + 1 + GGML_SCHED_WINDOW);
+        }
+    }
+
+    atomic_fetch_add(&sched->n_completed, 1);
+}
+
+static inline struct ggml_compute_params ggml_sched_params(const struct ggml_compute_state_shared * shared, int j, enum ggml_task_type type, int ith) {
+    const struct ggml_cplan * cplan = shared->cplan;
+    const int slot = cplan->work_slot[j];
+
+    struct ggml_compute_params params = {
+        /*.type  =*/ type,
+        /*.ith   =*/ ith,
+        /*.nth   =*/ cplan->n_tasks[j],
+        /*.wsize =*/ slot >= 0 ? cplan->work_slot_size : 0,
+        /*.wdata =*/ slot >= 0 ? cplan->work_data + slot*cplan->work_slot_size : NULL,
+    };
+
+    return params;
+}
+
+// called by the last task of a node
+static void ggml_sched_finish(struct ggml_compute_state_shared * shared, int ith, int j) {
+    struct ggml_tensor * node = shared->cgraph->nodes[j];
+
+    if (GGML_OP_HAS_FINALIZE[node->op]) {
+        struct ggml_compute_params params = ggml_sched_params(shared, j, GGML_TASK_FINALIZE, 0);
+        ggml_compute_forward(&params, node);
+    }
+
+    ggml_sched_complete(shared, ith, j);
+}
+
+static void ggml_sched_run_task(struct ggml_compute_state_shared * shared, int ith, int j, int task) {
+    struct ggml_compute_params params = ggml_sched_params(shared, j, GGML_TASK_COMPUTE, task);
+    ggml_compute_forward(&params, shared->cgraph->nodes[j]);
+
+    if (atomic_fetch_sub(&shared->sched->remaining[j], 1) == 1) {
+        ggml_sched_finish(shared, ith, j);
+    }
+}
+
+static void ggml_sched_start(struct ggml_compute_state_shared * shared, int ith, int j) {
+    struct ggml_sched * sched = shared->sched;
+    struct ggml_tensor * node = shared->cgraph->nodes[j];
+
+    sched->perf_start_cycles[j]  = ggml_perf_cycles();
+    sched->perf_start_time_us[j] = ggml_perf_time_us();
+
+    if (ggml_sched_is_nop(node->op)) {
+        ggml_sched_complete(shared, ith, j);
+        return;
+    }
+
+    if (GGML_OP_HAS_INIT[node->op]) {
+        struct ggml_compute_params params = ggml_sched_params(shared, j, GGML_TASK_INIT, 0);
+        ggml_compute_forward(&params, node);
+    }
+
+    // queue the other tasks for the idle threads and run the first one here
+    const int n_tasks = shared->cplan->n_tasks[j];
+
+    atomic_store(&sched->remaining[j], n_tasks);
+    for (int task = n_tasks - 1; task > 0; task--) {
+        ggml_sched_push(&sched->deques[ith], (j << 16) | task);
+    }
+
+    ggml_sched_run_task(shared, ith, j, 0);
+}
+
+static void ggml_sched_run(struct ggml_compute_state_shared * shared, int ith) {
+    struct ggml_sched * sched = shared->sched;
+    const int n_threads = sched->n_threads;
+
+    int idle = 0;
+
+    while (atomic_load(&sched->n_completed) < sched->n_nodes) {
+        int item = ggml_sched_pop(&sched->deques[ith]);
+        for (int k = 1; item == GGML_SCHED_EMPTY && k < n_threads; k++) {
+            item = ggml_sched_steal(&sched->deques[(ith + k) % n_threads]);
+        }
+
+        if (item == GGML_SCHED_EMPTY) {
+            // give way in case there are more threads than cores
+            if (++idle > 16) {
                 sched_yield();
-                node_n = atomic_load(&state->shared->node_n);
-            } while (node_n == last);
+            } else {
+                ggml_spin_pause();
+            }
+            continue;
+        }
+        idle = 0;
+
+        const int j    = item >> 16;
+        const int task = item & 0xffff;
+
+        if (task == GGML_SCHED_START) {
+            ggml_sched_start(shared, ith, j);
+        } else {
+            ggml_sched_run_task(shared, ith, j, task);
         }
+    }
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_cgraph * cgraph = state->shared->cgraph;
+    struct ggml_cplan  * cplan  = state->shared->cplan;
+
+    const int n_threads = state->shared->n_threads;
+    set_numa_thread_affinity(state->ith, n_threads);
+
+    if (state->shared->sched != NULL) {
+        ggml_sched_run(state->shared, state->ith);
+        return 0;
+    }
+
+    // a single thread runs the nodes in order
+    struct ggml_compute_params params = {
+        /*.type  =*/ GGML_TASK_INIT,
+        /*.ith   =*/ 0,
+        /*.nth   =*/ 1,
+        /*.wsize =*/ cplan->work_size,
+        /*.wdata =*/ cplan->work_data,
+    };
 
-        // check if we should stop
-        if (node_n >= cgraph->n_nodes) break;
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
+        GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
 
-        /* COMPUTE */
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_COMPUTE,
-            /*.ith   =*/ state->ith,
-            /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
-        };
+        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
+        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+
+        params.nth = cplan->n_tasks[node_n];
 
-        if (state->ith < node->n_tasks) {
+        if (GGML_OP_HAS_INIT[node->op]) {
+            params.type = GGML_TASK_INIT;
             ggml_compute_forward(&params, node);
         }
+
+        params.type = GGML_TASK_COMPUTE;
+        ggml_compute_forward(&params, node);
+
+        if (GGML_OP_HAS_FINALIZE[node->op]) {
+            params.type = GGML_TASK_FINALIZE;
+            ggml_compute_forward(&params, node);
+        }
+
+        ggml_graph_compute_perf_stats_node(node, perf_node_start_cycles, perf_node_start_time_us);
     }
 
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
+//
+// thread pool
+//
+// the workers wait for the generation counter to change, which means that a new graph is ready in
+// pool->shared. they spin on it first, since llama_eval calls ggml_graph_compute back to back, and
+// then go to sleep on a futex (a condition variable where there are no futexes)
+//
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.cgraph                  =*/ cgraph,
-        /*.perf_node_start_cycles  =*/ 0,
-        /*.perf_node_start_time_us =*/ 0,
-        /*.n_threads               =*/ n_threads,
-        /*.n_active                =*/ n_threads,
-        /*.node_n                  =*/ -1,
-    };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+#define GGML_THREADPOOL_SPIN 16384
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
+struct ggml_threadpool {
+    int n_threads;
 
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
+    struct ggml_compute_state * workers; // workers[0] stands for the calling thread
 
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = n_threads;
+    struct ggml_compute_state_shared * shared; // the graph being computed
 
-                        size_t cur = 0;
-                        if (ggml_is_quantized(node->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
-                        }
+    atomic_int generation; // bumped for every graph
+    atomic_int n_done;     // workers done with the current graph
+    atomic_int stop;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ADD:
-                case GGML_OP_ADD1:
-                    {
-                        node->n_tasks = n_threads;
+#if defined(_WIN32)
+    SRWLOCK            lock;
+    CONDITION_VARIABLE cond;
+#elif !defined(__linux__)
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+#endif
+};
 
-                        size_t cur = 0;
+static int ggml_threadpool_wait(struct ggml_threadpool * pool, int last) {
+    int generation;
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
-                        }
+    for (int i = 0; i < GGML_THREADPOOL_SPIN; i++) {
+        generation = atomic_load(&pool->generation);
+        if (generation != last) {
+            return generation;
+        }
+        // give way now and then in case there are more threads than cores
+        if (i % 64 == 63) {
+            sched_yield();
+        } else {
+            ggml_spin_pause();
+        }
+    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ACC:
-                    {
-                        node->n_tasks = n_threads;
+#if defined(__linux__)
+    while ((generation = atomic_load(&pool->generation)) == last) {
+        syscall(SYS_futex, (int *) (uintptr_t) &pool->generation, FUTEX_WAIT_PRIVATE, last, NULL, NULL, 0);
+    }
+#elif defined(_WIN32)
+    AcquireSRWLockExclusive(&pool->lock);
+    while ((generation = atomic_load(&pool->generation)) == last) {
+        SleepConditionVariableSRW(&pool->cond, &pool->lock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&pool->lock);
+#else
+    pthread_mutex_lock(&pool->lock);
+    while ((generation = atomic_load(&pool->generation)) == last) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+#endif
 
-                        size_t cur = 0;
+    return generation;
+}
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
-                        }
+static void ggml_threadpool_notify(struct ggml_threadpool * pool) {
+#if defined(__linux__)
+    atomic_fetch_add(&pool->generation, 1);
+    syscall(SYS_futex, (int *) (uintptr_t) &pool->generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#elif defined(_WIN32)
+    AcquireSRWLockExclusive(&pool->lock);
+    atomic_fetch_add(&pool->generation, 1);
+    ReleaseSRWLockExclusive(&pool->lock);
+    WakeAllConditionVariable(&pool->cond);
+#else
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->generation, 1);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_cond_broadcast(&pool->cond);
+#endif
+}
+
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * pool = state->pool;
+
+    int generation = 0;
+
+    while (true) {
+        generation = ggml_threadpool_wait(pool, generation);
+        if (atomic_load(&pool->stop)) {
+            break;
+        }
+
+        // workers beyond the graph's thread count sit this one out
+        if (state->ith < pool->shared->n_threads) {
+            state->shared = pool->shared;
+            ggml_graph_compute_thread(state);
+        }
+
+        atomic_fetch_add(&pool->n_done, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0);
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_LOG:
-                case GGML_OP_SUM:
-                case GGML_OP_SUM_ROWS:
-                case GGML_OP_MEAN:
-                case GGML_OP_ARGMAX:
-                case GGML_OP_REPEAT:
-                case GGML_OP_REPEAT_BACK:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_TANH:
-                case GGML_OP_ELU:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_MUL:
-                case GGML_OP_GELU:
-                case GGML_OP_GELU_QUICK:
-                case GGML_OP_SILU:
-                case GGML_OP_SILU_BACK:
-                case GGML_OP_NORM:
-                case GGML_OP_RMS_NORM:
-                case GGML_OP_RMS_NORM_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                case GGML_OP_OUT_PROD:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
-                        const enum ggml_type vec_dot_type = type_traits[node->src0->type].vec_dot_type;
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool != NULL);
+
+    pool->n_threads = n_threads;
+    pool->workers   = malloc(sizeof(struct ggml_compute_state)*n_threads);
+    pool->shared    = NULL;
+    GGML_ASSERT(pool->workers != NULL);
+
+    atomic_store(&pool->generation, 0);
+    atomic_store(&pool->n_done,     0);
+    atomic_store(&pool->stop,       0);
+
+#if defined(_WIN32)
+    InitializeSRWLock(&pool->lock);
+    InitializeConditionVariable(&pool->cond);
+#elif !defined(__linux__)
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+#endif
+
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .ith    = j,
+            .shared = NULL,
+            .pool   = pool,
+        };
+
+        if (j > 0) {
+            const int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+            GGML_ASSERT(rc == 0);
+        }
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    atomic_store(&pool->stop, 1);
+    ggml_threadpool_notify(pool);
+
+    for (int j = 1; j < pool->n_threads; j++) {
+        const int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+    }
+
+#if !defined(_WIN32) && !defined(__linux__)
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+#endif
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+
+    struct ggml_cplan cplan;
+    memset(&cplan, 0, sizeof(struct ggml_cplan));
+
+    cplan.n_threads  = n_threads;
+    cplan.threadpool = cgraph->threadpool;
+
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        int    n_tasks   = 0;
+        size_t node_work = 0;
+
+        switch (node->op) {
+            case GGML_OP_CPY:
+            case GGML_OP_DUP:
+                {
+                    n_tasks = n_threads;
+
+                    size_t cur = 0;
+                    if (ggml_is_quantized(node->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
+                    }
+
+                    node_work = cur;
+                } break;
+            case GGML_OP_ADD:
+            case GGML_OP_ADD1:
+                {
+                    n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (ggml_is_quantized(node->src0->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
+                    }
+
+                    node_work = cur;
+                } break;
+            case GGML_OP_ACC:
+                {
+                    n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (ggml_is_quantized(node->src0->type)) {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
+                    }
+
+                    node_work = cur;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_LOG:
+            case GGML_OP_SUM:
+            case GGML_OP_SUM_ROWS:
+            case GGML_OP_MEAN:
+            case GGML_OP_ARGMAX:
+            case GGML_OP_REPEAT:
+            case GGML_OP_REPEAT_BACK:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_TANH:
+            case GGML_OP_ELU:
+            case GGML_OP_RELU:
+                {
+                    n_tasks = 1;
+                } break;
+            case GGML_OP_MUL:
+            case GGML_OP_GELU:
+            case GGML_OP_GELU_QUICK:
+            case GGML_OP_SILU:
+            case GGML_OP_SILU_BACK:
+            case GGML_OP_NORM:
+            case GGML_OP_RMS_NORM:
+            case GGML_OP_RMS_NORM_BACK:
+            case GGML_OP_RMS_NORM_MUL:
+            case GGML_OP_SILU_MUL:
+                {
+                    n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+            case GGML_OP_OUT_PROD:
+                {
+                    n_tasks = n_threads;
+
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
+
+                    //n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, n_tasks);
+
+                    size_t cur = 0;
+                    const enum ggml_type vec_dot_type = type_traits[node->src0->type].vec_dot_type;
 
 #if defined(GGML_USE_CUBLAS)
-                        if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                        }
-                        else
+                    if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
+                        n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                    }
+                    else
 #elif defined(GGML_USE_CLBLAST)
-                        if (ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                            cur = ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
-                        }
-                        else
+                    if (ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
+                        n_tasks = 1; // TODO: this actually is doing nothing
+                                            //       the threads are still spinning
+                        cur = ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
+                    }
+                    else
 #endif
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                               //       the threads are still spinning
-                            if (node->src0->type != GGML_TYPE_F32) {
-                                // here we need memory just for single 2D matrix from src0
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            }
-                        } else
-#endif
-                        if (node->src1->type != vec_dot_type) {
-                            cur = GGML_TYPE_SIZE[vec_dot_type]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[vec_dot_type];
-                        } else {
-                            cur = 0;
+                    if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                        n_tasks = 1; // TODO: this actually is doing nothing
+                                           //       the threads are still spinning
+                        if (node->src0->type != GGML_TYPE_F32) {
+                            // here we need memory just for single 2D matrix from src0
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
                         }
+                    } else
+#endif
+                    if (node->src1->type != vec_dot_type) {
+                        cur = GGML_TYPE_SIZE[vec_dot_type]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[vec_dot_type];
+                    } else {
+                        cur = 0;
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SET:
-                case GGML_OP_CONT:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_GET_ROWS_BACK:
-                case GGML_OP_DIAG:
-                case GGML_OP_DIAG_MASK_ZERO:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_DIAG_MASK_INF:
-                case GGML_OP_SOFT_MAX:
-                case GGML_OP_SOFT_MAX_BACK:
-                case GGML_OP_ROPE:
-                case GGML_OP_ROPE_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ALIBI:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CLAMP:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CONV_1D:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                    node_work = cur;
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    n_tasks = 1;
+                } break;
+            case GGML_OP_SET:
+            case GGML_OP_CONT:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_GET_ROWS_BACK:
+            case GGML_OP_DIAG:
+            case GGML_OP_DIAG_MASK_ZERO:
+                {
+                    n_tasks = 1;
+                } break;
+            case GGML_OP_DIAG_MASK_INF:
+            case GGML_OP_SOFT_MAX:
+            case GGML_OP_SOFT_MAX_BACK:
+            case GGML_OP_ROPE:
+            case GGML_OP_ROPE_BACK:
+                {
+                    n_tasks = n_threads;
+                } break;
+            case GGML_OP_ALIBI:
+                {
+                    n_tasks = 1; //TODO
+                } break;
+            case GGML_OP_CLAMP:
+                {
+                    n_tasks = 1; //TODO
+                } break;
+            case GGML_OP_CONV_1D:
+                {
+                    n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_CONV_2D:
-                    {
-                        node->n_tasks = n_threads;
+                    node_work = cur;
+                } break;
+            case GGML_OP_CONV_2D:
+                {
+                    n_tasks = n_threads;
 
-                        GGML_ASSERT(node->src1->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
 
-                        const int64_t ne00 = node->src0->ne[0]; // W
-                        const int64_t ne01 = node->src0->ne[1]; // H
-                        const int64_t ne02 = node->src0->ne[2]; // C
-                        const int64_t ne03 = node->src0->ne[3]; // N
+                    const int64_t ne00 = node->src0->ne[0]; // W
+                    const int64_t ne01 = node->src0->ne[1]; // H
+                    const int64_t ne02 = node->src0->ne[2]; // C
+                    const int64_t ne03 = node->src0->ne[3]; // N
 
-                        const int64_t ne10 = node->src1->ne[0]; // W
-                        const int64_t ne11 = node->src1->ne[1]; // H
-                        const int64_t ne12 = node->src1->ne[2]; // C
+                    const int64_t ne10 = node->src1->ne[0]; // W
+                    const int64_t ne11 = node->src1->ne[1]; // H
+                    const int64_t ne12 = node->src1->ne[2]; // C
 
-                        const int64_t nk = ne00*ne01;
+                    const int64_t nk = ne00*ne01;
 
-                        UNUSED(ne02);
-                        UNUSED(ne03);
-                        UNUSED(nk);
+                    UNUSED(ne02);
+                    UNUSED(ne03);
+                    UNUSED(nk);
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(ne10*ne11*ne12);
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*      (ne10*ne11*ne12);
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(ne10*ne11*ne12);
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*      (ne10*ne11*ne12);
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                    node_work = cur;
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                    node_work = cur;
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        node->n_tasks = n_threads;
+                    node_work = cur;
+                } break;
+            case GGML_OP_FLASH_ATTN_BACK:
+                {
+                    n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int64_t    D = node->src0->ne[0];
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                    const int64_t    D = node->src0->ne[0];
+                    const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_WIN_PART:
-                case GGML_OP_WIN_UNPART:
-                case GGML_OP_MAP_UNARY:
-                case GGML_OP_MAP_BINARY:
-                case GGML_OP_MAP_CUSTOM1:
-                case GGML_OP_MAP_CUSTOM2:
-                case GGML_OP_MAP_CUSTOM3:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = ggml_type_size(node->type)*(node->n_tasks + node->src0->ne[0]*node->n_tasks);
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-                    {
-                        node->n_tasks = n_threads;
-
-                        size_t cur = ggml_type_size(node->type)*node->src0->ne[0]*node->n_tasks;
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ASSERT(false);
-                    } break;
-            }
+                    node_work = cur;
+                } break;
+            case GGML_OP_WIN_PART:
+            case GGML_OP_WIN_UNPART:
+            case GGML_OP_MAP_UNARY:
+            case GGML_OP_MAP_BINARY:
+            case GGML_OP_MAP_CUSTOM1:
+            case GGML_OP_MAP_CUSTOM2:
+            case GGML_OP_MAP_CUSTOM3:
+                {
+                    n_tasks = 1;
+                } break;
+            case GGML_OP_CROSS_ENTROPY_LOSS:
+                {
+                    n_tasks = n_threads;
+
+                    size_t cur = ggml_type_size(node->type)*(n_tasks + node->src0->ne[0]*n_tasks);
+
+                    node_work = cur;
+                } break;
+            case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+                {
+                    n_tasks = n_threads;
+
+                    size_t cur = ggml_type_size(node->type)*node->src0->ne[0]*n_tasks;
+
+                    node_work = cur;
+                } break;
+            case GGML_OP_NONE:
+                {
+                    n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ASSERT(false);
+                } break;
         }
 
-        if (cgraph->work != NULL && work_size > cgraph->work_size) {
-            GGML_ASSERT(false); // TODO: better handling
+        cplan.n_tasks[i]   = n_tasks;
+        cplan.work_slot[i] = node_work > 0 ? 0 : -1;
+
+        work_size = MAX(work_size, node_work);
+    }
+
+    if (work_size > 0) {
+        // nodes that run at the same time need their own copy of the work buffer. small buffers are
+        // repeated in slots, large ones are shared and the nodes using them run one after the other
+        const size_t slot_size = (work_size + CACHE_LINE_SIZE*n_threads - 1)/CACHE_LINE_SIZE*CACHE_LINE_SIZE;
+
+        int n_slots = 1;
+        if (n_threads > 1) {
+            n_slots = MAX(1, MIN(MIN(GGML_SCHED_MAX_SLOTS, n_threads), (int) (GGML_SCHED_SLOTS_SIZE/slot_size)));
         }
 
-        if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+        int n_work = 0;
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            if (cplan.work_slot[i] >= 0) {
+                cplan.work_slot[i] = n_work++ % n_slots;
+            }
+        }
 
-            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+        cplan.work_size      = n_slots*slot_size;
+        cplan.work_slot_size = slot_size;
+    }
+
+    return cplan;
+}
+
+// makes the plan use at most size bytes of work buffer, with fewer slots
+static void ggml_graph_plan_fit_work(const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan, size_t size) {
+    if (cplan->work_size <= size) {
+        return;
+    }
+
+    const int n_slots = (int) (size/cplan->work_slot_size);
+    GGML_ASSERT(n_slots > 0 && "work buffer too small");
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        if (cplan->work_slot[i] >= 0) {
+            cplan->work_slot[i] %= n_slots;
         }
     }
 
-    // create thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; ++j) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
-            };
+    cplan->work_size = n_slots*cplan->work_slot_size;
+}
 
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
+void ggml_graph_compute_plan(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    const int n_threads = cplan->n_threads;
+
+    GGML_ASSERT(n_threads > 0);
+    GGML_ASSERT(cplan->work_size == 0 || cplan->work_data != NULL);
+
+    struct ggml_compute_state_shared state_shared = {
+        /*.cgraph    =*/ cgraph,
+        /*.cplan     =*/ cplan,
+        /*.n_threads =*/ n_threads,
+        /*.sched     =*/ NULL,
+    };
+    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        cgraph->nodes[i]->n_tasks = cplan->n_tasks[i];
+    }
+
+    if (n_threads > 1) {
+        if (cplan->sched != NULL && (cplan->sched->n_threads != n_threads || cplan->sched->max_nodes < cgraph->n_nodes)) {
+            ggml_sched_free(cplan->sched);
+            cplan->sched = NULL;
+        }
+        if (cplan->sched == NULL) {
+            cplan->sched = ggml_sched_new(cgraph->n_nodes, n_threads);
         }
+        ggml_sched_prepare(cplan->sched, cgraph, cplan);
+        state_shared.sched = cplan->sched;
+    }
+
+    // the graph's own pool can run it if it is large enough, otherwise start the threads here
+    struct ggml_threadpool * pool = cplan->threadpool;
+    if (n_threads == 1 || (pool != NULL && pool->n_threads < n_threads)) {
+        pool = NULL;
     }
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
 
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    // this is a work thread too
-    ggml_graph_compute_thread(&workers[0]);
+    if (pool != NULL) {
+        pool->shared = &state_shared;
+        atomic_store(&pool->n_done, 0);
+        ggml_threadpool_notify(pool);
 
-    // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+        workers[0] = pool->workers[0];
+        workers[0].shared = &state_shared;
 
-    // join thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
+        // this is a work thread too
+        ggml_graph_compute_thread(&workers[0]);
+
+        // the workers are done with the graph once they have all checked in
+        while (atomic_load(&pool->n_done) < pool->n_threads - 1) {
+            sched_yield();
+        }
+    } else {
+        // create thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; ++j) {
+                workers[j] = (struct ggml_compute_state) {
+                    .thrd   = 0,
+                    .ith = j,
+                    .shared = &state_shared,
+                    .pool   = NULL,
+                };
+
+                const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+            }
+        }
+        workers[0].ith = 0;
+        workers[0].shared = &state_shared;
+        workers[0].pool = NULL;
+
+        // this is a work thread too
+        ggml_graph_compute_thread(&workers[0]);
+
+        // join thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; j++) {
+                const int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+            }
         }
     }
 
+    // don't leave affinity set on the main thread
+    clear_numa_thread_affinity();
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -16502,6 +17437,33 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     }
 }
 
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_cplan cplan = ggml_graph_plan(cgraph, cgraph->n_threads);
+
+    if (cplan.work_size > 0) {
+        if (cgraph->work == NULL) {
+            cgraph->work_size = cplan.work_size;
+
+            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
+            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+        } else {
+            ggml_graph_plan_fit_work(cgraph, &cplan, cgraph->work_size);
+        }
+
+        cplan.work_data = cgraph->work->data;
+    }
+
+    ggml_graph_compute_plan(cgraph, &cplan);
+    ggml_cplan_free(&cplan);
+}
+
+void ggml_cplan_free(struct ggml_cplan * cplan) {
+    if (cplan->sched != NULL) {
+        ggml_sched_free(cplan->sched);
+        cplan->sched = NULL;
+    }
+}
+
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
     for (int i = 0; i < cgraph->n_nodes; i++) {
         struct ggml_tensor * grad = cgraph->grads[i];
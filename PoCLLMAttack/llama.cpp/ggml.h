@@ -380,6 +380,9 @@ extern "C" {
         GGML_OP_CROSS_ENTROPY_LOSS,
         GGML_OP_CROSS_ENTROPY_LOSS_BACK,
 
+        GGML_OP_RMS_NORM_MUL,
+        GGML_OP_SILU_MUL,
+
         GGML_OP_COUNT,
     };
 
@@ -437,6 +440,12 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // persistent worker threads, see ggml_threadpool_new()
+    struct ggml_threadpool;
+
+    // node scheduler of a plan, see ggml_cplan
+    struct ggml_sched;
+
     // computation graph
     struct ggml_cgraph {
         int n_nodes;
@@ -446,6 +455,10 @@ extern "C" {
         size_t work_size;
         struct ggml_tensor * work;
 
+        // if set, the graph is computed on the threads of the pool instead of
+        // threads started for each ggml_graph_compute() call
+        struct ggml_threadpool * threadpool;
+
         struct ggml_tensor * nodes[GGML_MAX_NODES];
         struct ggml_tensor * grads[GGML_MAX_NODES];
         struct ggml_tensor * leafs[GGML_MAX_NODES];
@@ -456,6 +469,29 @@ extern "C" {
         int64_t perf_time_us;
     };
 
+    // how to compute a graph, see ggml_graph_plan()
+    struct ggml_cplan {
+        size_t    work_size; // size of the work buffer, as computed by ggml_graph_plan()
+        uint8_t * work_data; // work buffer, provided by the caller when work_size > 0
+
+        int n_threads;
+
+        // number of tasks of each node, in the order of cgraph->nodes
+        int n_tasks[GGML_MAX_NODES];
+
+        // nodes that run at the same time use different copies ("slots") of the work buffer,
+        // work_slot_size bytes apart. -1 for the nodes that do not use it
+        int8_t work_slot[GGML_MAX_NODES];
+        size_t work_slot_size;
+
+        // run on the threads of this pool instead of starting threads for each computation
+        struct ggml_threadpool * threadpool;
+
+        // dependencies between the nodes, worked out by ggml_graph_compute_plan() with more than one
+        // thread and kept until the graph changes, see ggml_cplan_free()
+        struct ggml_sched * sched;
+    };
+
     // scratch buffer
     struct ggml_scratch {
         size_t offs;
@@ -848,6 +884,21 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // rms_norm(a)*b in one pass over each row, b is broadcast to the rows of a like in ggml_mul
+    // the sum of squares is in float, the result is within 4 ulp of ggml_rms_norm + ggml_mul
+    // when a or b has a gradient, it is built as ggml_mul(ggml_rms_norm(a), ggml_repeat(b, a))
+    GGML_API struct ggml_tensor * ggml_rms_norm_mul(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
+    // silu(a)*b, a and b have the same shape
+    // when a or b has a gradient, it is built as ggml_mul(ggml_silu(a), b)
+    GGML_API struct ggml_tensor * ggml_silu_mul(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     // A: n columns, m rows
     // B: n columns, p rows  (i.e. we transpose it internally)
     // result is m columns, p rows
@@ -1297,9 +1348,28 @@ extern "C" {
     GGML_API struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
     GGML_API struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
+    // ggml_graph_plan() works out the tasks and the work buffer of a graph once, and
+    // ggml_graph_compute_plan() runs it as often as needed while the graph keeps its shape
+    // the caller owns the work buffer: when work_size > 0, point work_data to that many bytes
+    // threadpool starts out as cgraph->threadpool
+    GGML_API struct ggml_cplan ggml_graph_plan        (struct ggml_cgraph * cgraph, int n_threads);
+    GGML_API void              ggml_graph_compute_plan(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+    // frees what ggml_graph_compute_plan() kept in the plan, but not the work buffer
+    GGML_API void              ggml_cplan_free        (struct ggml_cplan * cplan);
+
+    // plans with cgraph->n_threads and keeps the work buffer in cgraph->work, allocating it in ctx
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // a pool of n_threads - 1 worker threads that are started once and reused by every graph
+    // or plan that points to it; the thread computing the graph is the n_threads-th
+    // between graphs the workers spin for a short while and then sleep until the next one
+    // graphs with more threads than the pool fall back to starting their own threads
+    // a pool computes one graph at a time
+    GGML_API struct ggml_threadpool * ggml_threadpool_new (int n_threads);
+    GGML_API void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+    GGML_API int                      ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void               ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -19,6 +19,14 @@
 #ifdef GGML_USE_METAL
 #include "ggml-metal.h"
 #endif
+#if !defined(GGML_USE_CUBLAS) && !defined(GGML_USE_METAL)
+// the GPU backends keep their own copies of the scratch buffers, see LLAMA_USE_SCRATCH
+#include "ggml-alloc.h"
+#define LLAMA_USE_ALLOCATOR
+#define LLAMA_ALLOC_ALIGNMENT 32
+#else
+#define LLAMA_USE_SCRATCH
+#endif
 #ifdef GGML_USE_K_QUANTS
 #ifndef QK_K
 #ifdef GGML_QKK_64
@@ -53,7 +61,6 @@
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
-#define LLAMA_USE_SCRATCH
 #define LLAMA_MAX_SCRATCH_BUFFERS 16
 
 // available llama models
@@ -79,6 +86,20 @@ void llama_nop(struct ggml_tensor * tensor) { // don't offload by default
     (void) tensor;
 }
 
+// ggml_rms_norm_mul and ggml_silu_mul only have CPU kernels: they replace a norm and its weight or
+// the SiLU gate of the feed-forward network where neither the weight nor the result is offloaded
+static bool llama_use_fused_ops(offload_func_t offload_func, const struct ggml_tensor * norm) {
+#ifdef GGML_USE_METAL
+    // the Metal backend computes every node of the graph
+    (void) offload_func;
+    (void) norm;
+    return false;
+#else
+    return offload_func == llama_nop && norm->backend == GGML_BACKEND_CPU;
+#endif
+}
+
+#ifdef LLAMA_USE_SCRATCH
 static const std::map<e_model, size_t> & MEM_REQ_SCRATCH0()
 {
     static std::map<e_model, size_t> k_sizes = {
@@ -102,6 +123,7 @@ static const std::map<e_model, size_t> & MEM_REQ_SCRATCH1()
     };
     return k_sizes;
 }
+#endif
 
 // 2*n_embd*n_ctx*n_layer*sizeof(float16)
 static const std::map<e_model, size_t> & MEM_REQ_KV_SELF()
@@ -116,6 +138,7 @@ static const std::map<e_model, size_t> & MEM_REQ_KV_SELF()
     return k_sizes;
 }
 
+#ifdef LLAMA_USE_SCRATCH
 // this is mostly needed for temporary mul_mat buffers to dequantize the data
 // not actually needed if BLAS is disabled
 static const std::map<e_model, size_t> & MEM_REQ_EVAL()
@@ -129,6 +152,7 @@ static const std::map<e_model, size_t> & MEM_REQ_EVAL()
     };
     return k_sizes;
 }
+#endif
 
 // amount of VRAM needed per batch size to hold temporary results
 // the values for 3b and 65b are not derived from testing but instead chosen conservatively
@@ -283,13 +307,20 @@ struct llama_model {
 
 struct llama_context {
     llama_context(const llama_model & model, const llama_vocab & vocab) : model(model), vocab(vocab), t_load_us(model.t_load_us), t_start_us(model.t_start_us) {}
-#ifdef GGML_USE_METAL
     ~llama_context() {
+#ifdef GGML_USE_METAL
         if (ctx_metal) {
             ggml_metal_free(ctx_metal);
         }
-    }
 #endif
+#ifdef LLAMA_USE_ALLOCATOR
+        if (alloc) {
+            ggml_allocr_free(alloc);
+        }
+#endif
+        ggml_cplan_free(&eval_plan);
+        ggml_threadpool_free(threadpool);
+    }
     std::mt19937 rng;
 
     bool has_evaluated_once = false;
@@ -327,6 +358,22 @@ struct llama_context {
     llama_ctx_buffer buf_compute;
     llama_ctx_buffer buf_scratch[LLAMA_MAX_SCRATCH_BUFFERS];
 
+#ifdef LLAMA_USE_ALLOCATOR
+    // the eval graph is built in buf_compute without data and its tensors are then placed in
+    // buf_alloc, which is sized for the largest batch when the context is created
+    llama_ctx_buffer buf_alloc;
+    struct ggml_allocr * alloc = NULL;
+
+    void init_alloc(size_t size) {
+        if (alloc) {
+            ggml_allocr_free(alloc);
+        }
+        // the buffer may not be aligned
+        buf_alloc.resize(size + LLAMA_ALLOC_ALIGNMENT);
+        alloc = ggml_allocr_new(buf_alloc.addr, buf_alloc.size, LLAMA_ALLOC_ALIGNMENT);
+    }
+#endif
+
 #ifdef GGML_USE_METAL
     ggml_metal_context * ctx_metal = NULL;
 #endif
@@ -334,6 +381,29 @@ struct llama_context {
     int    buf_last = 0;
     size_t buf_max_size[LLAMA_MAX_SCRATCH_BUFFERS] = { 0 };
 
+    // worker threads kept between evals, so that every token does not start and join them again
+    struct ggml_threadpool * threadpool = NULL;
+
+    struct ggml_threadpool * get_threadpool(int n_threads) {
+        if (n_threads <= 1) {
+            return NULL;
+        }
+        if (threadpool && ggml_threadpool_n_threads(threadpool) != n_threads) {
+            ggml_threadpool_free(threadpool);
+            threadpool = NULL;
+        }
+        if (!threadpool) {
+            threadpool = ggml_threadpool_new(n_threads);
+        }
+        return threadpool;
+    }
+
+    // work buffer of the eval graph, reused from one eval to the next
+    std::vector<uint8_t> work_buffer;
+
+    // plan of the eval graph, which keeps the dependencies between its nodes from one eval to the next
+    struct ggml_cplan eval_plan = {};
+
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(LLAMA_USE_SCRATCH)
         size_t last_size = 0;
@@ -366,6 +436,27 @@ struct llama_context {
     }
 };
 
+// computes the graph with its work buffer in buf instead of the graph's context
+// plan is planned again for the graph, but keeps the node dependencies it had when the graph has not changed
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads, ggml_cplan & plan) {
+    struct ggml_sched * sched = plan.sched;
+    plan = ggml_graph_plan(graph, n_threads);
+    plan.sched = sched;
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute_plan(graph, &plan);
+}
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = {};
+    ggml_graph_compute_helper(buf, graph, n_threads, plan);
+    ggml_cplan_free(&plan);
+}
+
 template <typename T>
 static T checked_mul(T a, T b) {
     T ret = a * b;
@@ -1127,12 +1218,16 @@ static void llama_model_load_internal(
         const size_t scale = memory_type == GGML_TYPE_F32 ? 2 : 1;
 
         // this is the total memory required to run the inference
+        // without the scratch buffers, the compute buffer is sized when a context is created
         const size_t mem_required =
             ctx_size +
-            mmapped_size - vram_weights + // weights in VRAM not in memory
-            MEM_REQ_SCRATCH0().at(model.type) +
-            MEM_REQ_SCRATCH1().at(model.type) +
-            MEM_REQ_EVAL().at    (model.type);
+            mmapped_size - vram_weights // weights in VRAM not in memory
+#ifdef LLAMA_USE_SCRATCH
+            + MEM_REQ_SCRATCH0().at(model.type)
+            + MEM_REQ_SCRATCH1().at(model.type)
+            + MEM_REQ_EVAL().at    (model.type)
+#endif
+            ;
 
         // this is the memory required by one llama_state
         const size_t mem_required_state =
@@ -1253,33 +1348,27 @@ static bool llama_model_load(
     }
 }
 
-// evaluate the transformer
+// build the graph of the transformer
 //
-//   - lctx:      llama context
-//   - tokens:    new batch of tokens to process
-//   - embd       embeddings input
-//   - n_tokens   number of tokens
-//   - n_past:    the context size so far
-//   - n_threads: number of threads to use
+//   - lctx:       llama context
+//   - ctx0:       context of the graph's tensors, with no_alloc when the allocator places them
+//   - gf:         graph to build
+//   - embd_input: whether the input is embeddings rather than tokens
+//   - n_tokens    number of tokens
+//   - n_past:     the context size so far
+//   - inp_out:    set to the input, which is written once the graph has its memory
+//   - embeddings: set to the output of the final norm
 //
-static bool llama_eval_internal(
+// returns the logits
+static struct ggml_tensor * llama_build_graph(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
+   struct ggml_context * ctx0,
+           ggml_cgraph & gf,
+            const bool   embd_input,
              const int   n_tokens,
              const int   n_past,
-             const int   n_threads,
-            const char * cgraph_fname) {
-
-    LLAMA_ASSERT((!tokens && embd) || (tokens && !embd));
-
-    // enforce that the first token is BOS
-    if (tokens && n_past == 0 && tokens[0] != llama_token_bos()) {
-        fprintf(stderr, "%s: first token must be BOS\n", __func__);
-        return false;
-    }
-
-    const int64_t t_start_us = ggml_time_us();
+   struct ggml_tensor ** inp_out,
+   struct ggml_tensor ** embeddings_out) {
 
     const int N = n_tokens;
 
@@ -1294,38 +1383,20 @@ static bool llama_eval_internal(
     const int n_layer      = hparams.n_layer;
     const int n_ctx        = hparams.n_ctx;
     const int n_head       = hparams.n_head;
-    const int n_vocab      = hparams.n_vocab;
     const int n_rot        = hparams.n_embd/hparams.n_head;
     const int n_gpu_layers = model.n_gpu_layers;
 
-    auto & mem_per_token = lctx.mem_per_token;
-    auto & buf_compute   = lctx.buf_compute;
-
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ buf_compute.size,
-        /*.mem_buffer =*/ buf_compute.addr,
-        /*.no_alloc   =*/ false,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    // for big prompts, if BLAS is enabled, it is better to use only one thread
-    // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
-    ggml_cgraph gf = {};
-    //gf.n_threads = N >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas() ? 1 : n_threads;
-    gf.n_threads = 1;
-
     struct ggml_tensor * cur;
     struct ggml_tensor * inpL;
 
-    if (tokens) {
-        struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-        ggml_set_name(embd, "embd");
-        memcpy(embd->data, tokens, N*ggml_element_size(embd));
-        inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
+    if (!embd_input) {
+        struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+        ggml_set_name(inp_tokens, "embd");
+        *inp_out = inp_tokens;
+        inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
     } else {
         inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
-        memcpy(inpL->data, embd, N * n_embd * ggml_element_size(inpL));
+        *inp_out = inpL;
     }
 
     const int i_gpu_start = n_layer - n_gpu_layers;
@@ -1361,12 +1432,17 @@ static bool llama_eval_internal(
         }
 #endif // GGML_USE_CUBLAS
 
+        const bool fused = llama_use_fused_ops(offload_func, model.layers[il].attention_norm);
+
         struct ggml_tensor * inpSA = inpL;
 
         lctx.use_buf(ctx0, 0);
 
         // norm
-        {
+        if (fused) {
+            cur = ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attention_norm);
+            ggml_set_name(cur, "attention_norm_0");
+        } else {
             cur = ggml_rms_norm(ctx0, inpL);
             offload_func(cur);
             ggml_set_name(cur, "rms_norm_0");
@@ -1514,7 +1590,10 @@ static bool llama_eval_internal(
         // feed-forward network
         {
             // norm
-            {
+            if (fused) {
+                cur = ggml_rms_norm_mul(ctx0, inpFF, model.layers[il].ffn_norm);
+                ggml_set_name(cur, "ffn_norm");
+            } else {
                 cur = ggml_rms_norm(ctx0, inpFF);
                 offload_func(cur);
                 ggml_set_name(cur, "rms_norm_1");
@@ -1538,12 +1617,16 @@ static bool llama_eval_internal(
             ggml_set_name(cur, "result_w1");
 
             // SILU activation
-            cur = ggml_silu(ctx0, cur);
-            offload_func(cur);
-            ggml_set_name(cur, "silu");
+            if (fused) {
+                cur = ggml_silu_mul(ctx0, cur, tmp);
+            } else {
+                cur = ggml_silu(ctx0, cur);
+                offload_func(cur);
+                ggml_set_name(cur, "silu");
 
-            cur = ggml_mul(ctx0, cur, tmp);
-            offload_func(cur);
+                cur = ggml_mul(ctx0, cur, tmp);
+                offload_func(cur);
+            }
             ggml_set_name(cur, "silu_x_result_w3");
 
             cur = ggml_mul_mat(ctx0,
@@ -1564,12 +1647,13 @@ static bool llama_eval_internal(
 
     lctx.use_buf(ctx0, 0);
 
-    // used at the end to optionally extract the embeddings
-    struct ggml_tensor * embeddings = NULL;
-
-
     // norm
-    {
+    if (llama_use_fused_ops(offload_func_nr, model.norm)) {
+        cur = ggml_rms_norm_mul(ctx0, inpL, model.norm);
+        ggml_set_name(cur, "result_norm");
+
+        *embeddings_out = cur;
+    } else {
         cur = ggml_rms_norm(ctx0, inpL);
         offload_func_nr(cur);
         ggml_set_name(cur, "rms_norm_2");
@@ -1579,7 +1663,7 @@ static bool llama_eval_internal(
         // offload_func_nr(cur); // TODO CPU + GPU mirrored backend
         ggml_set_name(cur, "result_norm");
 
-        embeddings = cur;
+        *embeddings_out = cur;
     }
 
 
@@ -1626,10 +1710,106 @@ static bool llama_eval_internal(
     // logits -> probs
     //cur = ggml_soft_max_inplace(ctx0, cur);
 
-    // run the computation
     ggml_build_forward_expand(&gf, cur);
 
-    ggml_graph_compute(ctx0, &gf);
+    return cur;
+}
+
+// evaluate the transformer
+//
+//   - lctx:      llama context
+//   - tokens:    new batch of tokens to process
+//   - embd       embeddings input
+//   - n_tokens   number of tokens
+//   - n_past:    the context size so far
+//   - n_threads: number of threads to use
+//
+static bool llama_eval_internal(
+         llama_context & lctx,
+     const llama_token * tokens,
+           const float * embd,
+             const int   n_tokens,
+             const int   n_past,
+             const int   n_threads,
+            const char * cgraph_fname) {
+
+    LLAMA_ASSERT((!tokens && embd) || (tokens && !embd));
+
+    // enforce that the first token is BOS
+    if (tokens && n_past == 0 && tokens[0] != llama_token_bos()) {
+        fprintf(stderr, "%s: first token must be BOS\n", __func__);
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const int N = n_tokens;
+
+    const auto & hparams = lctx.model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_vocab = hparams.n_vocab;
+
+    auto & mem_per_token = lctx.mem_per_token;
+    auto & buf_compute   = lctx.buf_compute;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf_compute.size,
+        /*.mem_buffer =*/ buf_compute.addr,
+#ifdef LLAMA_USE_ALLOCATOR
+        /*.no_alloc   =*/ true,
+#else
+        /*.no_alloc   =*/ false,
+#endif
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    // for big prompts, if BLAS is enabled, it is better to use only one thread
+    // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
+    // the PoC victim evaluates on one thread, LLAMA_MULTI_THREADED_EVAL uses n_threads and the context's pool
+    ggml_cgraph gf = {};
+#ifdef LLAMA_MULTI_THREADED_EVAL
+    const int n_eval_threads = N >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas() ? 1 : n_threads;
+#else
+    const int n_eval_threads = 1;
+    (void) n_threads;
+#endif
+    gf.n_threads = n_eval_threads;
+
+    struct ggml_tensor * inp = NULL;
+
+    // used at the end to optionally extract the embeddings
+    struct ggml_tensor * embeddings = NULL;
+
+    struct ggml_tensor * cur = llama_build_graph(lctx, ctx0, gf, !tokens, N, n_past, &inp, &embeddings);
+
+#ifdef LLAMA_USE_ALLOCATOR
+    ggml_allocr_reset(lctx.alloc);
+
+    // a batch can fragment the buffer more than the one it was sized with, its graph is then built
+    // again and placed in a buffer large enough for it
+    for (size_t alloc_size; (alloc_size = ggml_allocr_alloc_graph(lctx.alloc, &gf)) > lctx.buf_alloc.size; ) {
+        ggml_free(ctx0);
+        lctx.init_alloc(alloc_size);
+
+        ctx0 = ggml_init(params);
+        gf = {};
+        gf.n_threads = n_eval_threads;
+        cur = llama_build_graph(lctx, ctx0, gf, !tokens, N, n_past, &inp, &embeddings);
+    }
+#endif
+
+    if (tokens) {
+        memcpy(inp->data, tokens, N*ggml_element_size(inp));
+    } else {
+        memcpy(inp->data, embd, N*n_embd*ggml_element_size(inp));
+    }
+
+    // run the computation
+
+    gf.threadpool = lctx.get_threadpool(gf.n_threads);
+    ggml_graph_compute_helper(lctx.work_buffer, &gf, gf.n_threads, lctx.eval_plan);
 
     if (cgraph_fname) {
         ggml_graph_export(&gf, cgraph_fname);
@@ -2652,10 +2832,43 @@ struct llama_context * llama_new_context_with_model(
             ctx->embedding.resize(hparams.n_embd);
         }
 
+#ifdef LLAMA_USE_ALLOCATOR
+        {
+            // the graph is built without data, so this only holds the tensors themselves
+            // and the parameters of their ops
+            ctx->buf_compute.resize(ggml_tensor_overhead()*2*GGML_MAX_NODES);
+
+            // the largest graph is that of a full batch at the end of the context
+            const int n_tokens = std::min((int) hparams.n_ctx, params.n_batch);
+            const int n_past   = hparams.n_ctx - n_tokens;
+
+            struct ggml_init_params init_params = {
+                /*.mem_size   =*/ ctx->buf_compute.size,
+                /*.mem_buffer =*/ ctx->buf_compute.addr,
+                /*.no_alloc   =*/ true,
+            };
+            struct ggml_context * ctx0 = ggml_init(init_params);
+
+            ggml_cgraph gf = {};
+            struct ggml_tensor * inp        = NULL;
+            struct ggml_tensor * embeddings = NULL;
+            llama_build_graph(*ctx, ctx0, gf, false, n_tokens, n_past, &inp, &embeddings);
+
+            struct ggml_allocr * alloc_measure = ggml_allocr_new_measure(LLAMA_ALLOC_ALIGNMENT);
+            const size_t alloc_size = ggml_allocr_alloc_graph(alloc_measure, &gf);
+            ggml_allocr_free(alloc_measure);
+            ggml_free(ctx0);
+
+            ctx->init_alloc(alloc_size);
+
+            fprintf(stderr, "%s: compute buffer total size = %7.2f MB\n", __func__, (ctx->buf_compute.size + ctx->buf_alloc.size) / 1024.0 / 1024.0);
+        }
+#else
         ctx->buf_compute.resize(MEM_REQ_EVAL().at(ctx->model.type));
 
         ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0().at(ctx->model.type));
         ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1().at(ctx->model.type));
+#endif
     }
 
 #ifdef GGML_USE_METAL
@@ -2778,6 +2991,7 @@ int llama_apply_lora_from_file_internal(const struct llama_model & model, const
     params.no_alloc   = false;
 
     ggml_context * lora_ctx = ggml_init(params);
+    std::vector<uint8_t> work_buffer;
     std::unordered_map<std::string, struct ggml_tensor *> lora_tensors;
 
     // create a name -> tensor map of the model to accelerate lookups
@@ -2982,8 +3196,7 @@ int llama_apply_lora_from_file_internal(const struct llama_model & model, const
             }
 
             struct ggml_cgraph gf = ggml_build_forward(r);
-            gf.n_threads = n_threads;
-            ggml_graph_compute(lora_ctx, &gf);
+            ggml_graph_compute_helper(work_buffer, &gf, n_threads);
 
             // we won't need these tensors again, reset the context to save memory
             ggml_free(lora_ctx);
@@ -3136,7 +3349,6 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
 
             ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
             ggml_cgraph gf{};
-            gf.n_threads = 1;
 
             ggml_tensor * kout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
             kout3d->data = out;
@@ -3156,7 +3368,7 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
 
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
-            ggml_graph_compute(cpy_ctx, &gf);
+            ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1);
 
             ggml_free(cpy_ctx);
         }
@@ -3242,7 +3454,6 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
 
             ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
             ggml_cgraph gf{};
-            gf.n_threads = 1;
 
             ggml_tensor * kin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
             kin3d->data = (void *) inp;
@@ -3262,7 +3473,7 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
 
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
             ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
-            ggml_graph_compute(cpy_ctx, &gf);
+            ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1);
 
             ggml_free(cpy_ctx);
         }
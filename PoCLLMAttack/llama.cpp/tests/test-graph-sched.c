@@ -0,0 +1,325 @@
+// Runs a graph shaped like a few llama layers with 1 to 8 threads and checks that the results do not
+// depend on the thread count. The graph writes the KV cache through views and reuses a scratch buffer
+// between layers, which the node scheduler only sees through the memory the nodes touch. The same graph
+// is then placed by ggml-alloc, which reuses the memory of tensors as soon as they are no longer read,
+// and computed with a plan kept across the iterations as llama does, which keeps its node dependencies.
+// The fused ops the graph uses are also checked against the ops they replace, on rows of several widths.
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#define N_EMBD   64
+#define N_TOKENS 32
+#define N_LAYER  4
+#define N_ITER   50
+
+// ggml_rms_norm_mul sums the squares in float, ggml_rms_norm in ggml_float
+#define RMS_NORM_MUL_MAX_ULPS 4
+
+struct layer {
+    struct ggml_tensor * norm;
+    struct ggml_tensor * wq;
+    struct ggml_tensor * wk;
+    struct ggml_tensor * wv;
+    struct ggml_tensor * wo;
+};
+
+static void fill(struct ggml_tensor * t, float scale, int seed) {
+    float * data = (float *) t->data;
+    for (int i = 0; i < ggml_nelements(t); i++) {
+        data[i] = scale*sinf(0.37f*i + 1.3f*seed);
+    }
+}
+
+static struct ggml_tensor * new_weight(struct ggml_context * ctx, enum ggml_type type, int seed) {
+    struct ggml_tensor * f32 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N_EMBD, N_EMBD);
+    fill(f32, 0.1f, seed);
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, type, N_EMBD, N_EMBD);
+    const float * src = (const float *) f32->data;
+    switch (type) {
+        case GGML_TYPE_F32:
+            memcpy(w->data, src, ggml_nbytes(w));
+            break;
+        case GGML_TYPE_F16:
+            ggml_fp32_to_fp16_row(src, (ggml_fp16_t *) w->data, N_EMBD*N_EMBD);
+            break;
+        case GGML_TYPE_Q4_0:
+            {
+                int64_t hist[16] = { 0 };
+                ggml_quantize_q4_0(src, w->data, N_EMBD*N_EMBD, N_EMBD, hist);
+            } break;
+        default:
+            abort();
+    }
+    return w;
+}
+
+static struct ggml_tensor * build(
+        struct ggml_context * ctx, struct ggml_cgraph * gf, void * scratch, size_t scratch_size,
+        const struct layer * layers, struct ggml_tensor * input, struct ggml_tensor * kv, struct ggml_tensor * kq_scale) {
+    struct ggml_tensor * x = input;
+
+    for (int il = 0; il < N_LAYER; il++) {
+        // every layer starts over at the beginning of the scratch buffer, as llama does
+        if (scratch) {
+            ggml_set_scratch(ctx, (struct ggml_scratch) { 0, scratch_size, scratch });
+        }
+
+        // the fused ops in every other layer, as llama uses them in the layers that are not offloaded
+        struct ggml_tensor * cur = il % 2 == 0
+            ? ggml_rms_norm_mul(ctx, x, layers[il].norm)
+            : ggml_mul(ctx, ggml_rms_norm(ctx, x), layers[il].norm);
+
+        struct ggml_tensor * q = ggml_mul_mat(ctx, layers[il].wq, cur);
+        struct ggml_tensor * k = ggml_mul_mat(ctx, layers[il].wk, cur);
+        struct ggml_tensor * v = ggml_mul_mat(ctx, layers[il].wv, cur);
+
+        // store K in this layer's part of the cache and read it back through another view
+        struct ggml_tensor * k_cache = ggml_view_2d(ctx, kv, N_EMBD, N_TOKENS, kv->nb[1], il*N_TOKENS*kv->nb[1]);
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, k, k_cache));
+        struct ggml_tensor * k_past = ggml_view_2d(ctx, kv, N_EMBD, N_TOKENS, kv->nb[1], il*N_TOKENS*kv->nb[1]);
+
+        struct ggml_tensor * kq = ggml_mul_mat(ctx, k_past, q);
+        kq = ggml_soft_max_inplace(ctx, ggml_scale_inplace(ctx, kq, kq_scale));
+
+        struct ggml_tensor * vt = ggml_cont(ctx, ggml_transpose(ctx, v));
+        cur = ggml_mul_mat(ctx, vt, kq);
+        cur = ggml_mul_mat(ctx, layers[il].wo, cur);
+        cur = il % 2 == 0 ? ggml_silu_mul(ctx, cur, q) : ggml_silu(ctx, cur);
+
+        if (scratch) {
+            ggml_set_scratch(ctx, (struct ggml_scratch) { 0, 0, NULL });
+        }
+        x = ggml_add(ctx, x, cur);
+    }
+
+    ggml_build_forward_expand(gf, x);
+    return x;
+}
+
+// the distance between two floats in units in the last place of the expected one
+static float ulps(float expected, float actual) {
+    if (expected == actual) {
+        return 0.0f;
+    }
+    const float e = fabsf(expected);
+    return fabsf(actual - expected)/(nextafterf(e, INFINITY) - e);
+}
+
+// compares the fused ops with the ops they replace, on rows that are and are not a multiple of the SIMD step
+static int check_fused_ops(struct ggml_context * ctx) {
+    const int widths[] = { 7, 64, 4099, 11008 };
+    const int n_rows   = 5;
+
+    int n_failed = 0;
+
+    for (size_t iw = 0; iw < sizeof(widths)/sizeof(widths[0]); iw++) {
+        const int n = widths[iw];
+
+        struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, n_rows);
+        struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, n_rows);
+        struct ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+        fill(a, 4.0f, n);
+        fill(b, 2.0f, n + 1);
+        fill(w, 1.0f, n + 2);
+
+        struct ggml_tensor * rms_fused = ggml_rms_norm_mul(ctx, a, w);
+        struct ggml_tensor * rms       = ggml_mul(ctx, ggml_rms_norm(ctx, a), w);
+        struct ggml_tensor * silu_fused = ggml_silu_mul(ctx, a, b);
+        struct ggml_tensor * silu       = ggml_mul(ctx, ggml_silu(ctx, a), b);
+
+        for (int n_threads = 1; n_threads <= 3; n_threads += 2) {
+            struct ggml_cgraph g = ggml_build_forward(rms_fused);
+            ggml_build_forward_expand(&g, rms);
+            ggml_build_forward_expand(&g, silu_fused);
+            ggml_build_forward_expand(&g, silu);
+            g.n_threads = n_threads;
+            ggml_graph_compute(ctx, &g);
+
+            float max_ulps = 0.0f;
+            for (int i = 0; i < ggml_nelements(rms); i++) {
+                max_ulps = fmaxf(max_ulps, ulps(ggml_get_f32_1d(rms, i), ggml_get_f32_1d(rms_fused, i)));
+            }
+            if (max_ulps > RMS_NORM_MUL_MAX_ULPS) {
+                fprintf(stderr, "%s: rms_norm_mul, width %d, %d threads: %g ulps from rms_norm + mul\n", __func__, n, n_threads, (double) max_ulps);
+                n_failed++;
+            }
+
+            if (memcmp(silu_fused->data, silu->data, ggml_nbytes(silu)) != 0) {
+                fprintf(stderr, "%s: silu_mul, width %d, %d threads: differs from silu + mul\n", __func__, n, n_threads);
+                n_failed++;
+            }
+        }
+    }
+
+    return n_failed;
+}
+
+int main(void) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    const size_t scratch_size = 1024*1024;
+    void * scratch = malloc(scratch_size);
+
+    struct layer layers[N_LAYER];
+    for (int il = 0; il < N_LAYER; il++) {
+        layers[il].norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, N_EMBD);
+        fill(layers[il].norm, 1.0f, 5*il);
+        layers[il].wq = new_weight(ctx, GGML_TYPE_F16,  5*il + 1);
+        layers[il].wk = new_weight(ctx, GGML_TYPE_Q4_0, 5*il + 2);
+        layers[il].wv = new_weight(ctx, GGML_TYPE_F32,  5*il + 3);
+        layers[il].wo = new_weight(ctx, GGML_TYPE_Q4_0, 5*il + 4);
+    }
+
+    struct ggml_tensor * input = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N_EMBD, N_TOKENS);
+    fill(input, 1.0f, 100);
+    struct ggml_tensor * kv = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N_EMBD, N_LAYER*N_TOKENS);
+    struct ggml_tensor * kq_scale = ggml_new_f32(ctx, 0.125f);
+
+    struct ggml_cgraph gf = ggml_build_forward(input);
+    gf.n_nodes = 0;
+    gf.n_leafs = 0;
+    struct ggml_tensor * out = build(ctx, &gf, scratch, scratch_size, layers, input, kv, kq_scale);
+
+    gf.n_threads = 1;
+    ggml_graph_compute(ctx, &gf);
+
+    float * expected = malloc(ggml_nbytes(out));
+    memcpy(expected, out->data, ggml_nbytes(out));
+
+    int n_failed = check_fused_ops(ctx);
+
+    for (int n_threads = 2; n_threads <= 8; n_threads++) {
+        struct ggml_threadpool * pool = n_threads % 2 == 0 ? ggml_threadpool_new(n_threads) : NULL;
+
+        for (int iter = 0; iter < N_ITER; iter++) {
+            // a fresh graph every time, so that the work buffer is sized for the thread count
+            struct ggml_cgraph g = ggml_build_forward(input);
+            g.n_nodes = 0;
+            g.n_leafs = 0;
+            out = build(ctx, &g, scratch, scratch_size, layers, input, kv, kq_scale);
+            g.n_threads  = n_threads;
+            g.threadpool = pool;
+
+            memset(kv->data, 0, ggml_nbytes(kv));
+            memset(scratch, 0, scratch_size);
+            ggml_graph_compute(ctx, &g);
+
+            float max_diff = 0.0f;
+            for (int i = 0; i < ggml_nelements(out); i++) {
+                max_diff = fmaxf(max_diff, fabsf(ggml_get_f32_1d(out, i) - expected[i]));
+            }
+            if (max_diff > 1e-5f) {
+                fprintf(stderr, "%s: %d threads, iteration %d: max difference %g\n", __func__, n_threads, iter, (double) max_diff);
+                n_failed++;
+                break;
+            }
+        }
+
+        ggml_threadpool_free(pool);
+    }
+
+    // the graph in a context without data, measured and then placed in a buffer of that size
+    struct ggml_init_params graph_params = {
+        /*.mem_size   =*/ 2*GGML_MAX_NODES*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    size_t alloc_size = 0;
+    {
+        struct ggml_context * ctx0 = ggml_init(graph_params);
+        struct ggml_cgraph g = ggml_build_forward(input);
+        g.n_nodes = 0;
+        g.n_leafs = 0;
+        build(ctx0, &g, NULL, 0, layers, input, kv, kq_scale);
+
+        struct ggml_allocr * measure = ggml_allocr_new_measure(32);
+        alloc_size = ggml_allocr_alloc_graph(measure, &g) + 32;
+        ggml_allocr_free(measure);
+        ggml_free(ctx0);
+    }
+
+    void * alloc_buffer = malloc(alloc_size);
+    struct ggml_allocr * alloc = ggml_allocr_new(alloc_buffer, alloc_size, 32);
+
+    void * work = NULL;
+    size_t work_size = 0;
+
+    for (int n_threads = 1; n_threads <= 8; n_threads *= 2) {
+        struct ggml_threadpool * pool = n_threads > 1 ? ggml_threadpool_new(n_threads) : NULL;
+
+        struct ggml_cplan plan;
+        memset(&plan, 0, sizeof(plan));
+
+        for (int iter = 0; iter < N_ITER; iter++) {
+            struct ggml_context * ctx0 = ggml_init(graph_params);
+            struct ggml_cgraph g = ggml_build_forward(input);
+            g.n_nodes = 0;
+            g.n_leafs = 0;
+            out = build(ctx0, &g, NULL, 0, layers, input, kv, kq_scale);
+            g.n_threads  = n_threads;
+            g.threadpool = pool;
+
+            ggml_allocr_reset(alloc);
+            if (ggml_allocr_alloc_graph(alloc, &g) > alloc_size) {
+                fprintf(stderr, "%s: the graph does not fit in the buffer it was measured with\n", __func__);
+                n_failed++;
+                ggml_free(ctx0);
+                break;
+            }
+
+            // the graph is built again, but in the same place, so the plan keeps its dependencies
+            struct ggml_sched * sched = plan.sched;
+            plan = ggml_graph_plan(&g, n_threads);
+            plan.sched = sched;
+            if (plan.work_size > work_size) {
+                work_size = plan.work_size;
+                work = realloc(work, work_size);
+            }
+            plan.work_data = work;
+
+            memset(kv->data, 0, ggml_nbytes(kv));
+            memset(alloc_buffer, 0, alloc_size);
+            ggml_graph_compute_plan(&g, &plan);
+
+            float max_diff = 0.0f;
+            for (int i = 0; i < ggml_nelements(out); i++) {
+                max_diff = fmaxf(max_diff, fabsf(ggml_get_f32_1d(out, i) - expected[i]));
+            }
+            ggml_free(ctx0);
+            if (max_diff > 1e-5f) {
+                fprintf(stderr, "%s: allocated graph, %d threads, iteration %d: max difference %g\n", __func__, n_threads, iter, (double) max_diff);
+                n_failed++;
+                break;
+            }
+        }
+
+        ggml_cplan_free(&plan);
+        ggml_threadpool_free(pool);
+    }
+
+    free(work);
+    ggml_allocr_free(alloc);
+    free(alloc_buffer);
+    free(expected);
+    free(scratch);
+    ggml_free(ctx);
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,261 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+
+// For command line
+#include "cxxopts.hpp"
+
+// Histogram of the observed values
+#include <histogram.h>
+
+// Canary, prefix and vector scans
+#include <scan.h>
+
+// Summary of bounded runs
+#include <report.h>
+
+// Recordings written by the listeners' --record
+#include <recording.h>
+
+struct ReplayConfig {
+  uint32_t canary;
+  size_t top;
+  bool perIteration;
+  // Detectors besides the canary count
+  bool vectors;
+  size_t vectorLength;
+  size_t maxZeros;
+  size_t guard;
+  std::vector<uint8_t> prefix;
+};
+
+struct Hit {
+  const char *kind;
+  size_t index;
+};
+
+// What the workers found in one chunk, printed in iteration order
+struct ChunkResult {
+  bool corrupt = false;
+  std::vector<leftoverlocals::Histogram::Entry> top;
+  std::vector<Hit> hits;
+};
+
+// Replays chunks [begin, end) of the recording. Workers claim chunks from
+// a shared counter, so the chunks of one worker are not contiguous and
+// everything that is printed is collected per chunk first.
+void replay(const leftoverlocals::Reader &reader, size_t begin, size_t end, const ReplayConfig &cfg,
+	    unsigned threads, std::vector<ChunkResult> &results, leftoverlocals::Report &report) {
+  std::atomic<size_t> next(begin);
+  std::vector<leftoverlocals::Report> partial(threads);
+
+  auto work = [&](leftoverlocals::Report &mine) {
+    std::vector<uint32_t> dump;
+    leftoverlocals::Histogram observations;
+    leftoverlocals::scan::ZeroRunScanner scanner(cfg.vectorLength, cfg.maxZeros, cfg.guard);
+    std::vector<size_t> found;
+
+    for (size_t i = next++; i < end; i = next++) {
+      ChunkResult &r = results[i - begin];
+      const leftoverlocals::Reader::Chunk &chunk = reader.chunk(i);
+      dump.resize(chunk.words);
+      if (!reader.read(i, dump.data())) {
+	r.corrupt = true;
+	continue;
+      }
+
+      observations.clear();
+      observations.addAll(dump.data(), dump.size());
+      if (cfg.perIteration) {
+	r.top = observations.top(cfg.top);
+      }
+      mine.observations.merge(observations);
+      mine.iterations++;
+      mine.bytesScanned += dump.size() * sizeof(uint32_t);
+      if (leftoverlocals::scan::countMatches(dump.data(), dump.size(), cfg.canary)) {
+	mine.canaryIterations++;
+      }
+
+      if (cfg.vectors) {
+	found.clear();
+	scanner.scan(dump.data(), dump.size(), found);
+	for (size_t index : found) {
+	  r.hits.push_back({"vector", index});
+	}
+      }
+      if (!cfg.prefix.empty()) {
+	found.clear();
+	leftoverlocals::scan::findPrefix(dump.data(), dump.size() * sizeof(uint32_t), cfg.prefix.data(), cfg.prefix.size(), found);
+	for (size_t offset : found) {
+	  r.hits.push_back({"prefix", offset});
+	}
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.push_back(std::thread(work, std::ref(partial[t])));
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  for (auto &p : partial) {
+    report.merge(p);
+  }
+}
+
+bool parseHex(const std::string &hex, std::vector<uint8_t> &bytes) {
+  if (hex.size() % 2) {
+    return false;
+  }
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    char *end;
+    std::string pair = hex.substr(i, 2);
+    long b = strtol(pair.c_str(), &end, 16);
+    if (*end) {
+      return false;
+    }
+    bytes.push_back((uint8_t) b);
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+
+  cxxopts::Options options("replay", "runs the listeners' detectors over dumps recorded with --record");
+
+  options.add_options()
+    ("file", "Recording to replay", cxxopts::value<std::string>())
+    ("t,threads", "Worker threads (default: one per core)", cxxopts::value<unsigned>()->default_value("0"))
+    ("from", "First iteration to replay", cxxopts::value<uint64_t>()->default_value("0"))
+    ("to", "Stop before this iteration (default: the end of the recording)", cxxopts::value<uint64_t>())
+    ("c,canary", "Canary value counted in the summary (default: the recording's, or 123)", cxxopts::value<uint32_t>())
+    ("per-iteration", "Print the histogram of every dump, like the listeners do when they run forever")
+    ("top", "Number of values in each histogram", cxxopts::value<size_t>()->default_value("10"))
+    ("vectors", "Look for zero-delimited vectors, like the clCovertListener in the PoC")
+    ("vector-length", "Elements in a vector", cxxopts::value<size_t>()->default_value("4096"))
+    ("max-zeros", "Zeros allowed inside a vector", cxxopts::value<size_t>()->default_value("4"))
+    ("guard", "Zeros required on each side of a vector", cxxopts::value<size_t>()->default_value("2"))
+    ("prefix", "Look for this byte prefix, given in hex (e.g. 7b000000)", cxxopts::value<std::string>())
+    ("fail-without-hits", "Exit with status 2 if no detector found anything, for regression tests")
+    ("h,help", "Print usage");
+  options.parse_positional({"file"});
+  options.positional_help("FILE");
+
+  auto result = options.parse(argc, argv);
+
+  if (result.count("help") || !result.count("file")) {
+      std::cout << options.help() << std::endl;
+      exit(result.count("help") ? 0 : 1);
+  }
+
+  std::string path = result["file"].as<std::string>();
+  leftoverlocals::Reader reader(path);
+  if (!reader.ok()) {
+    std::cout << path << ": " << reader.errorMessage() << std::endl;
+    exit(1);
+  }
+  if (!reader.indexed()) {
+    std::cout << path << ": no index, the recording was interrupted; replaying the " << reader.chunks() << " complete iterations" << std::endl;
+  }
+
+  ReplayConfig cfg;
+  std::string recordedCanary = reader.metadata("canary");
+  cfg.canary = 123;
+  if (result.count("canary")) {
+    cfg.canary = result["canary"].as<uint32_t>();
+  }
+  else if (!recordedCanary.empty()) {
+    cfg.canary = (uint32_t) std::stoul(recordedCanary);
+  }
+  cfg.top = result["top"].as<size_t>();
+  cfg.perIteration = result.count("per-iteration");
+  cfg.vectors = result.count("vectors");
+  cfg.vectorLength = result["vector-length"].as<size_t>();
+  cfg.maxZeros = result["max-zeros"].as<size_t>();
+  cfg.guard = result["guard"].as<size_t>();
+  if (result.count("prefix") && !parseHex(result["prefix"].as<std::string>(), cfg.prefix)) {
+    std::cout << "invalid prefix: " << result["prefix"].as<std::string>() << std::endl;
+    exit(1);
+  }
+
+  unsigned threads = result["threads"].as<unsigned>();
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Only the chunks in range are decoded
+  size_t begin = reader.seek(result["from"].as<uint64_t>());
+  size_t end = result.count("to") ? reader.seek(result["to"].as<uint64_t>()) : reader.chunks();
+  end = std::max(begin, end);
+
+  std::cout << "replaying " << path << ": " << reader.metadata("device") << " (" << reader.metadata("api")
+	    << ", workgroup size " << reader.metadata("workgroup-size") << ", grid size " << reader.metadata("grid-size")
+	    << "), " << end - begin << " of " << reader.chunks() << " iterations on " << threads << " threads" << std::endl;
+
+  leftoverlocals::Report report;
+  report.name = reader.metadata("device");
+  std::vector<ChunkResult> results(end - begin);
+  auto start = std::chrono::steady_clock::now();
+  replay(reader, begin, end, cfg, threads, results, report);
+  report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (cfg.perIteration) {
+    std::cout << "printing out a histogram of observations. "<< std::endl;
+    std::cout << "---------" << std::endl;
+  }
+  size_t corrupt = 0;
+  size_t hits = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    ChunkResult &r = results[i];
+    uint64_t iteration = reader.chunk(begin + i).iteration;
+    if (r.corrupt) {
+      printf("iteration %llu: corrupt chunk\n", (unsigned long long) iteration);
+      corrupt++;
+      continue;
+    }
+    if (cfg.perIteration) {
+      leftoverlocals::Histogram::printTop(cfg.top, r.top);
+    }
+    for (auto &h : r.hits) {
+      printf("iteration %llu: %s at %zu\n", (unsigned long long) iteration, h.kind, h.index);
+    }
+    hits += r.hits.size();
+    if (cfg.perIteration) {
+      std::cout << "------------\nNext iteration starting" << std::endl;
+    }
+  }
+
+  report.print();
+  report.printJson(cfg.canary);
+  printf("\n");
+
+  if (corrupt) {
+    exit(1);
+  }
+  if (result.count("fail-without-hits") && hits == 0 && report.canaryIterations == 0) {
+    exit(2);
+  }
+  return 0;
+}
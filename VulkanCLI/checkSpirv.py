@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+#
+# Copyright 2023 Trail of Bits
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Checks that the checked-in SPIR-V of a kernel still matches its OpenCL C
+# source, for when the modules cannot be regenerated with clspv. It does not
+# replace spirv-val (see the check target of the Makefiles), it only covers
+# what the host code relies on:
+#
+#   - the module is well formed at the word level and every result id is
+#     defined once and below the id bound,
+#   - the clspv reflection lists the kernel's arguments in order, with their
+#     names: global pointers as storage buffers bound at their ordinal,
+#     local pointers as workgroup arrays sized by LOCAL_SIZE_SPEC_ID from
+#     common.h,
+#   - the workgroup array is sized by a specialization constant with that
+#     SpecId, which is used for nothing else (loop bounds come from canary[1]),
+#   - the .cinit file holds the same words as the .spv file.
+#
+# usage: checkSpirv.py KERNEL.cl...   (the modules are in spir-v/ next to it)
+
+import os
+import re
+import struct
+import sys
+
+MAGIC = 0x07230203
+
+OP_STRING = 7
+OP_EXT_INST_IMPORT = 11
+OP_EXT_INST = 12
+OP_SPEC_CONSTANT = 50
+OP_CONSTANT = 43
+OP_TYPE_ARRAY = 28
+OP_TYPE_POINTER = 32
+OP_VARIABLE = 59
+OP_DECORATE = 71
+OP_FUNCTION = 54
+OP_FUNCTION_END = 56
+
+DECORATION_SPEC_ID = 1
+STORAGE_CLASS_WORKGROUP = 4
+
+# NonSemantic.ClspvReflection instructions
+REFL_KERNEL = 1
+REFL_ARGUMENT_INFO = 2
+REFL_ARGUMENT_STORAGE_BUFFER = 3
+REFL_ARGUMENT_WORKGROUP = 11
+
+# Position of the result id of the opcodes these modules use; the others have
+# no result or are not checked
+RESULT_INDEX = {
+    OP_STRING: 0, OP_EXT_INST_IMPORT: 0, OP_EXT_INST: 1,
+    19: 0, 20: 0, 21: 0, 23: 0, OP_TYPE_ARRAY: 0, 29: 0, 30: 0, OP_TYPE_POINTER: 0, 33: 0,
+    OP_CONSTANT: 1, 44: 1, OP_SPEC_CONSTANT: 1, 51: 1, 52: 1,
+    OP_FUNCTION: 1, 55: 1, 57: 1, OP_VARIABLE: 1, 61: 1, 65: 1, 66: 1, 67: 1,
+    81: 1, 82: 1, 83: 1, 124: 1, 128: 1, 130: 1, 132: 1, 134: 1,
+    169: 1, 170: 1, 171: 1, 172: 1, 173: 1, 174: 1, 175: 1, 176: 1, 177: 1, 178: 1, 179: 1,
+    194: 1, 196: 1, 197: 1, 198: 1, 199: 1, 245: 1, 248: 0,
+}
+
+
+class CheckError(Exception):
+    pass
+
+
+def read_words(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if len(data) % 4 != 0:
+        raise CheckError('%s: size is not a multiple of 4' % path)
+    return list(struct.unpack('<%dI' % (len(data) // 4), data))
+
+
+def decode_string(words):
+    data = b''.join(struct.pack('<I', w) for w in words)
+    return data.split(b'\0')[0].decode()
+
+
+def parse_module(path):
+    words = read_words(path)
+    if len(words) < 5 or words[0] != MAGIC:
+        raise CheckError('%s: not a SPIR-V module' % path)
+    bound = words[3]
+    instructions = []
+    i = 5
+    while i < len(words):
+        count = words[i] >> 16
+        if count == 0 or i + count > len(words):
+            raise CheckError('%s: bad word count at word %d' % (path, i))
+        instructions.append((words[i] & 0xffff, words[i + 1:i + count]))
+        i += count
+
+    defined = set()
+    for opcode, operands in instructions:
+        if opcode in RESULT_INDEX:
+            result = operands[RESULT_INDEX[opcode]]
+            if result == 0 or result >= bound:
+                raise CheckError('%s: id %d is outside the bound %d' % (path, result, bound))
+            if result in defined:
+                raise CheckError('%s: id %d is defined twice' % (path, result))
+            defined.add(result)
+    return words, instructions
+
+
+def kernel_signatures(source):
+    # Drops comments, then takes the parameters of every __kernel function
+    source = re.sub(r'/\*.*?\*/|//[^\n]*', '', source, flags=re.S)
+    kernels = {}
+    for match in re.finditer(r'__kernel\s+void\s+(\w+)\s*\(([^)]*)\)', source):
+        params = []
+        for param in match.group(2).split(','):
+            tokens = re.findall(r'\w+', param)
+            space = 'local' if ('local' in tokens or '__local' in tokens) else \
+                    'global' if ('global' in tokens or '__global' in tokens) else 'private'
+            params.append((space, tokens[-1]))
+        kernels[match.group(1)] = params
+    return kernels
+
+
+def local_size_spec_id(common_h):
+    with open(common_h) as f:
+        match = re.search(r'#define\s+LOCAL_SIZE_SPEC_ID\s+(\d+)', f.read())
+    if not match:
+        raise CheckError('%s: LOCAL_SIZE_SPEC_ID is not defined' % common_h)
+    return int(match.group(1))
+
+
+def check_kernel(cl_path):
+    directory, name = os.path.split(cl_path)
+    base = os.path.splitext(name)[0]
+    spv_path = os.path.join(directory, 'spir-v', base + '.spv')
+    cinit_path = os.path.join(directory, 'spir-v', base + '.cinit')
+    spec_id = local_size_spec_id(os.path.join(directory, 'common.h'))
+
+    with open(cl_path) as f:
+        kernels = kernel_signatures(f.read())
+    words, instructions = parse_module(spv_path)
+
+    strings = {}
+    constants = {}
+    spec_ids = {}
+    pointers = {}
+    arrays = {}
+    workgroup_arrays = []
+    reflection = None
+    for opcode, operands in instructions:
+        if opcode == OP_STRING:
+            strings[operands[0]] = decode_string(operands[1:])
+        elif opcode == OP_CONSTANT:
+            constants[operands[1]] = operands[2]
+        elif opcode == OP_DECORATE and operands[1] == DECORATION_SPEC_ID:
+            spec_ids[operands[0]] = operands[2]
+        elif opcode == OP_TYPE_ARRAY:
+            arrays[operands[0]] = operands[2]
+        elif opcode == OP_TYPE_POINTER:
+            pointers[operands[0]] = (operands[1], operands[2])
+        elif opcode == OP_VARIABLE and operands[2] == STORAGE_CLASS_WORKGROUP:
+            workgroup_arrays.append(arrays.get(pointers[operands[0]][1]))
+        elif opcode == OP_EXT_INST_IMPORT and decode_string(operands[1:]).startswith('NonSemantic.ClspvReflection'):
+            reflection = operands[0]
+    if reflection is None:
+        raise CheckError('%s: no clspv reflection' % spv_path)
+
+    refl = [(operands[3], operands[1], operands[4:]) for opcode, operands in instructions
+            if opcode == OP_EXT_INST and operands[2] == reflection]
+    arg_infos = {result: strings[args[0]] for inst, result, args in refl if inst == REFL_ARGUMENT_INFO}
+
+    for kernel, params in kernels.items():
+        found = [(result, args) for inst, result, args in refl
+                 if inst == REFL_KERNEL and strings.get(args[1]) == kernel]
+        if not found:
+            raise CheckError('%s: kernel %s is not in the reflection' % (spv_path, kernel))
+        kernel_id, args = found[0]
+        if len(args) < 3 or constants.get(args[2]) != len(params):
+            raise CheckError('%s: kernel %s has %d arguments, the reflection says %s' %
+                             (spv_path, kernel, len(params), constants.get(args[2]) if len(args) > 2 else 'nothing'))
+
+        reflected = {}
+        for inst, result, args in refl:
+            if inst in (REFL_ARGUMENT_STORAGE_BUFFER, REFL_ARGUMENT_WORKGROUP) and args[0] == kernel_id:
+                reflected[constants[args[1]]] = (inst, args)
+        for ordinal, (space, param) in enumerate(params):
+            if ordinal not in reflected:
+                raise CheckError('%s: argument %d (%s) of %s is not in the reflection' % (spv_path, ordinal, param, kernel))
+            inst, args = reflected[ordinal]
+            info = arg_infos.get(args[-1])
+            if info != param:
+                raise CheckError('%s: argument %d of %s is %s in the source and %s in the module' %
+                                 (spv_path, ordinal, kernel, param, info))
+            if space == 'global':
+                if inst != REFL_ARGUMENT_STORAGE_BUFFER or constants[args[3]] != ordinal:
+                    raise CheckError('%s: %s should be a storage buffer at binding %d' % (spv_path, param, ordinal))
+            elif space == 'local':
+                if inst != REFL_ARGUMENT_WORKGROUP or constants[args[2]] != spec_id or constants[args[3]] != 4:
+                    raise CheckError('%s: %s should be a workgroup array of uints sized by SpecId %d' %
+                                     (spv_path, param, spec_id))
+                lengths = [length for length in workgroup_arrays if spec_ids.get(length) == spec_id]
+                if not lengths:
+                    raise CheckError('%s: no workgroup array is sized by SpecId %d' % (spv_path, spec_id))
+                # the length is only the array's, the kernels read their loop bounds from canary[1]
+                in_function = False
+                for opcode, operands in instructions:
+                    in_function = (in_function or opcode == OP_FUNCTION) and opcode != OP_FUNCTION_END
+                    if in_function and opcode != OP_FUNCTION and lengths[0] in operands[2:]:
+                        raise CheckError('%s: the code of %s uses the workgroup array length' % (spv_path, kernel))
+
+    with open(cinit_path) as f:
+        cinit = [int(w) for w in re.findall(r'\d+', f.read())]
+    if cinit != words:
+        raise CheckError('%s does not hold the words of %s' % (cinit_path, spv_path))
+
+
+def main(argv):
+    if len(argv) < 2:
+        print('usage: %s KERNEL.cl...' % argv[0], file=sys.stderr)
+        return 2
+    failed = False
+    for cl_path in argv[1:]:
+        try:
+            check_kernel(cl_path)
+            print('%s: ok' % cl_path)
+        except CheckError as e:
+            print('error: %s' % e, file=sys.stderr)
+            failed = True
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
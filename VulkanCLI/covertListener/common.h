@@ -14,16 +14,11 @@
    limitations under the License.
 */
 
-// All in size of 8 bit int
-
-#if !defined(SHARED_MEMORY_SIZE) 
-#define SHARED_MEMORY_SIZE 4096
-#endif
-
-// In case we want to try out of bounds accesses
-#if !defined(SHARED_MEMORY_SIZE_TRAVERSED) 
-#define SHARED_MEMORY_SIZE_TRAVERSED (SHARED_MEMORY_SIZE)
-#endif
-
-
-
+// Local memory is sized at runtime. The host sets the number of uints in
+// the local array through specialization constant LOCAL_SIZE_SPEC_ID,
+// which clspv assigns to the first local kernel argument, and also stores
+// it in canary[1] for the kernel's loop bounds.
+#define LOCAL_SIZE_SPEC_ID 3
+
+// Used when the device does not report its local memory size
+#define DEFAULT_LOCAL_SIZE 4096
@@ -16,13 +16,13 @@
 
 #include "common.h"
 
-__kernel void covertListener(__global volatile uint *a, __global volatile uint *b, __global volatile uint *c, __global volatile uint* canary) {
-  local volatile uint lm[SHARED_MEMORY_SIZE];
+__kernel void covertListener(__global volatile uint *a, __global volatile uint *b, __global volatile uint *c, __global volatile uint* canary, local volatile uint *lm) {
+  uint size = canary[1];
 
   // gotta use all the args or CLSPV just optimizes them out
-  for (int i = get_local_id(0); i < SHARED_MEMORY_SIZE_TRAVERSED; i+= get_local_size(0)) {
-    c[(SHARED_MEMORY_SIZE_TRAVERSED * get_group_id(0)) + i] = lm[i];
-    a[(SHARED_MEMORY_SIZE_TRAVERSED * get_group_id(0)) + i] = *canary;
-    b[(SHARED_MEMORY_SIZE_TRAVERSED * get_group_id(0)) + i] = 123;    
+  for (int i = get_local_id(0); i < size; i+= get_local_size(0)) {
+    c[(size * get_group_id(0)) + i] = lm[i];
+    a[(size * get_group_id(0)) + i] = *canary;
+    b[(size * get_group_id(0)) + i] = 123;    
   }    
 }
@@ -20,6 +20,10 @@
 #include <cassert>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <memory>
 
 // For command line
 #include <cxxopts.hpp>
@@ -27,10 +31,340 @@
 // Some common sizes across main and the kernel
 #include "common.h"
 
-// for sorting the histogram
-bool cmp(std::pair<int, int> a,
-	 std::pair<int, int> b) {
-    return a.second > b.second;
+// Histogram of the observed values
+#include <histogram.h>
+
+// Summary of bounded runs
+#include <report.h>
+
+// Pipeline cache kept across runs
+#include <vkcache.h>
+
+// Tuned launch configurations
+#include <profile.h>
+
+// Compressed recordings of the dumps
+#include <recording.h>
+
+std::vector<uint32_t> spvCode =
+#include "./spir-v/covertListener.cinit"
+  ;
+
+struct ListenerConfig {
+  int gridSize;
+  int workgroupSize;
+  bool persistent;
+  bool staging;
+  // Bounds of the run; negative and zero mean unbounded
+  long iterations;
+  double duration;
+  uint32_t canary;
+  // Bytes of local memory per workgroup, 0 for all the device has
+  long localMem;
+  bool useCache;
+  // Dispatches recorded into each submit, each dumping into its own
+  // slice of c
+  int batch;
+  // Every dump is written to this file when set
+  std::string recordPath;
+  // Dispatch profiles written at the end of a bounded run when set
+  std::string timingsPath;
+  std::string tracePath;
+};
+
+// Runs the listener on one physical device. An unbounded run goes on
+// forever and prints the histogram of every dump; a bounded one prints
+// nothing and accumulates the dumps, timings and canary hits into the
+// report.
+void listen(easyvk::Instance &instance, VkPhysicalDevice physicalDevice, const ListenerConfig &cfg, leftoverlocals::Report &report) {
+  bool interactive = cfg.iterations < 0 && cfg.duration <= 0;
+  auto device = easyvk::Device(instance, physicalDevice);
+  report.name = device.properties.deviceName;
+
+  if (interactive) {
+    std::cout << "Using device: " << device.properties.deviceName << "\n";
+  }
+
+  if (cfg.useCache) {
+    leftoverlocals::loadPipelineCache(device);
+  }
+
+  // The local array is sized when the pipeline is built
+  uint32_t localSize = cfg.localMem > 0 ? cfg.localMem / 4 : device.properties.limits.maxComputeSharedMemorySize / 4;
+  if (localSize == 0) {
+    localSize = DEFAULT_LOCAL_SIZE;
+  }
+
+  int size = localSize * cfg.gridSize;
+
+  std::unique_ptr<leftoverlocals::Recorder> recorder;
+  if (!cfg.recordPath.empty()) {
+    recorder.reset(new leftoverlocals::Recorder(cfg.recordPath,
+      "api=vulkan\ndevice=" + report.name +
+      "\nworkgroup-size=" + std::to_string(cfg.workgroupSize) +
+      "\ngrid-size=" + std::to_string(cfg.gridSize) +
+      "\nlocal-mem=" + std::to_string(localSize * 4) +
+      "\ncanary=" + std::to_string(cfg.canary) + "\n"));
+    if (!recorder->ok()) {
+      report.error = "cannot write " + cfg.recordPath;
+      if (interactive) {
+	std::cout << report.error << std::endl;
+	exit(1);
+      }
+      device.teardown();
+      return;
+    }
+  }
+
+  // Create some GPU buffers. They are needed so that the compiler
+  // doesn't just optimize away the kernel
+  auto a = easyvk::Buffer(device, size, cfg.staging);
+  auto b = easyvk::Buffer(device, size, cfg.staging);
+  auto c = easyvk::Buffer(device, size * cfg.batch, cfg.staging);
+  auto canary = easyvk::Buffer(device, 2);
+
+  if (interactive) {
+    std::cout << "printing out a histogram of observations. "<< std::endl;
+  }
+
+  canary.store(0,cfg.gridSize);
+  canary.store(1,localSize);
+  canary.flush();
+
+  if (interactive) {
+    std::cout << "---------" << std::endl;
+  }
+
+  long iterations = 0;
+
+  // Sized for the dump so counting never has to grow the table
+  leftoverlocals::Histogram observations(size);
+  if (!interactive) {
+    report.observations.reserve(size);
+  }
+
+  bool persistent = cfg.persistent;
+  std::vector<easyvk::Buffer> bufs = {a, b, c, canary};
+
+  // Breaks every dispatch down into host, submit, GPU and wait time.
+  // Bounded runs take their dispatch timings from it, so that the
+  // command buffer they time is the one run() recorded; runs that never
+  // end never write the profile.
+  easyvk::Profiler profiler(report.name);
+  bool profiling = !interactive;
+
+  // In persistent mode the shader module, descriptor sets, pipeline,
+  // fence and command pool are created once up front and the same
+  // program is re-submitted every iteration.
+  easyvk::Program *persistentProgram = nullptr;
+  if (persistent) {
+    persistentProgram = new easyvk::Program(device, spvCode, bufs);
+    persistentProgram->setWorkgroups(cfg.gridSize);
+    persistentProgram->setWorkgroupSize(cfg.workgroupSize);
+    persistentProgram->setSpecConstant(LOCAL_SIZE_SPEC_ID, localSize);
+    persistentProgram->setBatch(cfg.batch, 2);
+    persistentProgram->initialize("covertListener");
+    if (profiling) {
+      persistentProgram->setProfiler(&profiler);
+    }
+  }
+  
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  // write indefinitely, or until the bounds of the run are reached
+  while (interactive ||
+	 ((cfg.iterations < 0 || iterations < cfg.iterations) &&
+	  (cfg.duration <= 0 || elapsed() < cfg.duration))) {
+    iterations++;
+
+    // The kernel overwrites every element of a, b and c, so the
+    // persistent mode skips the host-side reset.
+    if (!persistent) {
+      // Write initial values to the buffers.
+      a.clear();
+      b.clear();
+      c.clear();
+      a.upload();
+      b.upload();
+      c.upload();
+    }
+
+    easyvk::Program *program = persistentProgram;
+    if (!persistent) {
+      program = new easyvk::Program(device, spvCode, bufs);
+    
+      // Dispatch 4 work groups of size 1 to carry out the work.
+      program->setWorkgroups(cfg.gridSize);
+      program->setWorkgroupSize(cfg.workgroupSize);
+      program->setSpecConstant(LOCAL_SIZE_SPEC_ID, localSize);
+      program->setBatch(cfg.batch, 2);
+    
+      program->initialize("covertListener");
+      if (profiling) {
+	program->setProfiler(&profiler);
+      }
+    }
+
+    // The pipeline is in the cache now, keep it for the next run
+    if (cfg.useCache && iterations == 1) {
+      leftoverlocals::savePipelineCache(device);
+    }
+
+    // Run the kernel. Bounded runs also time the dispatch on the device
+    // with the profiler's timestamps. A batch is timed as a whole and
+    // reported as that many dispatches of the average length.
+    program->run();
+    if (profiling && profiler.samples().back().gpu >= 0) {
+      for (int k = 0; k < cfg.batch; k++) {
+	report.dispatchMicros.push_back(profiler.samples().back().gpu / cfg.batch);
+      }
+    }
+
+    // Check the return values, straight from the mapping
+    c.download();
+    c.invalidate();
+    if (recorder) {
+      // Every dispatch of the batch is its own iteration in the recording
+      for (int k = 0; k < cfg.batch; k++) {
+	recorder->record((uint64_t) (iterations - 1) * cfg.batch + k, c.data() + (size_t) k * size, size);
+      }
+    }
+    if (interactive) {
+      observations.clear();
+      observations.addAll(c.data(), c.size());
+      observations.printTop(10);
+    }
+    else {
+      for (int k = 0; k < cfg.batch; k++) {
+	uint64_t hits = report.observations.count(cfg.canary);
+	report.observations.addAll(c.data() + (size_t) k * size, size);
+	if (report.observations.count(cfg.canary) != hits) {
+	  report.canaryIterations++;
+	  if (report.firstCanarySeconds < 0) {
+	    report.firstCanarySeconds = elapsed();
+	  }
+	}
+      }
+    }
+
+    if (!persistent) {
+      program->teardown();
+      delete program;
+    }
+
+    if (interactive) {
+      std::cout << "------------\nNext iteration starting" << std::endl;
+    }
+  }
+  
+  // Cleanup.
+  report.iterations = iterations * cfg.batch;
+  report.seconds = elapsed();
+  report.bytesScanned = (uint64_t) iterations * cfg.batch * size * sizeof(uint32_t);
+  if (recorder) {
+    recorder->close();
+    if (!recorder->ok()) {
+      report.error = "error writing " + cfg.recordPath;
+    }
+  }
+  if (!cfg.timingsPath.empty()) {
+    std::ofstream out(cfg.timingsPath);
+    profiler.writeJson(out);
+  }
+  if (!cfg.tracePath.empty()) {
+    std::ofstream out(cfg.tracePath);
+    profiler.writeChromeTrace(out);
+  }
+
+  if (persistentProgram) {
+    persistentProgram->teardown();
+    delete persistentProgram;
+  }
+  a.teardown();
+  b.teardown();
+  c.teardown();
+  canary.teardown();
+  device.teardown();
+}
+
+// Names the device and driver in the autotuner's profiles
+std::string profilePath(VkPhysicalDevice physicalDevice) {
+  VkPhysicalDeviceProperties p;
+  vkGetPhysicalDeviceProperties(physicalDevice, &p);
+  return leftoverlocals::Profile::path("vulkan", std::string(p.deviceName) + "\n" +
+				       std::to_string(p.vendorID) + ":" + std::to_string(p.deviceID) + ":" +
+				       std::to_string(p.driverVersion));
+}
+
+// Launch sizes given on the command line win over the device's profile
+ListenerConfig deviceConfig(VkPhysicalDevice physicalDevice, ListenerConfig cfg, const cxxopts::ParseResult &result) {
+  leftoverlocals::Profile profile;
+  if (result.count("no-profile") || !profile.load(profilePath(physicalDevice))) {
+    return cfg;
+  }
+  if (!result.count("workgroup-size")) {
+    cfg.workgroupSize = profile.workgroupSize;
+  }
+  if (!result.count("grid-size")) {
+    cfg.gridSize = profile.gridSize;
+  }
+  return cfg;
+}
+
+// Runs every (workgroup size, grid size) pair for a fixed time and saves
+// the one that samples the most local memory per second as the device's
+// profile.
+void autotune(easyvk::Instance &instance, VkPhysicalDevice physicalDevice, ListenerConfig cfg, double seconds) {
+  VkPhysicalDeviceProperties p;
+  vkGetPhysicalDeviceProperties(physicalDevice, &p);
+  long localMem = cfg.localMem > 0 ? cfg.localMem : p.limits.maxComputeSharedMemorySize;
+  int maxWorkgroupSize = std::min<uint32_t>(1024, std::min(p.limits.maxComputeWorkGroupSize[0], p.limits.maxComputeWorkGroupInvocations));
+  // Each dump has to fit in one storage buffer binding, and c holds --batch
+  // of them
+  int maxGridSize = std::max<long>(1, std::min<long>(1024, p.limits.maxStorageBufferRange / std::max(1L, localMem * cfg.batch)));
+
+  std::cout << "autotuning " << p.deviceName << ", " << seconds << " s per configuration" << std::endl;
+  printf("%6s %6s %12s %14s\n", "wgs", "gs", "iterations", "MB/s sampled");
+
+  cfg.iterations = -1;
+  cfg.duration = seconds;
+  // Tuning runs are throwaway
+  cfg.recordPath.clear();
+  cfg.timingsPath.clear();
+  cfg.tracePath.clear();
+  leftoverlocals::Profile best;
+  for (int wgs : leftoverlocals::powersOfTwo(32, maxWorkgroupSize)) {
+    for (int gs : leftoverlocals::powersOfTwo(1, maxGridSize)) {
+      cfg.workgroupSize = wgs;
+      cfg.gridSize = gs;
+      leftoverlocals::Report report;
+      listen(instance, physicalDevice, cfg, report);
+      if (!report.error.empty() || report.seconds <= 0) {
+	printf("%6d %6d %12s %14s\n", wgs, gs, "-", "failed");
+	continue;
+      }
+      double bytesPerSecond = report.bytesScanned / report.seconds;
+      printf("%6d %6d %12ld %14.1f\n", wgs, gs, report.iterations, bytesPerSecond / 1e6);
+      if (bytesPerSecond > best.bytesPerSecond) {
+	best.workgroupSize = wgs;
+	best.gridSize = gs;
+	best.bytesPerSecond = bytesPerSecond;
+      }
+    }
+  }
+
+  if (best.bytesPerSecond <= 0) {
+    std::cout << "no configuration ran" << std::endl;
+    return;
+  }
+  std::string path = profilePath(physicalDevice);
+  printf("best: --workgroup-size %d --grid-size %d (%.1f MB/s)\n", best.workgroupSize, best.gridSize, best.bytesPerSecond / 1e6);
+  if (best.save(path)) {
+    std::cout << "saved profile to " << path << std::endl;
+  }
 }
 
 int main(int argc, char* argv[]) {
@@ -45,7 +379,21 @@ int main(int argc, char* argv[]) {
     ("wgs, workgroup-size", "Number of threads in the workgroup", cxxopts::value<int>()->default_value("256"))
     ("gs, grid-size", "Number of workgroups per grid", cxxopts::value<int>()->default_value("32"))
     ("d,device", "Device id (int)", cxxopts::value<int>()->default_value("0"))
-
+    ("p,persistent", "Build the pipeline once and re-submit it every iteration")
+    ("s,staging", "Keep the buffers in device-local memory and read them back through staging buffers")
+    ("m,local-mem", "Bytes of local memory dumped per workgroup (default: all the device reports)", cxxopts::value<long>()->default_value("0"))
+    ("batch", "Dispatches recorded into each submit, each dumping into its own slice of the output buffer", cxxopts::value<int>()->default_value("1"))
+    ("no-cache", "Always build the pipeline instead of loading it from the pipeline cache")
+    ("autotune", "Benchmark workgroup and grid sizes on the device (every device with --all-devices) and save the fastest as its profile")
+    ("tune-seconds", "Seconds each configuration runs for when autotuning", cxxopts::value<double>()->default_value("0.5"))
+    ("no-profile", "Ignore the tuned profile and use the default workgroup and grid sizes")
+    ("record", "Write every dump to this file, compressed and indexed (one file per device with --all-devices, suffixed with the device id)", cxxopts::value<std::string>())
+    ("timings", "After a bounded run, write the host, submit, GPU and wait time of the dispatches to this JSON file (per device with --all-devices)", cxxopts::value<std::string>())
+    ("trace", "After a bounded run, write the dispatches to this file in Chrome trace format (per device with --all-devices)", cxxopts::value<std::string>())
+    ("a,all-devices", "Scan every device in parallel, one worker per device, and print one report")
+    ("i,iterations", "Stop after this many iterations per device and print a JSON summary (default with --all-devices: 100)", cxxopts::value<long>())
+    ("duration", "Stop after this many seconds per device and print a JSON summary", cxxopts::value<double>())
+    ("c,canary", "Canary value counted in the summary", cxxopts::value<uint32_t>()->default_value("123"))
     ("h,help", "Print usage");
 
 
@@ -72,109 +420,95 @@ int main(int argc, char* argv[]) {
     exit(0);
   }
  
-  int deviceID = result["device"].as<int>();
-    
-  // Create device from first physical device.
-  auto device = easyvk::Device(instance, physicalDevices.at(deviceID));
-
-  std::vector<uint32_t> spvCode =
-#include "./spir-v/covertListener.cinit"
-    ;	
-  
-  std::cout << "Using device: " << device.properties.deviceName << "\n";
-
-  int size = SHARED_MEMORY_SIZE_TRAVERSED * result["grid-size"].as<int>();
-  
-  // Create some GPU buffers. They are needed so that the compiler
-  // doesn't just optimize away the kernel
-  auto a = easyvk::Buffer(device, size);
-  auto b = easyvk::Buffer(device, size);
-  auto c = easyvk::Buffer(device, size);
-  auto canary = easyvk::Buffer(device, 1);
-
-  std::cout << "printing out a histogram of observations. "<< std::endl;
+  ListenerConfig cfg;
+  cfg.gridSize = result["grid-size"].as<int>();
+  cfg.workgroupSize = result["workgroup-size"].as<int>();
+  cfg.persistent = result.count("persistent");
+  cfg.staging = result.count("staging");
+  cfg.iterations = result.count("iterations") ? result["iterations"].as<long>() : -1;
+  cfg.duration = result.count("duration") ? result["duration"].as<double>() : 0;
+  cfg.canary = result["canary"].as<uint32_t>();
+  cfg.localMem = result["local-mem"].as<long>();
+  cfg.useCache = !result.count("no-cache");
+  cfg.batch = std::max(1, result["batch"].as<int>());
+  cfg.recordPath = result.count("record") ? result["record"].as<std::string>() : "";
+  cfg.timingsPath = result.count("timings") ? result["timings"].as<std::string>() : "";
+  cfg.tracePath = result.count("trace") ? result["trace"].as<std::string>() : "";
 
-  canary.store(0,result["grid-size"].as<int>());
-  //std::cout << result["grid-size"].as<int>() << std::endl;
-
-  std::cout << "---------" << std::endl;
-
-  long iterations = 0;
-  
-  // write indefinitely 
-  while (1) {
-    iterations++;
-    //if (iterations % 1000 == 0) {
-    //  std::cout << "." <<  std::flush;
-    //}
-  
-    // Write initial values to the buffers.
-    for (int i = 0; i < size; i++) {
-      a.store(i, 0);
-      b.store(i, 0);
-      c.store(i, 0);
-    }
-            
-    std::vector<easyvk::Buffer> bufs = {a, b, c, canary};
-    
-    auto program = easyvk::Program(device, spvCode, bufs);
-    
-    // Dispatch 4 work groups of size 1 to carry out the work.
-    program.setWorkgroups(result["grid-size"].as<int>());
-    program.setWorkgroupSize(result["workgroup-size"].as<int>());
-    
-    // Run the kernel.
-    program.initialize("covertListener");
-    program.run();
-
-    // Check the return values
-    std::unordered_map<int, int> observations;
-    //int nonZeros = 0;
-    for(int i = 0; i < SHARED_MEMORY_SIZE_TRAVERSED*result["grid-size"].as<int>(); i++) {
-      unsigned v = c.load(i);
-    
-      
-      if (observations.find(v) == observations.end()) {
-	observations[v] = 1;
-      }
-      else {
-	observations[v]++;
-      }
+  if (result.count("autotune")) {
+    std::vector<VkPhysicalDevice> devices(1, physicalDevices.at(result["device"].as<int>()));
+    if (result.count("all-devices")) {
+      devices = physicalDevices;
     }
-
-    std::vector<std::pair<unsigned int, unsigned int> > keyValues;
-    
-    for (auto i : observations) {
-      keyValues.push_back(i);
+    for (auto d : devices) {
+      autotune(instance, d, cfg, result["tune-seconds"].as<double>());
     }
+  }
+  else if (result.count("all-devices")) {
+    // Scanning is always bounded
+    if (cfg.iterations < 0 && cfg.duration <= 0) {
+      cfg.iterations = 100;
+    }
+    std::cout << "scanning " << physicalDevices.size() << " devices" << std::endl;
 
-    std::sort(keyValues.begin(), keyValues.end(), cmp);
-
-    printf("top 10 observations:\n");
-    int obs = 0;
-    for (auto i : keyValues) {
-      if (obs < 10) {
-	std::cout << "(" << i.first << "," << i.second << ")" << std::endl;
-        obs++;
-      }
-      else {
-        break;
+    // Each worker creates its own logical device, buffers and pipeline;
+    // only the instance is shared.
+    std::vector<leftoverlocals::Report> reports(physicalDevices.size());
+    std::vector<ListenerConfig> cfgs;
+    for (auto d : physicalDevices) {
+      cfgs.push_back(deviceConfig(d, cfg, result));
+      std::string suffix = "." + std::to_string(cfgs.size() - 1);
+      for (std::string *path : {&cfgs.back().recordPath, &cfgs.back().timingsPath, &cfgs.back().tracePath}) {
+	if (!path->empty()) {
+	  *path += suffix;
+	}
       }
     }
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < physicalDevices.size(); i++) {
+      workers.push_back(std::thread(listen, std::ref(instance), physicalDevices[i], std::cref(cfgs[i]), std::ref(reports[i])));
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
 
-    program.teardown();
-
-    std::cout << "------------\nNext iteration starting" << std::endl;
+    leftoverlocals::Report all;
+    all.name = "all devices combined";
+    std::cout << "---------" << std::endl;
+    for (size_t i = 0; i < reports.size(); i++) {
+      std::cout << "device " << i << ": ";
+      reports[i].print();
+      std::cout << "------------" << std::endl;
+      all.merge(reports[i]);
+    }
+    all.print();
 
+    printf("{\n  \"devices\": [\n");
+    for (size_t i = 0; i < reports.size(); i++) {
+      reports[i].printJson(cfg.canary, stdout, "    ");
+      printf(i + 1 < reports.size() ? ",\n" : "\n");
+    }
+    printf("  ],\n  \"combined\":\n");
+    all.printJson(cfg.canary, stdout, "  ");
+    printf("\n}\n");
+  }
+  else {
+    VkPhysicalDevice physicalDevice = physicalDevices.at(result["device"].as<int>());
+    cfg = deviceConfig(physicalDevice, cfg, result);
+    // stdout is left to the JSON summary
+    std::cerr << "workgroup size: " << cfg.workgroupSize << ", grid size: " << cfg.gridSize << std::endl;
 
+    leftoverlocals::Report report;
+    listen(instance, physicalDevice, cfg, report);
+    if (!report.error.empty()) {
+      std::cerr << report.error << std::endl;
+      instance.teardown();
+      return 1;
+    }
+    report.printJson(cfg.canary);
+    printf("\n");
   }
-  
-  // Cleanup.
-  
-  a.teardown();
-  b.teardown();
-  c.teardown();
-  device.teardown();
+
   instance.teardown();
   return 0;
 }
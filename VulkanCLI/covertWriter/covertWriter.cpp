@@ -26,6 +26,9 @@
 // Some common sizes across main and the kernel
 #include "common.h"
 
+// Pipeline cache kept across runs
+#include <vkcache.h>
+
 int main(int argc, char* argv[]) {
 
   cxxopts::Options options("covertWriter", "writes values to GPU memory for a covert listener to try and find");
@@ -39,6 +42,8 @@ int main(int argc, char* argv[]) {
     ("gs, grid-size", "Number of workgroups per grid", cxxopts::value<int>()->default_value("32"))
     ("d,device", "Device id (int)", cxxopts::value<int>()->default_value("0"))
     ("c,canary", "Canary value (int)", cxxopts::value<int>()->default_value("123"))
+    ("m,local-mem", "Bytes of local memory written per workgroup (default: all the device reports)", cxxopts::value<long>()->default_value("0"))
+    ("no-cache", "Always build the pipeline instead of loading it from the pipeline cache")
     ("h,help", "Print usage");
 
 
@@ -80,14 +85,26 @@ int main(int argc, char* argv[]) {
   
   std::cout << "Using device: " << device.properties.deviceName << "\n";
 
-  int size = SHARED_MEMORY_SIZE_TRAVERSED * result["grid-size"].as<int>();
+  bool useCache = !result.count("no-cache");
+  if (useCache) {
+    leftoverlocals::loadPipelineCache(device);
+  }
+
+  // The local array is sized when the pipeline is built
+  long localMem = result["local-mem"].as<long>();
+  uint32_t localSize = localMem > 0 ? localMem / 4 : device.properties.limits.maxComputeSharedMemorySize / 4;
+  if (localSize == 0) {
+    localSize = DEFAULT_LOCAL_SIZE;
+  }
+
+  int size = localSize * result["grid-size"].as<int>();
   
   // Create some GPU buffers. They are needed so that the compiler
   // doesn't just optimize away the kernel
   auto a = easyvk::Buffer(device, size);
   auto b = easyvk::Buffer(device, size);
   auto c = easyvk::Buffer(device, size);
-  auto canary = easyvk::Buffer(device, 1);
+  auto canary = easyvk::Buffer(device, 2);
 
   std::cout<< "writing canary value: " << result["canary"].as<int>() << std::endl;
 
@@ -112,6 +129,7 @@ int main(int argc, char* argv[]) {
     }
         
     canary.store(0,result["canary"].as<int>());
+    canary.store(1,localSize);
     
     std::vector<easyvk::Buffer> bufs = {a, b, c, canary};
     
@@ -120,9 +138,13 @@ int main(int argc, char* argv[]) {
     // Dispatch 4 work groups of size 1 to carry out the work.
     program.setWorkgroups(result["grid-size"].as<int>());
     program.setWorkgroupSize(result["workgroup-size"].as<int>());
+    program.setSpecConstant(LOCAL_SIZE_SPEC_ID, localSize);
     
     // Run the kernel.
     program.initialize("covertWriter");
+    if (useCache && iterations == 1) {
+      leftoverlocals::savePipelineCache(device);
+    }
     program.run();
     program.teardown();
   }
@@ -0,0 +1,132 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// On-disk cache for compiled kernels and pipeline caches.
+//
+// Entries are named by a hash of everything that went into them (device,
+// driver, build options, source), so a stale entry is simply never looked
+// up again. The directory is $LEFTOVERLOCALS_CACHE, else
+// $XDG_CACHE_HOME/leftoverlocals, else ~/.cache/leftoverlocals. Writes go
+// through a temporary file and a rename so that concurrent runs never see
+// a partial entry. C++11, POSIX only.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace leftoverlocals {
+  namespace cache {
+
+    // Creates the directory and its parents; true if it exists afterwards
+    inline bool makeDirectories(const std::string &dir) {
+      for (size_t i = 1; i <= dir.size(); i++) {
+        if (i == dir.size() || dir[i] == '/') {
+          mkdir(dir.substr(0, i).c_str(), 0755);
+        }
+      }
+      struct stat st;
+      return stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    // Empty when no cache directory can be created
+    inline std::string directory() {
+      std::string dir;
+      if (const char *env = getenv("LEFTOVERLOCALS_CACHE")) {
+        dir = env;
+      }
+      else if (const char *xdg = getenv("XDG_CACHE_HOME")) {
+        dir = std::string(xdg) + "/leftoverlocals";
+      }
+      else if (const char *home = getenv("HOME")) {
+        dir = std::string(home) + "/.cache/leftoverlocals";
+      }
+      if (dir.empty() || !makeDirectories(dir)) {
+        return "";
+      }
+      return dir;
+    }
+
+    // 64-bit FNV-1a
+    inline uint64_t hash(const std::string &key) {
+      uint64_t h = 0xcbf29ce484222325ull;
+      for (unsigned char c : key) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+      }
+      return h;
+    }
+
+    // Path of the entry for key, or empty if there is no cache directory
+    inline std::string path(const std::string &key, const std::string &suffix) {
+      std::string dir = directory();
+      if (dir.empty()) {
+        return "";
+      }
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx", (unsigned long long) hash(key));
+      return dir + "/" + name + "." + suffix;
+    }
+
+    inline bool read(const std::string &file, std::vector<unsigned char> &data) {
+      if (file.empty()) {
+        return false;
+      }
+      FILE *f = fopen(file.c_str(), "rb");
+      if (!f) {
+        return false;
+      }
+      data.clear();
+      unsigned char chunk[1 << 16];
+      size_t n;
+      while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+      }
+      bool ok = !ferror(f);
+      fclose(f);
+      return ok && !data.empty();
+    }
+
+    inline bool write(const std::string &file, const void *data, size_t n) {
+      if (file.empty() || n == 0) {
+        return false;
+      }
+      // Unique per writer: threads of one process may write the same entry
+      // when two devices are identical
+      static std::atomic<unsigned> writes(0);
+      std::string tmp = file + ".tmp" + std::to_string((long) getpid()) + "." + std::to_string(writes++);
+      FILE *f = fopen(tmp.c_str(), "wb");
+      if (!f) {
+        return false;
+      }
+      bool ok = fwrite(data, 1, n, f) == n;
+      ok = fclose(f) == 0 && ok;
+      if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+      }
+      return true;
+    }
+
+  }
+}
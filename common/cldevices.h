@@ -0,0 +1,148 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// OpenCL device enumeration and a per-process cache of contexts, queues
+// and built programs.
+//
+// Devices are numbered across all platforms in the order the ICD loader
+// reports them, which is what --device refers to in every tool. The
+// cache hands out one context per device, one queue per device and set
+// of queue properties, and one program per device, source and build
+// options, so that autotuning and multi-threaded listeners stop creating
+// a context and building the kernel for every run. Programs are built
+// through the on-disk kernel cache of clprogram.h, so a fresh process
+// only pays for loading a binary. Safe to use from several threads;
+// builds for different devices run in parallel.
+//
+// Include the OpenCL C++ bindings before this header, as for
+// clprogram.h.
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "clprogram.h"
+
+namespace leftoverlocals {
+
+  // Every device of every platform, numbered as listDevices() prints them
+  inline std::vector<cl::Device> allDevices() {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    std::vector<cl::Device> devices;
+    for (auto &p : platforms) {
+      std::vector<cl::Device> local;
+      p.getDevices(CL_DEVICE_TYPE_ALL, &local);
+      devices.insert(devices.end(), local.begin(), local.end());
+    }
+    return devices;
+  }
+
+  // What --list prints: the devices grouped by platform, with the size and
+  // type of their local memory
+  inline void listDevices(std::ostream &out = std::cout) {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    int id = 0;
+    for (auto &p : platforms) {
+      out << "platform: " << p.getInfo<CL_PLATFORM_NAME>() << std::endl;
+      std::vector<cl::Device> local;
+      p.getDevices(CL_DEVICE_TYPE_ALL, &local);
+      for (auto &d : local) {
+        out << "  device " << id << ": " << d.getInfo<CL_DEVICE_NAME>() << std::endl;
+        out << "   local memory size: " << d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << " type: " << d.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() << std::endl;
+        id++;
+      }
+      out << std::endl;
+    }
+  }
+
+  class DeviceCache {
+  public:
+    // The cache shared by the whole process
+    static DeviceCache &shared() {
+      static DeviceCache cache;
+      return cache;
+    }
+
+    cl::Context context(const cl::Device &device) {
+      Entry &e = entry(device);
+      std::lock_guard<std::mutex> lock(e.mutex);
+      return e.context;
+    }
+
+    // Threads that each want their own queue create it from context()
+    cl::CommandQueue queue(const cl::Device &device, cl_command_queue_properties properties = 0) {
+      Entry &e = entry(device);
+      std::lock_guard<std::mutex> lock(e.mutex);
+      auto it = e.queues.find(properties);
+      if (it == e.queues.end()) {
+        it = e.queues.insert(std::make_pair(properties, cl::CommandQueue(e.context, device, properties))).first;
+      }
+      return it->second;
+    }
+
+    // Builds source with options once per process, as buildProgram() does.
+    // Failed builds are not remembered.
+    cl_int program(const cl::Device &device, const std::string &source, const std::string &options,
+                   cl::Program &program, std::string &log, bool useCache = true) {
+      Entry &e = entry(device);
+      std::lock_guard<std::mutex> lock(e.mutex);
+      std::string key = options + "\n" + source;
+      auto it = e.programs.find(key);
+      if (it != e.programs.end()) {
+        program = it->second;
+        return CL_SUCCESS;
+      }
+      cl_int err = buildProgram(e.context, device, source, options, program, log, useCache);
+      if (err == CL_SUCCESS) {
+        e.programs[key] = program;
+      }
+      return err;
+    }
+
+  private:
+    struct Entry {
+      std::mutex mutex;
+      cl::Context context;
+      std::map<cl_command_queue_properties, cl::CommandQueue> queues;
+      std::map<std::string, cl::Program> programs;
+    };
+
+    DeviceCache() {}
+
+    Entry &entry(const cl::Device &device) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::unique_ptr<Entry> &e = entries[device()];
+      if (!e) {
+        e.reset(new Entry());
+        e->context = cl::Context(std::vector<cl::Device>(1, device));
+      }
+      return *e;
+    }
+
+    std::mutex mutex;
+    std::map<cl_device_id, std::unique_ptr<Entry>> entries;
+  };
+
+}
@@ -0,0 +1,80 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Building OpenCL programs through the on-disk kernel cache.
+//
+// Include the OpenCL C++ bindings before this header (CL/opencl.hpp, or
+// CL/cl2.hpp in the llama.cpp PoC); it works with either.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "cache.h"
+
+namespace leftoverlocals {
+
+  // Builds source with options for one device. The binary of an earlier
+  // build with the same device, driver, options and source is loaded from
+  // the cache instead of compiling again, and fresh builds are added to
+  // it. Returns the status of the build; the build log is left in log on
+  // failure.
+  inline cl_int buildProgram(const cl::Context &context, const cl::Device &device,
+                             const std::string &source, const std::string &options,
+                             cl::Program &program, std::string &log, bool useCache = true) {
+    std::string file;
+    if (useCache) {
+      std::string key = device.getInfo<CL_DEVICE_NAME>() + "\n" +
+        device.getInfo<CL_DEVICE_VENDOR>() + "\n" +
+        device.getInfo<CL_DRIVER_VERSION>() + "\n" +
+        device.getInfo<CL_DEVICE_VERSION>() + "\n" +
+        options + "\n" + source;
+      file = cache::path(key, "clbin");
+    }
+
+    std::vector<unsigned char> binary;
+    if (cache::read(file, binary)) {
+      cl::Program::Binaries binaries(1, binary);
+      std::vector<cl_int> status;
+      cl_int err = CL_SUCCESS;
+      cl::Program cached(context, std::vector<cl::Device>(1, device), binaries, &status, &err);
+      if (err == CL_SUCCESS && cached.build(std::vector<cl::Device>(1, device), options.c_str()) == CL_SUCCESS) {
+        program = cached;
+        return CL_SUCCESS;
+      }
+      // A binary the driver no longer accepts is rebuilt from source below
+    }
+
+    cl::Program::Sources sources;
+    sources.push_back({source.c_str(), source.length()});
+    program = cl::Program(context, sources);
+    cl_int err = program.build(std::vector<cl::Device>(1, device), options.c_str());
+    if (err != CL_SUCCESS) {
+      log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+      return err;
+    }
+
+    if (!file.empty()) {
+      cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+      if (binaries.size() == 1) {
+        cache::write(file, binaries[0].data(), binaries[0].size());
+      }
+    }
+    return CL_SUCCESS;
+  }
+
+}
@@ -0,0 +1,206 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Histogram of 32-bit observations shared by the listeners.
+//
+// Values are counted in a flat open-addressing table (linear probing,
+// power-of-two capacity) that is sized for the dump up front, so counting
+// never allocates or rehashes in the steady state. Only the occupied slots
+// are remembered, which keeps clear() and top() proportional to the number
+// of distinct values rather than to the table size.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace leftoverlocals {
+
+  class Histogram {
+  public:
+    typedef std::pair<uint32_t, uint64_t> Entry;
+
+    // expected is the number of observations per dump; the table never
+    // needs to grow if every one of them is distinct.
+    explicit Histogram(size_t expected = 1024) {
+      reserve(expected);
+    }
+
+    void reserve(size_t expected) {
+      size_t capacity = 16;
+      while (capacity < expected * 2) {
+        capacity *= 2;
+      }
+      if (capacity > keys.size()) {
+        rehash(capacity);
+      }
+    }
+
+    void add(uint32_t value, uint64_t n = 1) {
+      size_t slot = find(value);
+      if (counts[slot] == 0) {
+        keys[slot] = value;
+        used.push_back(slot);
+        if (used.size() * 2 > keys.size()) {
+          counts[slot] = n;
+          rehash(keys.size() * 2);
+          observations += n;
+          return;
+        }
+      }
+      counts[slot] += n;
+      observations += n;
+    }
+
+    // Counts a whole dump. Dumps are dominated by long runs of the same
+    // value (usually zero), so runs are collapsed into a single update.
+    void addAll(const uint32_t *data, size_t n) {
+      size_t i = 0;
+      while (i < n) {
+        uint32_t value = data[i];
+        size_t j = i + 1;
+        while (j < n && data[j] == value) {
+          j++;
+        }
+        add(value, j - i);
+        i = j;
+      }
+    }
+
+    void addAll(const int *data, size_t n) {
+      addAll(reinterpret_cast<const uint32_t *>(data), n);
+    }
+
+    // Counts a dump with one shard per thread and merges the shards.
+    // Worth it only for dumps of several MB.
+    void addAllParallel(const uint32_t *data, size_t n, unsigned threads) {
+      if (threads <= 1 || n < threads) {
+        addAll(data, n);
+        return;
+      }
+      std::vector<Histogram> shards(threads, Histogram(0));
+      std::vector<std::thread> workers;
+      size_t chunk = (n + threads - 1) / threads;
+      for (unsigned t = 0; t < threads; t++) {
+        size_t begin = std::min(n, t * chunk);
+        size_t end = std::min(n, begin + chunk);
+        workers.push_back(std::thread([&shards, data, begin, end, t]() {
+          shards[t].addAll(data + begin, end - begin);
+        }));
+      }
+      for (auto &w : workers) {
+        w.join();
+      }
+      for (auto &shard : shards) {
+        merge(shard);
+      }
+    }
+
+    void merge(const Histogram &other) {
+      for (size_t slot : other.used) {
+        add(other.keys[slot], other.counts[slot]);
+      }
+    }
+
+    // Forgets all observations but keeps the table allocated.
+    void clear() {
+      for (size_t slot : used) {
+        counts[slot] = 0;
+      }
+      used.clear();
+      observations = 0;
+    }
+
+    uint64_t count(uint32_t value) const {
+      return counts[find(value)];
+    }
+
+    size_t distinct() const {
+      return used.size();
+    }
+
+    uint64_t total() const {
+      return observations;
+    }
+
+    // The k most frequent values, most frequent first. Ties are broken by
+    // value so the output is deterministic.
+    std::vector<Entry> top(size_t k) const {
+      std::vector<Entry> entries;
+      entries.reserve(used.size());
+      for (size_t slot : used) {
+        entries.push_back(Entry(keys[slot], counts[slot]));
+      }
+      k = std::min(k, entries.size());
+      auto byCount = [](const Entry &a, const Entry &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+      };
+      std::partial_sort(entries.begin(), entries.begin() + k, entries.end(), byCount);
+      entries.resize(k);
+      return entries;
+    }
+
+    // Prints the listeners' usual "top N observations" block.
+    void printTop(size_t k, FILE *out = stdout) const {
+      printTop(k, top(k), out);
+    }
+
+    // The same block for entries kept from an earlier top(k)
+    static void printTop(size_t k, const std::vector<Entry> &entries, FILE *out = stdout) {
+      fprintf(out, "top %zu observations:\n", k);
+      for (auto &e : entries) {
+        fprintf(out, "(%u,%llu)\n", e.first, (unsigned long long) e.second);
+      }
+    }
+
+  private:
+    std::vector<uint32_t> keys;
+    std::vector<uint64_t> counts;
+    std::vector<size_t> used;
+    uint64_t observations = 0;
+
+    size_t find(uint32_t value) const {
+      size_t mask = keys.size() - 1;
+      // Fibonacci hashing spreads small consecutive values across the table
+      size_t slot = (size_t) ((value * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+      while (counts[slot] != 0 && keys[slot] != value) {
+        slot = (slot + 1) & mask;
+      }
+      return slot;
+    }
+
+    void rehash(size_t capacity) {
+      std::vector<uint32_t> oldKeys(capacity);
+      std::vector<uint64_t> oldCounts(capacity, 0);
+      oldKeys.swap(keys);
+      oldCounts.swap(counts);
+      std::vector<size_t> oldUsed;
+      oldUsed.swap(used);
+      used.reserve(capacity / 2);
+      for (size_t slot : oldUsed) {
+        size_t s = find(oldKeys[slot]);
+        keys[s] = oldKeys[slot];
+        counts[s] = oldCounts[slot];
+        used.push_back(s);
+      }
+    }
+  };
+
+}
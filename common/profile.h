@@ -0,0 +1,85 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Per-device launch profiles written by the listeners' autotuner.
+//
+// A profile records the workgroup and grid size that sampled the most
+// local memory per second on one device and driver. It is stored next to
+// the kernel cache as a small "key value" text file, so it can be read or
+// edited by hand.
+
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+
+namespace leftoverlocals {
+
+  struct Profile {
+    int workgroupSize = 0;
+    int gridSize = 0;
+    double bytesPerSecond = 0;
+
+    // api tells the Vulkan and OpenCL profiles of the same device apart;
+    // device should name the device and its driver version.
+    static std::string path(const std::string &api, const std::string &device) {
+      return cache::path(api + "\n" + device, "profile");
+    }
+
+    bool load(const std::string &file) {
+      FILE *f = file.empty() ? nullptr : fopen(file.c_str(), "r");
+      if (!f) {
+        return false;
+      }
+      char key[64];
+      double value;
+      while (fscanf(f, "%63s %lf", key, &value) == 2) {
+        if (!strcmp(key, "workgroup-size")) {
+          workgroupSize = (int) value;
+        }
+        else if (!strcmp(key, "grid-size")) {
+          gridSize = (int) value;
+        }
+        else if (!strcmp(key, "bytes-per-second")) {
+          bytesPerSecond = value;
+        }
+      }
+      fclose(f);
+      return workgroupSize > 0 && gridSize > 0;
+    }
+
+    bool save(const std::string &file) const {
+      char text[256];
+      int n = snprintf(text, sizeof(text), "workgroup-size %d\ngrid-size %d\nbytes-per-second %.0f\n",
+                       workgroupSize, gridSize, bytesPerSecond);
+      return cache::write(file, text, n);
+    }
+  };
+
+  // The grid of launch configurations the autotuner tries
+  inline std::vector<int> powersOfTwo(int from, int to) {
+    std::vector<int> values;
+    for (int v = from; v <= to; v *= 2) {
+      values.push_back(v);
+    }
+    return values;
+  }
+
+}
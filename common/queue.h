@@ -0,0 +1,128 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Bounded lock-free queue for handing dumps or candidates between threads.
+//
+// This is Dmitry Vyukov's bounded multi-producer multi-consumer queue:
+// every cell carries a sequence number that tells producers and consumers
+// whether it is free for the current lap, so a push or pop is one CAS on
+// the shared position plus one release store. Neither side ever blocks;
+// tryPush() fails when the queue is full and tryPop() when it is empty,
+// and the caller decides whether to drop, retry or sleep. C++11.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace leftoverlocals {
+
+  template <typename T>
+  class BoundedQueue {
+  public:
+    // The capacity is rounded up to a power of two
+    explicit BoundedQueue(size_t capacity) : cells(roundUp(capacity)), mask(cells.size() - 1) {
+      for (size_t i = 0; i < cells.size(); i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      enqueuePos.store(0, std::memory_order_relaxed);
+      dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    size_t capacity() const {
+      return cells.size();
+    }
+
+    bool tryPush(const T &value) {
+      Cell *cell;
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      for (;;) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+          if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if (diff < 0) {
+          return false;
+        }
+        else {
+          pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+      }
+      cell->data = value;
+      cell->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool tryPop(T &value) {
+      Cell *cell;
+      size_t pos = dequeuePos.load(std::memory_order_relaxed);
+      for (;;) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+          if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if (diff < 0) {
+          return false;
+        }
+        else {
+          pos = dequeuePos.load(std::memory_order_relaxed);
+        }
+      }
+      value = cell->data;
+      cell->sequence.store(pos + mask + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T data;
+    };
+
+    static size_t roundUp(size_t n) {
+      size_t capacity = 2;
+      while (capacity < n) {
+        capacity *= 2;
+      }
+      return capacity;
+    }
+
+    std::vector<Cell> cells;
+    const size_t mask;
+    // Producers and consumers each get their own cache line. Padding
+    // rather than alignas keeps the queue safe to allocate with new
+    // before C++17.
+    char padding0[64];
+    std::atomic<size_t> enqueuePos;
+    char padding1[64 - sizeof(size_t)];
+    std::atomic<size_t> dequeuePos;
+    char padding2[64 - sizeof(size_t)];
+  };
+
+}
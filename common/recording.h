@@ -0,0 +1,480 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Recordings of the listeners' raw dumps.
+//
+// A recording is a header, one chunk per dump and an index:
+//
+//   header  "LLREC001", u32 metadata length, metadata ("key=value" lines)
+//   chunk   u32 'CHNK', u32 words, u64 iteration, u32 encoded bytes, payload
+//   index   u64 iteration and u64 file offset per chunk
+//   footer  u64 index offset, u64 chunk count, "LLRIDX01"
+//
+// All integers are little endian. Payloads are encoded with encodeDump():
+// a sequence of tokens, each a varint whose low bit tells a run of zero
+// words (length << 1) from a run of literal words (length << 1 | 1). The
+// literal words follow as zigzag varints of the difference to the
+// previous word. Dumps are almost entirely zeros, so this shrinks them by
+// orders of magnitude at memcpy-like speed.
+//
+// The Recorder copies dumps into a bounded queue and encodes and writes
+// them on a background thread; the listener only blocks when the writer
+// falls behind by more than the queue depth. The Reader maps a recording
+// and decodes any chunk on its own. A recording whose writer died before
+// writing the index is still readable, the index is then rebuilt by
+// walking the chunks. C++11, POSIX only.
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace leftoverlocals {
+
+  namespace recording {
+    const char fileMagic[8] = {'L', 'L', 'R', 'E', 'C', '0', '0', '1'};
+    const char indexMagic[8] = {'L', 'L', 'R', 'I', 'D', 'X', '0', '1'};
+    const uint32_t chunkMagic = 0x4b4e4843; // "CHNK"
+    const size_t chunkHeaderSize = 20;
+    const size_t footerSize = 24;
+
+    inline void putVarint(std::vector<uint8_t> &out, uint64_t v) {
+      while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+      }
+      out.push_back((uint8_t) v);
+    }
+
+    // Returns false on truncated input
+    inline bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+      v = 0;
+      for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    template <typename T>
+    void putLE(std::vector<uint8_t> &out, T v) {
+      for (size_t i = 0; i < sizeof(T); i++) {
+        out.push_back((uint8_t) (v >> (8 * i)));
+      }
+    }
+
+    template <typename T>
+    T getLE(const uint8_t *p) {
+      T v = 0;
+      for (size_t i = 0; i < sizeof(T); i++) {
+        v |= (T) p[i] << (8 * i);
+      }
+      return v;
+    }
+  }
+
+  // Appends the encoding of n words to out
+  inline void encodeDump(const uint32_t *data, size_t n, std::vector<uint8_t> &out) {
+    using namespace recording;
+    uint32_t prev = 0;
+    size_t i = 0;
+    while (i < n) {
+      size_t j = i;
+      if (data[i] == 0) {
+        while (j < n && data[j] == 0) {
+          j++;
+        }
+        putVarint(out, (uint64_t) (j - i) << 1);
+        prev = 0;
+      }
+      else {
+        // A single zero between literals is cheaper kept in the literal run
+        while (j < n && (data[j] != 0 || (j + 1 < n && data[j + 1] != 0))) {
+          j++;
+        }
+        putVarint(out, (uint64_t) (j - i) << 1 | 1);
+        for (size_t k = i; k < j; k++) {
+          uint32_t delta = data[k] - prev;
+          putVarint(out, (delta << 1) ^ (0u - (delta >> 31)));
+          prev = data[k];
+        }
+      }
+      i = j;
+    }
+  }
+
+  // Decodes exactly n words; false if the payload is malformed
+  inline bool decodeDump(const uint8_t *p, size_t bytes, uint32_t *out, size_t n) {
+    using namespace recording;
+    const uint8_t *end = p + bytes;
+    uint32_t prev = 0;
+    size_t i = 0;
+    while (i < n) {
+      uint64_t token;
+      if (!getVarint(p, end, token) || (token >> 1) > n - i) {
+        return false;
+      }
+      size_t run = token >> 1;
+      if (!(token & 1)) {
+        memset(out + i, 0, run * sizeof(uint32_t));
+        prev = 0;
+      }
+      else {
+        for (size_t k = 0; k < run; k++) {
+          uint64_t z;
+          if (!getVarint(p, end, z)) {
+            return false;
+          }
+          prev += (uint32_t) (z >> 1) ^ (0u - (uint32_t) (z & 1));
+          out[i + k] = prev;
+        }
+      }
+      i += run;
+    }
+    return p == end;
+  }
+
+  class Recorder {
+  public:
+    struct Stats {
+      uint64_t chunks = 0;
+      uint64_t rawBytes = 0;
+      uint64_t encodedBytes = 0;
+      // Times record() had to wait for the writer
+      uint64_t stalls = 0;
+    };
+
+    // metadata is stored verbatim in the header, "key=value" per line
+    Recorder(const std::string &path, const std::string &metadata, size_t queueDepth = 8)
+      : depth(queueDepth ? queueDepth : 1) {
+      file = fopen(path.c_str(), "wb");
+      if (!file) {
+        return;
+      }
+      std::vector<uint8_t> header(recording::fileMagic, recording::fileMagic + 8);
+      recording::putLE<uint32_t>(header, metadata.size());
+      header.insert(header.end(), metadata.begin(), metadata.end());
+      write(header);
+      writer = std::thread(&Recorder::run, this);
+    }
+
+    ~Recorder() {
+      close();
+    }
+
+    bool ok() const {
+      return file != nullptr && !failed;
+    }
+
+    // Queues a copy of the dump. Blocks while the queue is full.
+    void record(uint64_t iteration, const uint32_t *data, size_t n) {
+      if (!file) {
+        return;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      if (queue.size() >= depth) {
+        stats.stalls++;
+        drained.wait(lock, [this]() { return queue.size() < depth; });
+      }
+      Pending pending;
+      pending.iteration = iteration;
+      // Reuse the buffer of a dump that was already written
+      if (!spare.empty()) {
+        pending.words.swap(spare.back());
+        spare.pop_back();
+      }
+      pending.words.assign(data, data + n);
+      queue.push_back(std::move(pending));
+      lock.unlock();
+      queued.notify_one();
+    }
+
+    // Writes the remaining dumps and the index. Called by the destructor.
+    void close() {
+      if (!file) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+      }
+      queued.notify_one();
+      writer.join();
+
+      std::vector<uint8_t> tail;
+      for (auto &entry : index) {
+        recording::putLE<uint64_t>(tail, entry.first);
+        recording::putLE<uint64_t>(tail, entry.second);
+      }
+      recording::putLE<uint64_t>(tail, offset);
+      recording::putLE<uint64_t>(tail, index.size());
+      tail.insert(tail.end(), recording::indexMagic, recording::indexMagic + 8);
+      write(tail);
+      if (fclose(file) != 0) {
+        failed = true;
+      }
+      file = nullptr;
+    }
+
+    Stats statistics() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return stats;
+    }
+
+  private:
+    struct Pending {
+      uint64_t iteration;
+      std::vector<uint32_t> words;
+    };
+
+    FILE *file = nullptr;
+    bool failed = false;
+    size_t depth;
+    uint64_t offset = 0;
+    std::vector<std::pair<uint64_t, uint64_t> > index;
+
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable drained;
+    std::deque<Pending> queue;
+    std::vector<std::vector<uint32_t> > spare;
+    bool closing = false;
+    Stats stats;
+    std::thread writer;
+
+    void write(const std::vector<uint8_t> &bytes) {
+      if (fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) {
+        failed = true;
+      }
+      offset += bytes.size();
+    }
+
+    void run() {
+      std::vector<uint8_t> chunk;
+      for (;;) {
+        Pending pending;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          queued.wait(lock, [this]() { return closing || !queue.empty(); });
+          if (queue.empty()) {
+            return;
+          }
+          pending = std::move(queue.front());
+          queue.pop_front();
+        }
+        drained.notify_one();
+
+        chunk.clear();
+        recording::putLE<uint32_t>(chunk, recording::chunkMagic);
+        recording::putLE<uint32_t>(chunk, pending.words.size());
+        recording::putLE<uint64_t>(chunk, pending.iteration);
+        recording::putLE<uint32_t>(chunk, 0);
+        encodeDump(pending.words.data(), pending.words.size(), chunk);
+        uint32_t encoded = chunk.size() - recording::chunkHeaderSize;
+        memcpy(&chunk[16], &encoded, sizeof(encoded));
+
+        index.push_back(std::make_pair(pending.iteration, offset));
+        write(chunk);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.chunks++;
+        stats.rawBytes += pending.words.size() * sizeof(uint32_t);
+        stats.encodedBytes += chunk.size();
+        spare.push_back(std::vector<uint32_t>());
+        spare.back().swap(pending.words);
+      }
+    }
+  };
+
+  class Reader {
+  public:
+    struct Chunk {
+      uint64_t iteration;
+      uint64_t offset;
+      uint32_t words;
+      uint32_t bytes;
+    };
+
+    explicit Reader(const std::string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        error = "cannot open " + path;
+        return;
+      }
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = st.st_size;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+          base = (const uint8_t *) m;
+        }
+      }
+      ::close(fd);
+      if (!base) {
+        error = "cannot map " + path;
+        return;
+      }
+      parse();
+    }
+
+    ~Reader() {
+      if (base) {
+        munmap((void *) base, size);
+      }
+    }
+
+    bool ok() const {
+      return error.empty();
+    }
+
+    const std::string &errorMessage() const {
+      return error;
+    }
+
+    // The "key=value" metadata of the header
+    const std::string &metadata() const {
+      return meta;
+    }
+
+    std::string metadata(const std::string &key) const {
+      size_t pos = 0;
+      while (pos < meta.size()) {
+        size_t eol = meta.find('\n', pos);
+        if (eol == std::string::npos) {
+          eol = meta.size();
+        }
+        std::string line = meta.substr(pos, eol - pos);
+        if (line.compare(0, key.size() + 1, key + "=") == 0) {
+          return line.substr(key.size() + 1);
+        }
+        pos = eol + 1;
+      }
+      return "";
+    }
+
+    // False when the index was missing and had to be rebuilt
+    bool indexed() const {
+      return hasIndex;
+    }
+
+    size_t chunks() const {
+      return index.size();
+    }
+
+    const Chunk &chunk(size_t i) const {
+      return index[i];
+    }
+
+    // Position of the first chunk recorded at or after iteration
+    size_t seek(uint64_t iteration) const {
+      size_t lo = 0, hi = index.size();
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (index[mid].iteration < iteration) {
+          lo = mid + 1;
+        }
+        else {
+          hi = mid;
+        }
+      }
+      return lo;
+    }
+
+    // Decodes chunk i into out, which must hold chunk(i).words words.
+    // Safe to call from several threads at once.
+    bool read(size_t i, uint32_t *out) const {
+      const Chunk &c = index[i];
+      return decodeDump(base + c.offset + recording::chunkHeaderSize, c.bytes, out, c.words);
+    }
+
+  private:
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    std::string error;
+    std::string meta;
+    bool hasIndex = false;
+    std::vector<Chunk> index;
+
+    bool readChunkHeader(uint64_t offset, Chunk &c) const {
+      if (offset + recording::chunkHeaderSize > size ||
+          recording::getLE<uint32_t>(base + offset) != recording::chunkMagic) {
+        return false;
+      }
+      c.offset = offset;
+      c.words = recording::getLE<uint32_t>(base + offset + 4);
+      c.iteration = recording::getLE<uint64_t>(base + offset + 8);
+      c.bytes = recording::getLE<uint32_t>(base + offset + 16);
+      return offset + recording::chunkHeaderSize + c.bytes <= size;
+    }
+
+    void parse() {
+      if (size < 12 || memcmp(base, recording::fileMagic, 8) != 0) {
+        error = "not a recording";
+        return;
+      }
+      uint32_t metaLength = recording::getLE<uint32_t>(base + 8);
+      uint64_t first = 12 + (uint64_t) metaLength;
+      if (first > size) {
+        error = "truncated header";
+        return;
+      }
+      meta.assign((const char *) base + 12, metaLength);
+
+      // Use the index if the recording was closed properly
+      if (size >= first + recording::footerSize &&
+          memcmp(base + size - 8, recording::indexMagic, 8) == 0) {
+        uint64_t indexOffset = recording::getLE<uint64_t>(base + size - 24);
+        uint64_t count = recording::getLE<uint64_t>(base + size - 16);
+        if (indexOffset <= size - recording::footerSize &&
+            count == (size - recording::footerSize - indexOffset) / 16) {
+          hasIndex = true;
+          for (uint64_t i = 0; i < count && hasIndex; i++) {
+            Chunk c;
+            uint64_t offset = recording::getLE<uint64_t>(base + indexOffset + 16 * i + 8);
+            hasIndex = readChunkHeader(offset, c);
+            index.push_back(c);
+          }
+          if (hasIndex) {
+            return;
+          }
+          index.clear();
+        }
+      }
+
+      // Otherwise walk the chunks up to the first incomplete one
+      Chunk c;
+      for (uint64_t offset = first; readChunkHeader(offset, c); offset += recording::chunkHeaderSize + c.bytes) {
+        index.push_back(c);
+      }
+    }
+  };
+
+}
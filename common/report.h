@@ -0,0 +1,167 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Results of a bounded listener run on one device.
+//
+// The listeners fill a Report per device when they run for a fixed number
+// of iterations or seconds, and print it either as text or as a JSON
+// summary that can be compared across drivers and machines.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+namespace leftoverlocals {
+
+  struct Report {
+    std::string name;
+    // Set instead of the results when the device could not be used
+    std::string error;
+    long iterations = 0;
+    // Iterations in which the canary was observed at least once
+    long canaryIterations = 0;
+    // Seconds into the run at which the canary was first observed,
+    // negative if it never was
+    double firstCanarySeconds = -1;
+    double seconds = 0;
+    uint64_t bytesScanned = 0;
+    // Bytes moved between host and device, only reported when counted
+    bool countsBytesMoved = false;
+    uint64_t bytesUploaded = 0;
+    uint64_t bytesReadBack = 0;
+    // Device-side duration of each dispatch, when the API reports it
+    std::vector<double> dispatchMicros;
+    Histogram observations;
+
+    // Folds another device's run into this one. The devices run
+    // concurrently, so the wall time is the longest of the two.
+    void merge(const Report &other) {
+      if (!other.error.empty()) {
+        return;
+      }
+      iterations += other.iterations;
+      canaryIterations += other.canaryIterations;
+      if (other.firstCanarySeconds >= 0 && (firstCanarySeconds < 0 || other.firstCanarySeconds < firstCanarySeconds)) {
+        firstCanarySeconds = other.firstCanarySeconds;
+      }
+      seconds = std::max(seconds, other.seconds);
+      bytesScanned += other.bytesScanned;
+      countsBytesMoved = countsBytesMoved || other.countsBytesMoved;
+      bytesUploaded += other.bytesUploaded;
+      bytesReadBack += other.bytesReadBack;
+      dispatchMicros.insert(dispatchMicros.end(), other.dispatchMicros.begin(), other.dispatchMicros.end());
+      observations.merge(other.observations);
+    }
+
+    uint64_t nonZero() const {
+      return observations.total() - observations.count(0);
+    }
+
+    double nonZeroRatio() const {
+      return observations.total() ? (double) nonZero() / observations.total() : 0.0;
+    }
+
+    // Nearest-rank percentile of the dispatch latencies, p in [0, 100]
+    double dispatchPercentile(double p) const {
+      if (dispatchMicros.empty()) {
+        return 0.0;
+      }
+      std::vector<double> sorted(dispatchMicros);
+      std::sort(sorted.begin(), sorted.end());
+      size_t rank = (size_t) (p / 100.0 * (sorted.size() - 1) + 0.5);
+      return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    void print(FILE *out = stdout) const {
+      fprintf(out, "%s\n", name.c_str());
+      if (!error.empty()) {
+        fprintf(out, "  %s\n", error.c_str());
+        return;
+      }
+      fprintf(out, "  %ld iterations, %llu values observed, %llu non-zero (%.2f%%), %zu distinct\n",
+              iterations, (unsigned long long) observations.total(), (unsigned long long) nonZero(),
+              100.0 * nonZeroRatio(), observations.distinct());
+      if (countsBytesMoved) {
+        fprintf(out, "  %llu bytes uploaded, %llu read back\n",
+                (unsigned long long) bytesUploaded, (unsigned long long) bytesReadBack);
+      }
+      observations.printTop(10, out);
+    }
+
+    // One JSON object, without a trailing newline so that reports can be
+    // nested in an array.
+    void printJson(uint32_t canary, FILE *out = stdout, const char *indent = "") const {
+      fprintf(out, "%s{\n", indent);
+      fprintf(out, "%s  \"device\": \"%s\",\n", indent, escape(name).c_str());
+      if (!error.empty()) {
+        fprintf(out, "%s  \"error\": \"%s\"\n", indent, escape(error).c_str());
+        fprintf(out, "%s}", indent);
+        return;
+      }
+      double s = seconds > 0 ? seconds : 1e-9;
+      fprintf(out, "%s  \"iterations\": %ld,\n", indent, iterations);
+      fprintf(out, "%s  \"seconds\": %.6f,\n", indent, seconds);
+      fprintf(out, "%s  \"iterations_per_second\": %.3f,\n", indent, iterations / s);
+      fprintf(out, "%s  \"bytes_scanned\": %llu,\n", indent, (unsigned long long) bytesScanned);
+      fprintf(out, "%s  \"bytes_per_second\": %.1f,\n", indent, bytesScanned / s);
+      if (countsBytesMoved) {
+        fprintf(out, "%s  \"bytes_uploaded\": %llu,\n", indent, (unsigned long long) bytesUploaded);
+        fprintf(out, "%s  \"bytes_read_back\": %llu,\n", indent, (unsigned long long) bytesReadBack);
+      }
+      if (dispatchMicros.empty()) {
+        fprintf(out, "%s  \"dispatch_us\": null,\n", indent);
+      }
+      else {
+        fprintf(out, "%s  \"dispatch_us\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n", indent,
+                dispatchPercentile(50), dispatchPercentile(90), dispatchPercentile(99), dispatchPercentile(100));
+      }
+      fprintf(out, "%s  \"values\": %llu,\n", indent, (unsigned long long) observations.total());
+      fprintf(out, "%s  \"non_zero_ratio\": %.6f,\n", indent, nonZeroRatio());
+      fprintf(out, "%s  \"canary\": %u,\n", indent, canary);
+      fprintf(out, "%s  \"canary_hits\": %llu,\n", indent, (unsigned long long) observations.count(canary));
+      fprintf(out, "%s  \"canary_hits_per_second\": %.3f,\n", indent, observations.count(canary) / s);
+      if (firstCanarySeconds < 0) {
+        fprintf(out, "%s  \"first_canary_seconds\": null,\n", indent);
+      }
+      else {
+        fprintf(out, "%s  \"first_canary_seconds\": %.6f,\n", indent, firstCanarySeconds);
+      }
+      fprintf(out, "%s  \"canary_iterations\": %ld\n", indent, canaryIterations);
+      fprintf(out, "%s}", indent);
+    }
+
+  private:
+    static std::string escape(const std::string &s) {
+      std::string escaped;
+      for (char c : s) {
+        if (c == '"' || c == '\\') {
+          escaped += '\\';
+        }
+        if ((unsigned char) c >= 0x20) {
+          escaped += c;
+        }
+      }
+      return escaped;
+    }
+  };
+
+}
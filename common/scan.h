@@ -0,0 +1,560 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Pattern scans over dumped local memory.
+//
+// Every scan is a single linear pass. The inner loops have AVX2 and NEON
+// versions with a scalar fallback. The AVX2 versions are compiled with a
+// target attribute and picked at runtime, so no extra compiler flags are
+// needed. This header has to stay C++11 so that it can be used from the
+// llama.cpp PoC.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEFTOVERLOCALS_SCAN_AVX2 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define LEFTOVERLOCALS_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace leftoverlocals {
+namespace scan {
+
+  // Bytes scanned and time spent, for reporting throughput.
+  struct Stats {
+    uint64_t bytes = 0;
+    double seconds = 0;
+
+    double gbps() const {
+      return seconds > 0 ? bytes / seconds / 1e9 : 0;
+    }
+  };
+
+  inline int popcount64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int c = 0;
+    for (; x; x &= x - 1) {
+      c++;
+    }
+    return c;
+#endif
+  }
+
+  inline int ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int c = 0;
+    while (!(x & 1)) {
+      x >>= 1;
+      c++;
+    }
+    return c;
+#endif
+  }
+
+  namespace detail {
+
+    // One bitmap word for 64 elements: bit j is set when
+    // (data[j] & mask) == value.
+    inline uint64_t matchWordScalar(const uint32_t *data, size_t n, uint32_t value, uint32_t mask) {
+      uint64_t word = 0;
+      for (size_t j = 0; j < n; j++) {
+        word |= (uint64_t) ((data[j] & mask) == value) << j;
+      }
+      return word;
+    }
+
+    inline void matchBitmapScalar(const uint32_t *data, size_t n, uint32_t value, uint32_t mask, uint64_t *bitmap) {
+      for (size_t i = 0; i < n; i += 64) {
+        bitmap[i / 64] = matchWordScalar(data + i, n - i < 64 ? n - i : 64, value, mask);
+      }
+    }
+
+    inline size_t countMatchesScalar(const uint32_t *data, size_t n, uint32_t value, uint32_t mask) {
+      size_t count = 0;
+      for (size_t i = 0; i < n; i++) {
+        count += (data[i] & mask) == value;
+      }
+      return count;
+    }
+
+    inline void findPrefixScalar(const uint8_t *data, size_t n, const uint8_t *prefix, size_t m, size_t from, std::vector<size_t> &hits) {
+      const uint8_t *p = data + from;
+      const uint8_t *end = data + n - m + 1;
+      while (p < end) {
+        p = (const uint8_t *) memchr(p, prefix[0], end - p);
+        if (!p) {
+          break;
+        }
+        if (memcmp(p, prefix, m) == 0) {
+          hits.push_back(p - data);
+        }
+        p++;
+      }
+    }
+
+    // Largest element, skipping NaNs; -inf when there is none
+    inline float maxScalar(const float *data, size_t n) {
+      float max = -std::numeric_limits<float>::infinity();
+      for (size_t i = 0; i < n; i++) {
+        if (data[i] > max) {
+          max = data[i];
+        }
+      }
+      return max;
+    }
+
+    inline size_t findFirstScalar(const float *data, size_t n, float value, size_t from) {
+      for (size_t i = from; i < n; i++) {
+        if (data[i] == value) {
+          return i;
+        }
+      }
+      return n;
+    }
+
+    // One bitmap word for up to 64 elements: bit j is set when
+    // data[j] > threshold.
+    inline uint64_t greaterWordScalar(const float *data, size_t n, float threshold) {
+      uint64_t word = 0;
+      for (size_t j = 0; j < n; j++) {
+        word |= (uint64_t) (data[j] > threshold) << j;
+      }
+      return word;
+    }
+
+#if defined(LEFTOVERLOCALS_SCAN_AVX2)
+    inline bool hasAVX2() {
+      static const bool avx2 = __builtin_cpu_supports("avx2");
+      return avx2;
+    }
+
+    __attribute__((target("avx2")))
+    inline void matchBitmapAVX2(const uint32_t *data, size_t n, uint32_t value, uint32_t mask, uint64_t *bitmap) {
+      const __m256i v = _mm256_set1_epi32((int) value);
+      const __m256i msk = _mm256_set1_epi32((int) mask);
+      size_t i = 0;
+      for (; i + 64 <= n; i += 64) {
+        uint64_t word = 0;
+        for (int j = 0; j < 8; j++) {
+          __m256i x = _mm256_loadu_si256((const __m256i *) (data + i + 8 * j));
+          __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(x, msk), v);
+          word |= (uint64_t) (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(eq)) << (8 * j);
+        }
+        bitmap[i / 64] = word;
+      }
+      if (i < n) {
+        bitmap[i / 64] = matchWordScalar(data + i, n - i, value, mask);
+      }
+    }
+
+    __attribute__((target("avx2")))
+    inline size_t countMatchesAVX2(const uint32_t *data, size_t n, uint32_t value, uint32_t mask) {
+      const __m256i v = _mm256_set1_epi32((int) value);
+      const __m256i msk = _mm256_set1_epi32((int) mask);
+      size_t count = 0;
+      size_t i = 0;
+      while (i + 8 <= n) {
+        // Lane counters are flushed before they can overflow
+        size_t blockEnd = n - i > (size_t(1) << 30) ? i + (size_t(1) << 30) : n;
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 8 <= blockEnd; i += 8) {
+          __m256i x = _mm256_loadu_si256((const __m256i *) (data + i));
+          acc = _mm256_sub_epi32(acc, _mm256_cmpeq_epi32(_mm256_and_si256(x, msk), v));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        for (int j = 0; j < 8; j++) {
+          count += lanes[j];
+        }
+      }
+      return count + countMatchesScalar(data + i, n - i, value, mask);
+    }
+
+    // Compares the first and last byte of the prefix at 32 positions at a
+    // time and only runs memcmp where both match.
+    __attribute__((target("avx2")))
+    inline void findPrefixAVX2(const uint8_t *data, size_t n, const uint8_t *prefix, size_t m, std::vector<size_t> &hits) {
+      const __m256i first = _mm256_set1_epi8((char) prefix[0]);
+      const __m256i last = _mm256_set1_epi8((char) prefix[m - 1]);
+      size_t i = 0;
+      for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (data + i + m - 1));
+        uint32_t candidates = (uint32_t) _mm256_movemask_epi8(
+          _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (candidates) {
+          size_t pos = i + ctz64(candidates);
+          if (memcmp(data + pos, prefix, m) == 0) {
+            hits.push_back(pos);
+          }
+          candidates &= candidates - 1;
+        }
+      }
+      findPrefixScalar(data, n, prefix, m, i, hits);
+    }
+
+    __attribute__((target("avx2")))
+    inline float maxAVX2(const float *data, size_t n) {
+      // max_ps returns its second operand when either is NaN, so NaNs in
+      // the data never replace the accumulator
+      __m256 acc = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8) {
+        acc = _mm256_max_ps(_mm256_loadu_ps(data + i), acc);
+      }
+      float lanes[8];
+      _mm256_storeu_ps(lanes, acc);
+      return std::max(maxScalar(lanes, 8), maxScalar(data + i, n - i));
+    }
+
+    __attribute__((target("avx2")))
+    inline size_t findFirstAVX2(const float *data, size_t n, float value) {
+      const __m256 v = _mm256_set1_ps(value);
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8) {
+        int eq = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(data + i), v, _CMP_EQ_OQ));
+        if (eq) {
+          return i + ctz64((uint64_t) eq);
+        }
+      }
+      return findFirstScalar(data, n, value, i);
+    }
+
+    __attribute__((target("avx2")))
+    inline uint64_t greaterWordAVX2(const float *data, size_t n, float threshold) {
+      if (n < 64) {
+        return greaterWordScalar(data, n, threshold);
+      }
+      const __m256 t = _mm256_set1_ps(threshold);
+      uint64_t word = 0;
+      for (int j = 0; j < 8; j++) {
+        __m256 gt = _mm256_cmp_ps(_mm256_loadu_ps(data + 8 * j), t, _CMP_GT_OQ);
+        word |= (uint64_t) (uint32_t) _mm256_movemask_ps(gt) << (8 * j);
+      }
+      return word;
+    }
+#endif
+
+#if defined(LEFTOVERLOCALS_SCAN_NEON)
+    inline void matchBitmapNEON(const uint32_t *data, size_t n, uint32_t value, uint32_t mask, uint64_t *bitmap) {
+      const uint32x4_t v = vdupq_n_u32(value);
+      const uint32x4_t msk = vdupq_n_u32(mask);
+      const uint32_t weights[4] = {1, 2, 4, 8};
+      const uint32x4_t w = vld1q_u32(weights);
+      size_t i = 0;
+      for (; i + 64 <= n; i += 64) {
+        uint64_t word = 0;
+        for (int j = 0; j < 16; j++) {
+          uint32x4_t eq = vceqq_u32(vandq_u32(vld1q_u32(data + i + 4 * j), msk), v);
+          word |= (uint64_t) vaddvq_u32(vandq_u32(eq, w)) << (4 * j);
+        }
+        bitmap[i / 64] = word;
+      }
+      if (i < n) {
+        bitmap[i / 64] = matchWordScalar(data + i, n - i, value, mask);
+      }
+    }
+
+    inline size_t countMatchesNEON(const uint32_t *data, size_t n, uint32_t value, uint32_t mask) {
+      const uint32x4_t v = vdupq_n_u32(value);
+      const uint32x4_t msk = vdupq_n_u32(mask);
+      size_t count = 0;
+      size_t i = 0;
+      while (i + 4 <= n) {
+        size_t blockEnd = n - i > (size_t(1) << 30) ? i + (size_t(1) << 30) : n;
+        uint32x4_t acc = vdupq_n_u32(0);
+        for (; i + 4 <= blockEnd; i += 4) {
+          acc = vsubq_u32(acc, vceqq_u32(vandq_u32(vld1q_u32(data + i), msk), v));
+        }
+        count += vaddvq_u32(acc);
+      }
+      return count + countMatchesScalar(data + i, n - i, value, mask);
+    }
+
+    inline void findPrefixNEON(const uint8_t *data, size_t n, const uint8_t *prefix, size_t m, std::vector<size_t> &hits) {
+      const uint8x16_t first = vdupq_n_u8(prefix[0]);
+      const uint8x16_t last = vdupq_n_u8(prefix[m - 1]);
+      size_t i = 0;
+      for (; i + m - 1 + 16 <= n; i += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(data + i), first), vceqq_u8(vld1q_u8(data + i + m - 1), last));
+        // Narrow to 4 bits per byte so the candidates fit in one word
+        uint64_t candidates = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (candidates) {
+          size_t pos = i + ctz64(candidates) / 4;
+          if (memcmp(data + pos, prefix, m) == 0) {
+            hits.push_back(pos);
+          }
+          candidates &= ~(uint64_t(0xf) << (ctz64(candidates) & ~3));
+        }
+      }
+      findPrefixScalar(data, n, prefix, m, i, hits);
+    }
+
+    inline float maxNEON(const float *data, size_t n) {
+      // The "nm" variants return the number when one operand is NaN
+      float32x4_t acc = vdupq_n_f32(-std::numeric_limits<float>::infinity());
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        acc = vmaxnmq_f32(acc, vld1q_f32(data + i));
+      }
+      return std::max(vmaxnmvq_f32(acc), maxScalar(data + i, n - i));
+    }
+
+    inline size_t findFirstNEON(const float *data, size_t n, float value) {
+      const float32x4_t v = vdupq_n_f32(value);
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        if (vmaxvq_u32(vceqq_f32(vld1q_f32(data + i), v))) {
+          break;
+        }
+      }
+      return findFirstScalar(data, n, value, i);
+    }
+
+    inline uint64_t greaterWordNEON(const float *data, size_t n, float threshold) {
+      if (n < 64) {
+        return greaterWordScalar(data, n, threshold);
+      }
+      const float32x4_t t = vdupq_n_f32(threshold);
+      const uint32_t weights[4] = {1, 2, 4, 8};
+      const uint32x4_t w = vld1q_u32(weights);
+      uint64_t word = 0;
+      for (int j = 0; j < 16; j++) {
+        uint32x4_t gt = vcgtq_f32(vld1q_f32(data + 4 * j), t);
+        word |= (uint64_t) vaddvq_u32(vandq_u32(gt, w)) << (4 * j);
+      }
+      return word;
+    }
+#endif
+
+  }
+
+  // Sets bit i of bitmap (which must hold (n + 63) / 64 words) when
+  // (data[i] & mask) == value.
+  inline void matchBitmap(const uint32_t *data, size_t n, uint32_t value, uint32_t mask, uint64_t *bitmap) {
+#if defined(LEFTOVERLOCALS_SCAN_AVX2)
+    if (detail::hasAVX2()) {
+      detail::matchBitmapAVX2(data, n, value, mask, bitmap);
+      return;
+    }
+#elif defined(LEFTOVERLOCALS_SCAN_NEON)
+    detail::matchBitmapNEON(data, n, value, mask, bitmap);
+    return;
+#endif
+    detail::matchBitmapScalar(data, n, value, mask, bitmap);
+  }
+
+  // Number of elements equal to a canary value, e.g. the writers' 123.
+  inline size_t countMatches(const uint32_t *data, size_t n, uint32_t value, uint32_t mask = 0xffffffffu) {
+#if defined(LEFTOVERLOCALS_SCAN_AVX2)
+    if (detail::hasAVX2()) {
+      return detail::countMatchesAVX2(data, n, value, mask);
+    }
+#elif defined(LEFTOVERLOCALS_SCAN_NEON)
+    return detail::countMatchesNEON(data, n, value, mask);
+#endif
+    return detail::countMatchesScalar(data, n, value, mask);
+  }
+
+  // Appends the byte offset of every occurrence of an arbitrary byte
+  // prefix, e.g. the canary prefix the AppleApp writer sends.
+  inline void findPrefix(const void *data, size_t n, const void *prefix, size_t m, std::vector<size_t> &hits) {
+    const uint8_t *d = (const uint8_t *) data;
+    const uint8_t *p = (const uint8_t *) prefix;
+    if (m == 0 || m > n) {
+      return;
+    }
+#if defined(LEFTOVERLOCALS_SCAN_AVX2)
+    if (detail::hasAVX2()) {
+      detail::findPrefixAVX2(d, n, p, m, hits);
+      return;
+    }
+#elif defined(LEFTOVERLOCALS_SCAN_NEON)
+    detail::findPrefixNEON(d, n, p, m, hits);
+    return;
+#endif
+    detail::findPrefixScalar(d, n, p, m, 0, hits);
+  }
+
+  // Index of the first largest element, e.g. the most likely token of a
+  // row of logits. NaNs are skipped; n when there is no other element.
+  inline size_t argmax(const float *data, size_t n) {
+    float max;
+#if defined(LEFTOVERLOCALS_SCAN_AVX2)
+    if (detail::hasAVX2()) {
+      max = detail::maxAVX2(data, n);
+      return detail::findFirstAVX2(data, n, max);
+    }
+#elif defined(LEFTOVERLOCALS_SCAN_NEON)
+    max = detail::maxNEON(data, n);
+    return detail::findFirstNEON(data, n, max);
+#endif
+    max = detail::maxScalar(data, n);
+    return detail::findFirstScalar(data, n, max, 0);
+  }
+
+  // The k largest elements as (value, index), largest first, ties in
+  // index order. NaNs are skipped. Once k elements are held, only the
+  // elements above the smallest of them are looked at one by one; the
+  // rest is filtered 64 at a time.
+  inline void topK(const float *data, size_t n, size_t k, std::vector<std::pair<float, size_t> > &out) {
+    typedef std::pair<float, size_t> Entry;
+    // Orders the heap so that its front is the entry to evict first
+    auto worse = [](const Entry &a, const Entry &b) {
+      return a.first != b.first ? a.first > b.first : a.second < b.second;
+    };
+    out.clear();
+    if (k == 0) {
+      return;
+    }
+    size_t i = 0;
+    for (; i < n && out.size() < k; i++) {
+      if (data[i] == data[i]) {
+        out.push_back(Entry(data[i], i));
+        std::push_heap(out.begin(), out.end(), worse);
+      }
+    }
+    for (; i < n; i += 64) {
+      size_t m = n - i < 64 ? n - i : 64;
+      uint64_t word;
+#if defined(LEFTOVERLOCALS_SCAN_AVX2)
+      if (detail::hasAVX2()) {
+        word = detail::greaterWordAVX2(data + i, m, out.front().first);
+      }
+      else {
+        word = detail::greaterWordScalar(data + i, m, out.front().first);
+      }
+#elif defined(LEFTOVERLOCALS_SCAN_NEON)
+      word = detail::greaterWordNEON(data + i, m, out.front().first);
+#else
+      word = detail::greaterWordScalar(data + i, m, out.front().first);
+#endif
+      while (word) {
+        size_t j = i + ctz64(word);
+        word &= word - 1;
+        // The threshold may have risen since the word was built
+        if (data[j] > out.front().first) {
+          std::pop_heap(out.begin(), out.end(), worse);
+          out.back() = Entry(data[j], j);
+          std::push_heap(out.begin(), out.end(), worse);
+        }
+      }
+    }
+    std::sort_heap(out.begin(), out.end(), worse);
+  }
+
+  // Finds runs of mostly non-zero 32-bit elements delimited by zeros,
+  // e.g. a 4096-float vector cached in local memory by a matrix-vector
+  // kernel. A run starts at i when the guard elements before it are zero
+  // and data[i] is not, spans length elements containing at most maxZeros
+  // zeros, and is followed by guard zeros. Zero means +0.0f or -0.0f, which
+  // also covers integer zero.
+  //
+  // The zero bitmap and per-word zero counts are built in one pass, after
+  // which every window check is O(1). Buffers are kept between calls.
+  class ZeroRunScanner {
+  public:
+    ZeroRunScanner(size_t _length = 4096, size_t _maxZeros = 4, size_t _guard = 2) :
+      length(_length), maxZeros(_maxZeros), guard(_guard < 1 ? 1 : (_guard > 63 ? 63 : _guard)) {}
+
+    // Appends the start index of each run, stopping after maxHits runs.
+    void scan(const uint32_t *data, size_t n, std::vector<size_t> &hits, size_t maxHits = SIZE_MAX) {
+      auto start = std::chrono::steady_clock::now();
+      size_t words = (n + 63) / 64;
+      zeros.resize(words);
+      zerosBefore.resize(words + 1);
+      matchBitmap(data, n, 0, 0x7fffffffu, zeros.data());
+      zerosBefore[0] = 0;
+      for (size_t w = 0; w < words; w++) {
+        zerosBefore[w + 1] = zerosBefore[w] + popcount64(zeros[w]);
+      }
+
+      size_t found = 0;
+      uint64_t prev = 0;
+      for (size_t w = 0; w < words && found < maxHits; w++) {
+        uint64_t z = zeros[w];
+        // A candidate is a non-zero element whose guard predecessors are
+        // all zero, carrying the predecessors over from the previous word.
+        // Elements before the start of the dump do not count as zeros.
+        uint64_t candidates = ~z;
+        for (size_t s = 1; s <= guard; s++) {
+          candidates &= (z << s) | (prev >> (64 - s));
+        }
+        if (w == words - 1 && n % 64) {
+          candidates &= (uint64_t(1) << (n % 64)) - 1;
+        }
+        while (candidates && found < maxHits) {
+          size_t i = w * 64 + ctz64(candidates);
+          candidates &= candidates - 1;
+          if (i + length + guard > n) {
+            continue;
+          }
+          if (zerosIn(i, i + length) > maxZeros) {
+            continue;
+          }
+          if (zerosIn(i + length, i + length + guard) != guard) {
+            continue;
+          }
+          hits.push_back(i);
+          found++;
+        }
+        prev = z;
+      }
+
+      stats.bytes += n * sizeof(uint32_t);
+      stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Throughput of all scans so far
+    Stats stats;
+
+  private:
+    size_t length;
+    size_t maxZeros;
+    size_t guard;
+    std::vector<uint64_t> zeros;
+    std::vector<size_t> zerosBefore;
+
+    size_t zerosBeforeIndex(size_t i) const {
+      size_t w = i / 64;
+      size_t bit = i % 64;
+      if (bit == 0) {
+        return zerosBefore[w];
+      }
+      return zerosBefore[w] + popcount64(zeros[w] & ((uint64_t(1) << bit) - 1));
+    }
+
+    size_t zerosIn(size_t begin, size_t end) const {
+      return zerosBeforeIndex(end) - zerosBeforeIndex(begin);
+    }
+  };
+
+}
+}
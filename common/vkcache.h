@@ -0,0 +1,56 @@
+/*
+   Copyright 2023 Trail of Bits
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Persisting an easyvk::Device's pipeline cache in the kernel cache.
+//
+// Include easyvk.h before this header.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "cache.h"
+
+namespace leftoverlocals {
+
+  // One entry per device and driver; the driver checks the same fields
+  // again when the data is loaded.
+  inline std::string pipelineCachePath(const easyvk::Device &device) {
+    const VkPhysicalDeviceProperties &p = device.properties;
+    std::string key = std::string(p.deviceName) + "\n" +
+      std::to_string(p.vendorID) + ":" + std::to_string(p.deviceID) + ":" +
+      std::to_string(p.driverVersion) + "\n" +
+      std::string((const char *) p.pipelineCacheUUID, VK_UUID_SIZE);
+    return cache::path(key, "vkcache");
+  }
+
+  inline void loadPipelineCache(easyvk::Device &device) {
+    std::vector<unsigned char> data;
+    if (cache::read(pipelineCachePath(device), data)) {
+      device.loadPipelineCache(data);
+    }
+  }
+
+  // Call once the pipelines have been created
+  inline void savePipelineCache(easyvk::Device &device) {
+    std::vector<unsigned char> data = device.pipelineCacheData();
+    if (!data.empty()) {
+      cache::write(pipelineCachePath(device), data.data(), data.size());
+    }
+  }
+
+}
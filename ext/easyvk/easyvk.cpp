@@ -1,5 +1,9 @@
 #include "easyvk.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
 // TODO: extend this to include ios logging lib
 void evk_log(const char* fmt, ...) {
     va_list args;
@@ -242,16 +246,18 @@ namespace easyvk {
 			// Define device info
 			std::vector<const char*> enabledExtensions { };
 
+			VkPhysicalDeviceVulkanMemoryModelFeaturesKHR memoryModelFeatures {
+				VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_MEMORY_MODEL_FEATURES_KHR,
+				nullptr,
+				true,
+				true,
+			};
+
 			VkDeviceCreateInfo deviceCreateInfo;
 			if(vulkan_memory_model_supported) {
 				deviceCreateInfo = {
 					VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-					new VkPhysicalDeviceVulkanMemoryModelFeaturesKHR {
-						VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_MEMORY_MODEL_FEATURES_KHR,
-						nullptr,
-						true,
-						true,
-					},
+					&memoryModelFeatures,
 					VkDeviceCreateFlags {},
 					1,
 					queues.data(),
@@ -280,6 +286,16 @@ namespace easyvk {
 			
 			// Get device properties
 			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+			uint32_t familyCount = 0;
+			vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+			std::vector<VkQueueFamilyProperties> families(familyCount);
+			vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+			if (computeFamilyId < familyCount)
+				timestampValidBits = families[computeFamilyId].timestampValidBits;
+
+			// Start with an empty pipeline cache
+			loadPipelineCache({});
 		}
 
 	uint32_t Device::selectMemory(VkBuffer buffer, VkMemoryPropertyFlags flags) {
@@ -299,6 +315,12 @@ namespace easyvk {
 		return uint32_t(-1);
 	}
 
+	VkMemoryPropertyFlags Device::memoryFlags(uint32_t memId) {
+		VkPhysicalDeviceMemoryProperties memProperties;
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+		return memProperties.memoryTypes[memId].propertyFlags;
+	}
+
 	// Get device queue
 	VkQueue Device::computeQueue() {
 		VkQueue queue;
@@ -306,49 +328,343 @@ namespace easyvk {
 		return queue;
 	}
 
+	VkFence Device::acquireFence() {
+		if (!fences.empty()) {
+			VkFence fence = fences.back();
+			fences.pop_back();
+			return fence;
+		}
+		VkFenceCreateInfo createInfo {
+			VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+			nullptr,
+			0
+		};
+		VkFence fence;
+		vkCheck(vkCreateFence(device, &createInfo, nullptr, &fence));
+		return fence;
+	}
+
+	void Device::releaseFence(VkFence fence) {
+		vkCheck(vkResetFences(device, 1, &fence));
+		fences.push_back(fence);
+	}
+
+	VkCommandPool Device::acquireCommandPool() {
+		if (!commandPools.empty()) {
+			VkCommandPool pool = commandPools.back();
+			commandPools.pop_back();
+			return pool;
+		}
+		VkCommandPoolCreateInfo createInfo {
+			VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+			nullptr,
+			VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+			computeFamilyId
+		};
+		VkCommandPool pool;
+		vkCheck(vkCreateCommandPool(device, &createInfo, nullptr, &pool));
+		return pool;
+	}
+
+	// Command buffers allocated from the pool must have been freed
+	void Device::releaseCommandPool(VkCommandPool pool) {
+		vkCheck(vkResetCommandPool(device, pool, 0));
+		commandPools.push_back(pool);
+	}
+
+	// Pools hold one descriptor set per dispatch of a batch
+	VkDescriptorPool Device::acquireDescriptorPool(uint32_t descriptors, uint32_t sets) {
+		uint64_t key = uint64_t(sets) << 32 | descriptors;
+		for (size_t i = 0; i < descriptorPools.size(); i++) {
+			if (descriptorPools[i].first == key) {
+				VkDescriptorPool pool = descriptorPools[i].second;
+				descriptorPools.erase(descriptorPools.begin() + i);
+				return pool;
+			}
+		}
+		VkDescriptorPoolSize poolSize {
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			descriptors * sets
+		};
+		VkDescriptorPoolCreateInfo createInfo {
+			VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+			nullptr,
+			VkDescriptorPoolCreateFlags {},
+			sets,
+			1,
+			&poolSize
+		};
+		VkDescriptorPool pool;
+		vkCheck(vkCreateDescriptorPool(device, &createInfo, nullptr, &pool));
+		return pool;
+	}
+
+	// Frees the descriptor sets allocated from the pool
+	void Device::releaseDescriptorPool(VkDescriptorPool pool, uint32_t descriptors, uint32_t sets) {
+		vkCheck(vkResetDescriptorPool(device, pool, 0));
+		descriptorPools.push_back(std::make_pair(uint64_t(sets) << 32 | descriptors, pool));
+	}
+
+	// Pools hold the two timestamps around a dispatch
+	VkQueryPool Device::acquireTimestampQueryPool() {
+		if (!queryPools.empty()) {
+			VkQueryPool pool = queryPools.back();
+			queryPools.pop_back();
+			return pool;
+		}
+		// TODO: Device support limits need to be queried.
+		VkQueryPoolCreateInfo createInfo {
+			VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+			VK_NULL_HANDLE,
+			0,
+			VK_QUERY_TYPE_TIMESTAMP,
+			2
+		};
+		VkQueryPool pool;
+		vkCheck(vkCreateQueryPool(device, &createInfo, VK_NULL_HANDLE, &pool));
+		return pool;
+	}
+
+	// The pool is reset by the next command buffer that uses it
+	void Device::releaseTimestampQueryPool(VkQueryPool pool) {
+		queryPools.push_back(pool);
+	}
+
+	void Device::loadPipelineCache(const std::vector<unsigned char> &data) {
+		if (pipelineCache != VK_NULL_HANDLE)
+			vkDestroyPipelineCache(device, pipelineCache, nullptr);
+		// Drivers validate the header and ignore data from another device
+		// or driver version
+		VkPipelineCacheCreateInfo createInfo {
+			VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+			nullptr,
+			0,
+			data.size(),
+			data.empty() ? nullptr : data.data()
+		};
+		vkCheck(vkCreatePipelineCache(device, &createInfo, nullptr, &pipelineCache));
+	}
+
+	std::vector<unsigned char> Device::pipelineCacheData() {
+		size_t size = 0;
+		vkCheck(vkGetPipelineCacheData(device, pipelineCache, &size, nullptr));
+		std::vector<unsigned char> data(size);
+		if (size > 0)
+			vkCheck(vkGetPipelineCacheData(device, pipelineCache, &size, data.data()));
+		data.resize(size);
+		return data;
+	}
+
 	void Device::teardown() {
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+		for (auto fence : fences)
+			vkDestroyFence(device, fence, nullptr);
+		for (auto pool : commandPools)
+			vkDestroyCommandPool(device, pool, nullptr);
+		for (auto &pool : descriptorPools)
+			vkDestroyDescriptorPool(device, pool.second, nullptr);
+		for (auto pool : queryPools)
+			vkDestroyQueryPool(device, pool, nullptr);
+		fences.clear();
+		commandPools.clear();
+		descriptorPools.clear();
+		queryPools.clear();
 		vkDestroyDevice(device, nullptr);
 	}
 
 	// Create new buffer
-	VkBuffer getNewBuffer(easyvk::Device &_device, uint32_t size) {
-		VkBuffer newBuffer;
-		vkCheck(vkCreateBuffer(_device.device, new VkBufferCreateInfo {
+	VkBuffer getNewBuffer(easyvk::Device &_device, uint32_t size, VkBufferUsageFlags usage) {
+		VkBufferCreateInfo createInfo {
 			VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
 			nullptr,
 			VkBufferCreateFlags {},
 			size * sizeof(uint32_t),
-			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT }, nullptr, &newBuffer));
+			usage };
+		VkBuffer newBuffer;
+		vkCheck(vkCreateBuffer(_device.device, &createInfo, nullptr, &newBuffer));
 		return newBuffer;
 	}
 
-	Buffer::Buffer(easyvk::Device &_device, uint32_t _size) :
+	// Allocate memory of the given kind and bind it to the buffer
+	VkDeviceMemory bindNewMemory(easyvk::Device &_device, VkBuffer buffer, VkMemoryPropertyFlags flags, uint32_t &memId) {
+		memId = _device.selectMemory(buffer, flags);
+
+		VkMemoryRequirements memReqs;
+		vkGetBufferMemoryRequirements(_device.device, buffer, &memReqs);
+
+		VkMemoryAllocateInfo allocateInfo {
+			VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			nullptr,
+			memReqs.size,
+			memId};
+		VkDeviceMemory memory;
+		vkCheck(vkAllocateMemory(_device.device, &allocateInfo, nullptr, &memory));
+
+		vkCheck(vkBindBufferMemory(_device.device, buffer, memory, 0));
+		return memory;
+	}
+
+	Buffer::Buffer(easyvk::Device &_device, uint32_t _size, bool _deviceLocal) :
 		device(_device),
-		buffer(getNewBuffer(_device, _size)),
-		size(_size)
+		length(_size),
+		deviceLocal(_deviceLocal)
 		{
-            // Allocate and map memory to new buffer
-	        auto memId = _device.selectMemory(buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+			VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+			if (deviceLocal)
+				usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+			buffer = getNewBuffer(_device, _size, usage);
 
-            VkMemoryRequirements memReqs;
-            vkGetBufferMemoryRequirements(device.device, buffer, &memReqs);
+			uint32_t memId;
+			if (deviceLocal) {
+				memory = bindNewMemory(_device, buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memId);
 
-            vkCheck(vkAllocateMemory(_device.device, new VkMemoryAllocateInfo {
-                VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                nullptr,
-                memReqs.size,
-                memId}, nullptr, &memory));
+				// The host reads and writes the staging buffer
+				stagingBuffer = getNewBuffer(_device, _size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+				stagingMemory = bindNewMemory(_device, stagingBuffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memId);
 
-            vkCheck(vkBindBufferMemory(_device.device, buffer, memory, 0));
+				transferPool = device.acquireCommandPool();
+				transferFence = device.acquireFence();
+			}
+			else {
+				// Allocate and map memory to new buffer
+				memory = bindNewMemory(_device, buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memId);
+			}
+			coherent = device.memoryFlags(memId) & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
-            void* newData = new void*;
-            vkCheck(vkMapMemory(_device.device, memory, 0, VK_WHOLE_SIZE, VkMemoryMapFlags {}, &newData));
-            data = (uint32_t*)newData;
+			void* newData = nullptr;
+			vkCheck(vkMapMemory(_device.device, deviceLocal ? stagingMemory : memory, 0, VK_WHOLE_SIZE, VkMemoryMapFlags {}, &newData));
+			mapped = (uint32_t*)newData;
 		}
 
+	void Buffer::fill(uint32_t value) {
+		if (value == 0)
+			memset(mapped, 0, length * sizeof(uint32_t));
+		else
+			std::fill(mapped, mapped + length, value);
+		flush();
+	}
+
+	void Buffer::copy_from(const uint32_t* src, size_t n, size_t offset) {
+		memcpy(mapped + offset, src, n * sizeof(uint32_t));
+		flush();
+	}
+
+	void Buffer::copy_to(uint32_t* dst, size_t n, size_t offset) {
+		invalidate();
+		memcpy(dst, mapped + offset, n * sizeof(uint32_t));
+	}
+
+	// Non-coherent mappings are always flushed and invalidated whole, which
+	// keeps clear of the nonCoherentAtomSize alignment rules.
+	void Buffer::flush() {
+		if (coherent)
+			return;
+		VkMappedMemoryRange range {
+			VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+			nullptr,
+			deviceLocal ? stagingMemory : memory,
+			0,
+			VK_WHOLE_SIZE};
+		vkCheck(vkFlushMappedMemoryRanges(device.device, 1, &range));
+	}
+
+	void Buffer::invalidate() {
+		if (coherent)
+			return;
+		VkMappedMemoryRange range {
+			VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+			nullptr,
+			deviceLocal ? stagingMemory : memory,
+			0,
+			VK_WHOLE_SIZE};
+		vkCheck(vkInvalidateMappedMemoryRanges(device.device, 1, &range));
+	}
+
+	void Buffer::upload() {
+		if (!deviceLocal)
+			return;
+		flush();
+		transfer(stagingBuffer, buffer, true);
+	}
+
+	void Buffer::download() {
+		if (!deviceLocal)
+			return;
+		transfer(buffer, stagingBuffer, false);
+		invalidate();
+	}
+
+	// Copies the whole buffer on the compute queue and waits for it
+	void Buffer::transfer(VkBuffer src, VkBuffer dst, bool toDevice) {
+		VkCommandBufferAllocateInfo allocateInfo {
+			VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			nullptr,
+			transferPool,
+			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			1};
+		VkCommandBuffer commandBuffer;
+		vkCheck(vkAllocateCommandBuffers(device.device, &allocateInfo, &commandBuffer));
+
+		VkCommandBufferBeginInfo beginInfo {
+			VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			nullptr,
+			VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+		vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+		// Make host writes (upload) or shader writes (download) visible to the copy
+		VkMemoryBarrier before {
+			VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			nullptr,
+			toDevice ? VK_ACCESS_HOST_WRITE_BIT : VK_ACCESS_SHADER_WRITE_BIT,
+			VK_ACCESS_TRANSFER_READ_BIT};
+		vkCmdPipelineBarrier(commandBuffer,
+							 toDevice ? VK_PIPELINE_STAGE_HOST_BIT : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &before, 0, nullptr, 0, nullptr);
+
+		VkBufferCopy region {0, 0, length * sizeof(uint32_t)};
+		vkCmdCopyBuffer(commandBuffer, src, dst, 1, &region);
+
+		// And the copy visible to the next dispatch (upload) or the host (download)
+		VkMemoryBarrier after {
+			VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			nullptr,
+			VK_ACCESS_TRANSFER_WRITE_BIT,
+			toDevice ? (VkAccessFlags) (VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT) : (VkAccessFlags) VK_ACCESS_HOST_READ_BIT};
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 toDevice ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_HOST_BIT,
+							 0, 1, &after, 0, nullptr, 0, nullptr);
+
+		vkCheck(vkEndCommandBuffer(commandBuffer));
+
+		VkSubmitInfo submitInfo {
+			VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			nullptr,
+			0,
+			nullptr,
+			nullptr,
+			1,
+			&commandBuffer,
+			0,
+			nullptr
+		};
+		vkCheck(vkQueueSubmit(device.computeQueue(), 1, &submitInfo, transferFence));
+		vkCheck(vkWaitForFences(device.device, 1, &transferFence, VK_TRUE, UINT64_MAX));
+		vkCheck(vkResetFences(device.device, 1, &transferFence));
+
+		vkFreeCommandBuffers(device.device, transferPool, 1, &commandBuffer);
+	}
 
 	void Buffer::teardown() {
-		vkUnmapMemory(device.device, memory);
+		if (deviceLocal) {
+			vkUnmapMemory(device.device, stagingMemory);
+			vkFreeMemory(device.device, stagingMemory, nullptr);
+			vkDestroyBuffer(device.device, stagingBuffer, nullptr);
+			device.releaseCommandPool(transferPool);
+			device.releaseFence(transferFence);
+		}
+		else {
+			vkUnmapMemory(device.device, memory);
+		}
 		vkFreeMemory(device.device, memory, nullptr);
 		vkDestroyBuffer(device.device, buffer, nullptr);
 	}
@@ -369,14 +685,15 @@ namespace easyvk {
 	}
 
 	VkShaderModule initShaderModule(easyvk::Device& device, std::vector<uint32_t> spvCode) {
-		VkShaderModule shaderModule;
-		vkCheck(vkCreateShaderModule(device.device, new VkShaderModuleCreateInfo {
+		VkShaderModuleCreateInfo createInfo {
 			VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
 			nullptr,
 			0,
 			spvCode.size() * sizeof(uint32_t),
 			spvCode.data()
-		}, nullptr, &shaderModule));
+		};
+		VkShaderModule shaderModule;
+		vkCheck(vkCreateShaderModule(device.device, &createInfo, nullptr, &shaderModule));
 
 		return shaderModule;
 	}
@@ -412,19 +729,24 @@ namespace easyvk {
 	}
 
 	// This function brings descriptorSet, buffers, and bufferInfo to create writeDescriptorSets,
-	// which describes a descriptor set write operation
+	// which describes a descriptor set write operation. The buffer at index
+	// slice is bound from offset to offset + range, the others whole.
 	void writeSets(
 			VkDescriptorSet& descriptorSet,
 			std::vector<easyvk::Buffer> &buffers,
 			std::vector<VkWriteDescriptorSet>& writeDescriptorSets,
-			std::vector<VkDescriptorBufferInfo>& bufferInfos) {
+			std::vector<VkDescriptorBufferInfo>& bufferInfos,
+			uint32_t slice = uint32_t(-1),
+			VkDeviceSize offset = 0,
+			VkDeviceSize range = VK_WHOLE_SIZE) {
 
 		// Define descriptor buffer info
 	    for (int i = 0; i < buffers.size(); i++) {
+			bool sliced = uint32_t(i) == slice;
 			bufferInfos.push_back(VkDescriptorBufferInfo{
 				buffers[i].buffer,
-				0,
-				VK_WHOLE_SIZE
+				sliced ? offset : 0,
+				sliced ? range : VK_WHOLE_SIZE
 			});
 		}
 
@@ -448,6 +770,8 @@ namespace easyvk {
 	void Program::initialize(const char* entry_point) {
 		descriptorSetLayout = createDescriptorSetLayout(device, buffers.size());
 
+		VkPushConstantRange pushConstantRange {VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes};
+
 		// Define pipeline layout info
 		VkPipelineLayoutCreateInfo createInfo {
 			VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
@@ -456,7 +780,7 @@ namespace easyvk {
 			1,
 			&descriptorSetLayout,
 			1,
-			new VkPushConstantRange {VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes}
+			&pushConstantRange
 		};
 
 		// Print out device's properties information
@@ -465,38 +789,50 @@ namespace easyvk {
 		// Create a new pipeline layout object
 		vkCheck(vkCreatePipelineLayout(device.device, &createInfo, nullptr, &pipelineLayout));
 
-		// Define descriptor pool size
-		VkDescriptorPoolSize poolSize {
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-			(uint32_t)buffers.size()
-		};
-		auto descriptorSizes = std::array<VkDescriptorPoolSize, 1>({poolSize});
+		// Take a descriptor pool from the device; the batch is fixed from here on
+		descriptorPool = device.acquireDescriptorPool(buffers.size(), batchCount);
+		initialized = true;
 
-		// Create a new descriptor pool object
-		vkCheck(vkCreateDescriptorPool(device.device, new VkDescriptorPoolCreateInfo {
-			VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-			nullptr,
-			VkDescriptorPoolCreateFlags {},
-			1,
-			uint32_t(descriptorSizes.size()),
-			descriptorSizes.data()}, nullptr, &descriptorPool));
-
-		// Allocate descriptor set
-		vkCheck(vkAllocateDescriptorSets(device.device, new VkDescriptorSetAllocateInfo {
+		// Allocate one descriptor set per dispatch
+		std::vector<VkDescriptorSetLayout> layouts(batchCount, descriptorSetLayout);
+		VkDescriptorSetAllocateInfo descriptorSetAI {
 			VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
 			nullptr,
 			descriptorPool,
-			1,
-			&descriptorSetLayout}, &descriptorSet));
-
-		writeSets(descriptorSet, buffers, writeDescriptorSets, bufferInfos);
-
-		// Update contents of descriptor set object
-		vkUpdateDescriptorSets(device.device, writeDescriptorSets.size(), &writeDescriptorSets.front(), 0,{});
+			batchCount,
+			layouts.data()};
+		descriptorSets.resize(batchCount);
+		vkCheck(vkAllocateDescriptorSets(device.device, &descriptorSetAI, descriptorSets.data()));
+
+		// Slices of the output buffer are bound at their byte offsets
+		VkDeviceSize sliceBytes = VK_WHOLE_SIZE;
+		if (batchCount > 1) {
+			VkDeviceSize bytes = VkDeviceSize(buffers.at(batchOutput).size()) * sizeof(uint32_t);
+			sliceBytes = bytes / batchCount;
+			VkDeviceSize alignment = std::max<VkDeviceSize>(1, device.properties.limits.minStorageBufferOffsetAlignment);
+			if (bytes % batchCount != 0 || sliceBytes % alignment != 0) {
+				evk_log("easyvk: a batch of %u needs slices of buffer %u aligned to %llu bytes\n",
+					batchCount, batchOutput, (unsigned long long) alignment);
+				exit(1);
+			}
+		}
+		for (uint32_t i = 0; i < batchCount; i++) {
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+			std::vector<VkDescriptorBufferInfo> bufferInfos;
+			writeSets(descriptorSets[i], buffers, writeDescriptorSets, bufferInfos,
+				batchCount > 1 ? batchOutput : uint32_t(-1), i * sliceBytes, sliceBytes);
+
+			// Update contents of descriptor set object
+			vkUpdateDescriptorSets(device.device, writeDescriptorSets.size(), &writeDescriptorSets.front(), 0,{});
+		}
 
-		VkSpecializationMapEntry specMap[1] = {VkSpecializationMapEntry{0, 0, sizeof(uint32_t)}};
-		uint32_t specMapContent[1] = {workgroupSize};
-		VkSpecializationInfo specInfo {1, specMap, sizeof(uint32_t), specMapContent};
+		std::vector<VkSpecializationMapEntry> specMap = {VkSpecializationMapEntry{0, 0, sizeof(uint32_t)}};
+		std::vector<uint32_t> specMapContent = {workgroupSize};
+		for (auto &constant : specConstants) {
+			specMap.push_back(VkSpecializationMapEntry{constant.first, uint32_t(specMapContent.size() * sizeof(uint32_t)), sizeof(uint32_t)});
+			specMapContent.push_back(constant.second);
+		}
+		VkSpecializationInfo specInfo {uint32_t(specMap.size()), specMap.data(), specMapContent.size() * sizeof(uint32_t), specMapContent.data()};
 		// Define shader stage create info
 		VkPipelineShaderStageCreateInfo stageCI{
 			VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -517,30 +853,11 @@ namespace easyvk {
 		};
 
 		// Create compute pipelines
-		vkCheck(vkCreateComputePipelines(device.device, {}, 1, &pipelineCI, nullptr,  &pipeline));
-
-		// Create fence.
-		vkCheck(vkCreateFence(
-			device.device,
-			new VkFenceCreateInfo {
-				VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-				nullptr,
-				0
-			},
-			nullptr,
-			&fence
-		));
+		vkCheck(vkCreateComputePipelines(device.device, device.pipelineCache, 1, &pipelineCI, nullptr,  &pipeline));
 
-		// Define command pool info
-		VkCommandPoolCreateInfo commandPoolCreateInfo {
-			VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-			nullptr,
-			VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-			device.computeFamilyId
-		};
-
-		// Create command pool
-		vkCheck(vkCreateCommandPool(device.device, &commandPoolCreateInfo, nullptr, &commandPool));
+		// Take a fence and a command pool from the device
+		fence = device.acquireFence();
+		commandPool = device.acquireCommandPool();
 
 		// Define command buffer info
 		VkCommandBufferAllocateInfo commandBufferAI {
@@ -554,46 +871,73 @@ namespace easyvk {
 		// Allocate command buffers
 		vkCheck(vkAllocateCommandBuffers(device.device, &commandBufferAI, &commandBuffer));
 
-		// Create timestamp query pool
-		// TODO: Device support limits need to be queried.
-		vkCheck(vkCreateQueryPool(
-			device.device,
-			new VkQueryPoolCreateInfo {
-				VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
-				VK_NULL_HANDLE,
-				0,
-				VK_QUERY_TYPE_TIMESTAMP,
-				2
-			},
-			VK_NULL_HANDLE,
-			&timestampQueryPool
-		));
+		// Take a timestamp query pool from the device
+		timestampQueryPool = device.acquireTimestampQueryPool();
 	}
 
-	void Program::run() {
+	void Program::record() {
+		// The command buffer of a pending submit is still in use
+		if (submitted) {
+			evk_log("easyvk: the command buffer is recorded before wait() for the last submit()\n");
+			exit(1);
+		}
+
 		// Start recording command buffer
-		vkCheck(vkBeginCommandBuffer(commandBuffer, new VkCommandBufferBeginInfo {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO}));
+		VkCommandBufferBeginInfo beginInfo {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+		vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
 
-		// Bind pipeline and descriptor sets
+		// Bind pipeline
 		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-						  pipelineLayout, 0, 1, &descriptorSet, 0, 0);
 
 		// Bind push constants
-		uint32_t pValues[3] = {0, 0, 0};
-		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes, &pValues);
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes, pushConstants.data());
+
+		// Timestamps for the profiler around everything the dispatch does
+		if (profiledTimestamps()) {
+			vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, 2);
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, 0);
+		}
 
 		/*vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
 		  1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});*/
 
 		// Dispatch compute work items
-		vkCmdDispatch(commandBuffer, numWorkgroups, 1, 1);
+		recordDispatches();
 
 		/*vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
 		  1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});*/
 
+		if (profiledTimestamps())
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, 1);
+
 		// End recording command buffer
 		vkCheck(vkEndCommandBuffer(commandBuffer));
+		recorded = true;
+	}
+
+	// One dispatch per descriptor set. Each waits for the previous one's
+	// writes, since the buffers other than the output are shared.
+	void Program::recordDispatches() {
+		VkMemoryBarrier shaderToShader {VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+			VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+		for (uint32_t i = 0; i < batchCount; i++) {
+			if (i > 0)
+				vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+					1, &shaderToShader, 0, {}, 0, {});
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+							  pipelineLayout, 0, 1, &descriptorSets[i], 0, 0);
+			vkCmdDispatch(commandBuffer, numWorkgroups, 1, 1);
+		}
+	}
+
+	void Program::submit() {
+		// Also guards the fence, which is only reset by wait()
+		if (submitted) {
+			evk_log("easyvk: submit() before wait() for the last submit()\n");
+			exit(1);
+		}
+		if (!recorded)
+			record();
 
 	    // Define submit info
 		VkSubmitInfo submitInfo {
@@ -610,41 +954,86 @@ namespace easyvk {
 
 		auto queue = device.computeQueue();
 
+		// The command buffer has timestamps if and only if this is set
+		profiledSubmit = profiler != nullptr;
+		if (profiledSubmit)
+			pending.submitStart = profiler->now();
+
 		// Submit command buffer to queue, signals fence on completion. 
 		vkCheck(vkQueueSubmit(queue, 1, &submitInfo, fence));
+		submitted = true;
+
+		if (profiledSubmit)
+			pending.submit = profiler->now() - pending.submitStart;
+	}
+
+	void Program::wait() {
+		if (!submitted)
+			return;
+		// Only submits made while profiling are profiled
+		bool profiled = profiledSubmit && profiler != nullptr;
+		if (profiled)
+			pending.waitStart = profiler->now();
 		// Wait on fence.
 		vkCheck(vkWaitForFences(device.device, 1, &fence, VK_TRUE, UINT64_MAX));
+		if (profiled)
+			pending.wait = profiler->now() - pending.waitStart;
 		// Reset fence signal.
 		vkCheck(vkResetFences(device.device, 1, &fence));
+		submitted = false;
+
+		if (profiled) {
+			pending.gpu = -1;
+			if (device.timestampValidBits > 0) {
+				uint64_t queryResults[2] = {0, 0};
+				vkCheck(vkGetQueryPoolResults(device.device, timestampQueryPool, 0, 2, sizeof(queryResults), queryResults,
+					sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+				uint64_t mask = device.timestampValidBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << device.timestampValidBits) - 1;
+				pending.gpu = ((queryResults[1] - queryResults[0]) & mask) * device.properties.limits.timestampPeriod / 1000.0;
+			}
+			profiler->add(pending);
+		}
+	}
+
+	void Program::run() {
+		submit();
+		wait();
 	}
 
 	float Program::runWithDispatchTiming() {
+		if (submitted) {
+			evk_log("easyvk: runWithDispatchTiming() before wait() for the last submit()\n");
+			exit(1);
+		}
+
+		// This overwrites the command buffer recorded for run()
+		recorded = false;
+
 		// Start recording command buffer
-		vkCheck(vkBeginCommandBuffer(commandBuffer, new VkCommandBufferBeginInfo {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO}));
+		VkCommandBufferBeginInfo beginInfo {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+		vkCheck(vkBeginCommandBuffer(commandBuffer, &beginInfo));
 
 		// Reset query pool.
 		vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 0, 2);
 
-		// Bind pipeline and descriptor sets
+		// Bind pipeline
 		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-						  pipelineLayout, 0, 1, &descriptorSet, 0, 0);
 
 		// Bind push constants
-		uint32_t pValues[3] = {0, 0, 0};
-		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes, &pValues);
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constant_size_bytes, pushConstants.data());
 
+		VkMemoryBarrier shaderToHost {VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT};
         vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
-                             1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});
+                             1, &shaderToHost, 0, {}, 0, {});
 		
 		// Write first timestamp.
 		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, timestampQueryPool, 0);
 
-		// Dispatch compute work items
-		vkCmdDispatch(commandBuffer, numWorkgroups, 1, 1);
+		// Dispatch compute work items, the whole batch is timed
+		recordDispatches();
 
 		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
-							1, new VkMemoryBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT}, 0, {}, 0, {});
+							1, &shaderToHost, 0, {}, 0, {});
 
 		// Write second timestamp.
 		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, timestampQueryPool, 1);
@@ -692,9 +1081,48 @@ namespace easyvk {
 	}
 
 	void Program::setWorkgroups(uint32_t _numWorkgroups) {
+		if (numWorkgroups != _numWorkgroups)
+			recorded = false;
 		numWorkgroups = _numWorkgroups;
 	}
 
+	void Program::setPushConstant(uint32_t index, uint32_t value) {
+		if (pushConstants.at(index) != value)
+			recorded = false;
+		pushConstants.at(index) = value;
+	}
+
+	void Program::setSpecConstant(uint32_t id, uint32_t value) {
+		for (auto &constant : specConstants) {
+			if (constant.first == id) {
+				constant.second = value;
+				return;
+			}
+		}
+		specConstants.push_back(std::make_pair(id, value));
+	}
+
+	void Program::setBatch(uint32_t count, uint32_t output) {
+		// The descriptor sets and their pool are sized for the batch
+		if (initialized) {
+			evk_log("easyvk: setBatch() is called after initialize()\n");
+			exit(1);
+		}
+		batchCount = std::max(1u, count);
+		batchOutput = output;
+	}
+
+	void Program::setProfiler(Profiler *_profiler) {
+		// Timestamps are only recorded while profiling
+		if ((profiler != nullptr) != (_profiler != nullptr))
+			recorded = false;
+		profiler = _profiler;
+	}
+
+	bool Program::profiledTimestamps() {
+		return profiler != nullptr && device.timestampValidBits > 0;
+	}
+
 	void Program::setWorkgroupSize(uint32_t _workgroupSize) {
 		workgroupSize = _workgroupSize;
 	}
@@ -712,13 +1140,154 @@ namespace easyvk {
 	}
 
 	void Program::teardown() {
+		// Pooled objects must not be handed out while still in use
+		wait();
 		vkDestroyShaderModule(device.device, shaderModule, nullptr);
-		vkDestroyDescriptorPool(device.device, descriptorPool, nullptr);
+		device.releaseDescriptorPool(descriptorPool, buffers.size(), batchCount);
 		vkDestroyDescriptorSetLayout(device.device, descriptorSetLayout, nullptr);
 		vkDestroyPipelineLayout(device.device, pipelineLayout, nullptr);
 		vkDestroyPipeline(device.device, pipeline, nullptr);
-		vkDestroyFence(device.device, fence, nullptr);
-		vkDestroyCommandPool(device.device, commandPool, nullptr);
-		vkDestroyQueryPool(device.device, timestampQueryPool, VK_NULL_HANDLE);
+		device.releaseFence(fence);
+		vkFreeCommandBuffers(device.device, commandPool, 1, &commandBuffer);
+		device.releaseCommandPool(commandPool);
+		device.releaseTimestampQueryPool(timestampQueryPool);
+	}
+
+	Profiler::Profiler(const std::string &_name) :
+		name(_name),
+		origin(std::chrono::steady_clock::now()) {
+	}
+
+	double Profiler::now() const {
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	void Profiler::add(Sample sample) {
+		sample.host = lastWaitEnd < 0 ? 0 : sample.submitStart - lastWaitEnd;
+		lastWaitEnd = sample.waitStart + sample.wait;
+		recorded.push_back(sample);
+	}
+
+	void Profiler::clear() {
+		recorded.clear();
+		lastWaitEnd = -1;
+	}
+
+	// Samples without GPU timestamps are left out of the gpu component
+	static std::vector<double> component(const std::vector<Profiler::Sample> &samples, double Profiler::Sample::*c) {
+		std::vector<double> values;
+		for (auto &s : samples) {
+			if (s.*c >= 0)
+				values.push_back(s.*c);
+		}
+		return values;
+	}
+
+	double Profiler::percentile(double Sample::*c, double p) const {
+		std::vector<double> values = component(recorded, c);
+		if (values.empty())
+			return -1;
+		std::sort(values.begin(), values.end());
+		size_t rank = (size_t) (p / 100.0 * (values.size() - 1) + 0.5);
+		return values[std::min(rank, values.size() - 1)];
+	}
+
+	double Profiler::mean(double Sample::*c) const {
+		std::vector<double> values = component(recorded, c);
+		if (values.empty())
+			return -1;
+		double sum = 0;
+		for (double v : values)
+			sum += v;
+		return sum / values.size();
+	}
+
+	const char* Profiler::boundBy() const {
+		double gpu = mean(&Sample::gpu);
+		if (recorded.empty() || gpu < 0)
+			return "unknown";
+		double host = mean(&Sample::host);
+		double driver = mean(&Sample::submit) + std::max(0.0, mean(&Sample::wait) - gpu);
+		if (host >= driver && host >= gpu)
+			return "host";
+		return driver >= gpu ? "driver" : "gpu";
+	}
+
+	static std::string jsonString(const std::string &s) {
+		std::string escaped = "\"";
+		for (char c : s) {
+			if (c == '"' || c == '\\')
+				escaped += '\\';
+			if ((unsigned char) c >= 0x20)
+				escaped += c;
+		}
+		return escaped + "\"";
+	}
+
+	void Profiler::writeJson(std::ostream &out) const {
+		const std::pair<const char*, double Sample::*> components[] = {
+			{"host_us", &Sample::host},
+			{"submit_us", &Sample::submit},
+			{"gpu_us", &Sample::gpu},
+			{"wait_us", &Sample::wait},
+		};
+		std::ios::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision(3);
+		out.setf(std::ios::fixed, std::ios::floatfield);
+		out << "{\n  \"name\": " << jsonString(name) << ",\n";
+		out << "  \"dispatches\": " << recorded.size() << ",\n";
+		for (auto &c : components) {
+			std::vector<double> values = component(recorded, c.second);
+			if (values.empty()) {
+				out << "  \"" << c.first << "\": null,\n";
+				continue;
+			}
+			// Bucket b counts the values below 2^b us and not below 2^(b-1)
+			std::vector<size_t> buckets;
+			for (double v : values) {
+				size_t b = v < 1 ? 0 : (size_t) std::floor(std::log2(v)) + 1;
+				if (b >= buckets.size())
+					buckets.resize(b + 1);
+				buckets[b]++;
+			}
+			out << "  \"" << c.first << "\": {\"count\": " << values.size() << ", \"mean\": " << mean(c.second)
+				<< ", \"p50\": " << percentile(c.second, 50) << ", \"p90\": " << percentile(c.second, 90)
+				<< ", \"p99\": " << percentile(c.second, 99) << ", \"max\": " << percentile(c.second, 100)
+				<< ", \"histogram\": [";
+			bool first = true;
+			for (size_t b = 0; b < buckets.size(); b++) {
+				if (!buckets[b])
+					continue;
+				out << (first ? "" : ", ") << "{\"lt\": " << (uint64_t(1) << b) << ", \"count\": " << buckets[b] << "}";
+				first = false;
+			}
+			out << "]},\n";
+		}
+		out << "  \"bound_by\": \"" << boundBy() << "\"\n}\n";
+		out.flags(flags);
+		out.precision(precision);
+	}
+
+	void Profiler::writeChromeTrace(std::ostream &out) const {
+		std::ios::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision(3);
+		out.setf(std::ios::fixed, std::ios::floatfield);
+		out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+		out << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": " << jsonString(name) << "}},\n";
+		out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"host\"}},\n";
+		out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"gpu\"}}";
+		auto event = [&out](const char* name, int tid, double ts, double dur) {
+			out << ",\n  {\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+				<< ", \"ts\": " << ts << ", \"dur\": " << dur << "}";
+		};
+		for (auto &s : recorded) {
+			event("vkQueueSubmit", 1, s.submitStart, s.submit);
+			event("vkWaitForFences", 1, s.waitStart, s.wait);
+			if (s.gpu >= 0)
+				event("dispatch", 2, s.submitStart + s.submit, s.gpu);
+		}
+		out << "\n]}\n";
+		out.flags(flags);
+		out.precision(precision);
 	}
 }
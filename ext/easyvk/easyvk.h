@@ -1,8 +1,12 @@
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <fstream>
+#include <ostream>
 #include <set>
 #include <stdarg.h>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <vulkan/vulkan.h>
@@ -34,37 +38,160 @@ namespace easyvk {
 			VkDevice device;
 			VkPhysicalDeviceProperties properties;
 			uint32_t selectMemory(VkBuffer buffer, VkMemoryPropertyFlags flags);
+			VkMemoryPropertyFlags memoryFlags(uint32_t memId);
 			VkQueue computeQueue();
 			uint32_t computeFamilyId = uint32_t(-1);
+			// Zero when the compute queue does not support timestamps
+			uint32_t timestampValidBits = 0;
+
+			// Fences, command pools, descriptor pools and timestamp query
+			// pools are recycled between Programs instead of being created
+			// and destroyed for each one. Released objects are reset and
+			// handed out again by the next acquire. A Device and its pools
+			// must only be used from one thread.
+			VkFence acquireFence();
+			void releaseFence(VkFence fence);
+			VkCommandPool acquireCommandPool();
+			void releaseCommandPool(VkCommandPool pool);
+			VkDescriptorPool acquireDescriptorPool(uint32_t descriptors, uint32_t sets = 1);
+			void releaseDescriptorPool(VkDescriptorPool pool, uint32_t descriptors, uint32_t sets = 1);
+			VkQueryPool acquireTimestampQueryPool();
+			void releaseTimestampQueryPool(VkQueryPool pool);
+
+			// Pipeline cache used by every Program on this device. It can be
+			// seeded with the data saved by an earlier run so that pipelines
+			// are not compiled again.
+			VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+			void loadPipelineCache(const std::vector<unsigned char> &data);
+			std::vector<unsigned char> pipelineCacheData();
+
 			void teardown();
 		private:
 			Instance &instance;
 			VkPhysicalDevice physicalDevice;
+			std::vector<VkFence> fences;
+			std::vector<VkCommandPool> commandPools;
+			// Keyed by the number of sets in the upper half and of storage
+			// buffer descriptors per set in the lower half
+			std::vector<std::pair<uint64_t, VkDescriptorPool>> descriptorPools;
+			std::vector<VkQueryPool> queryPools;
 	};
 
 	class Buffer {
 		public:
-			Buffer(Device &device, uint32_t size);
+			// A deviceLocal buffer lives in device-local memory and is
+			// accessed through a host-visible staging buffer of the same
+			// size; upload() and download() move data between the two.
+			// Otherwise the buffer itself is mapped.
+			Buffer(Device &device, uint32_t size, bool deviceLocal = false);
 			VkBuffer buffer;
 
 			void store(size_t i, uint32_t value) {
-				*(data + i) = value;
+				*(mapped + i) = value;
 			}
 
 			uint32_t load(size_t i) {
-				return *(data + i);
+				return *(mapped + i);
 			}
+
+			// Bulk access to the mapping. On non-coherent memory, call
+			// invalidate() before reading what the device wrote and flush()
+			// after writing what the device should see; fill(), copy_from()
+			// and copy_to() do this themselves.
+			uint32_t* data() {
+				return mapped;
+			}
+
+			const uint32_t* data() const {
+				return mapped;
+			}
+
+			size_t size() const {
+				return length;
+			}
+
+			void fill(uint32_t value);
 			void clear() {
-				for (uint32_t i = 0; i < size; i++)
-					store(i, 0);
+				fill(0);
 			}
+			void copy_from(const uint32_t* src, size_t n, size_t offset = 0);
+			void copy_to(uint32_t* dst, size_t n, size_t offset = 0);
+
+			void flush();
+			void invalidate();
+
+			// Copy the staging buffer to the device-local one and back. Both
+			// block until the copy is done and are no-ops for buffers that
+			// are mapped directly.
+			void upload();
+			void download();
 
 			void teardown();
 		private:
 			easyvk::Device &device;
 			VkDeviceMemory memory;
-			uint32_t size;
-            uint32_t* data;
+			uint32_t length;
+			uint32_t* mapped;
+			bool coherent = true;
+
+			// Only used by device-local buffers
+			bool deviceLocal;
+			VkBuffer stagingBuffer = VK_NULL_HANDLE;
+			VkDeviceMemory stagingMemory = VK_NULL_HANDLE;
+			VkCommandPool transferPool = VK_NULL_HANDLE;
+			VkFence transferFence = VK_NULL_HANDLE;
+			void transfer(VkBuffer src, VkBuffer dst, bool toDevice);
+	};
+
+	// Where the time of each dispatch goes. Once attached to a Program with
+	// setProfiler(), every submit()/wait() pair adds one Sample. All times
+	// are in microseconds, start times relative to the Profiler's creation.
+	//
+	// host is the time between the end of one wait and the next submit,
+	// i.e. the caller's own work. submit is vkQueueSubmit and wait is
+	// vkWaitForFences. gpu is the time between timestamps written before
+	// and after the dispatch, or negative when the queue has none. The
+	// part of the wait not spent executing is scheduling and completion
+	// latency, which together with submit is counted as the driver's.
+	class Profiler {
+		public:
+			struct Sample {
+				double host;
+				double submitStart;
+				double submit;
+				double gpu;
+				double waitStart;
+				double wait;
+			};
+
+			Profiler(const std::string &_name = "");
+			// Microseconds since the Profiler was created
+			double now() const;
+			void add(Sample sample);
+			const std::vector<Sample> &samples() const {
+				return recorded;
+			}
+			void clear();
+
+			// Nearest-rank percentile of one component, p in [0, 100]
+			double percentile(double Sample::*component, double p) const;
+			double mean(double Sample::*component) const;
+			// "host", "driver" or "gpu", whichever takes the most time per
+			// dispatch; "unknown" without GPU timestamps
+			const char* boundBy() const;
+
+			// Count, mean, percentiles and a power-of-two histogram of each
+			// component, as one JSON object
+			void writeJson(std::ostream &out) const;
+			// Trace Event Format, for chrome://tracing or Perfetto. The GPU
+			// clock is not correlated with the host's, so dispatches are
+			// drawn right after the submit that launched them.
+			void writeChromeTrace(std::ostream &out) const;
+		private:
+			std::string name;
+			std::chrono::steady_clock::time_point origin;
+			std::vector<Sample> recorded;
+			double lastWaitEnd = -1;
 	};
 
 	class Program {
@@ -73,9 +200,30 @@ namespace easyvk {
 			Program(Device &_device, std::vector<uint32_t> spvCode, std::vector<easyvk::Buffer> &buffers);
 			void initialize(const char* entry_point);
 			void run();
+			// Non-blocking half of run(): records the command buffer if it is
+			// stale and submits it. Must be paired with wait() before the
+			// next submit(), run() or runWithDispatchTiming().
+			void submit();
+			// Blocks until the last submit() has finished executing.
+			void wait();
 			float runWithDispatchTiming();
 			void setWorkgroups(uint32_t _numWorkgroups);
 			void setWorkgroupSize(uint32_t _workgroupSize);
+			void setPushConstant(uint32_t index, uint32_t value);
+			// Specialization constants other than the workgroup size (id 0),
+			// e.g. the sizes of local arrays. Takes effect in initialize().
+			void setSpecConstant(uint32_t id, uint32_t value);
+			// Records count dispatches into one command buffer, separated by
+			// barriers, so that one submit and one fence wait cover all of
+			// them. Dispatch i sees the buffer at index output through the
+			// i-th of count equal slices, e.g. an output buffer sized for
+			// count dumps; all other buffers are shared. Each slice must be a
+			// multiple of minStorageBufferOffsetAlignment. A profiled batch
+			// is one sample. Must be called before initialize().
+			void setBatch(uint32_t count, uint32_t output);
+			// Profiles every submit()/wait() pair from now on. The Profiler
+			// must outlive its use; nullptr turns profiling off.
+			void setProfiler(Profiler *_profiler);
 			void teardown();
 		private:
 			std::vector<easyvk::Buffer> &buffers;
@@ -83,17 +231,31 @@ namespace easyvk {
 			easyvk::Device &device;
 			VkDescriptorSetLayout descriptorSetLayout;
 			VkDescriptorPool descriptorPool;
-			VkDescriptorSet descriptorSet;
-			std::vector<VkWriteDescriptorSet> writeDescriptorSets;
-			std::vector<VkDescriptorBufferInfo> bufferInfos;
+			// One per dispatch of a batch
+			std::vector<VkDescriptorSet> descriptorSets;
+			uint32_t batchCount = 1;
+			uint32_t batchOutput = 0;
 			VkPipelineLayout pipelineLayout;
 			VkPipeline pipeline;
-			uint32_t numWorkgroups;
+			uint32_t numWorkgroups = 0;
 			uint32_t workgroupSize;
 			VkFence fence;
 			VkCommandBuffer commandBuffer;
+			// The command buffer is only re-recorded when the dispatch
+			// parameters change.
+			bool recorded = false;
+			bool submitted = false;
+			bool initialized = false;
+			std::array<uint32_t, push_constant_size_bytes / sizeof(uint32_t)> pushConstants = {};
+			std::vector<std::pair<uint32_t, uint32_t>> specConstants;
+			void record();
+			void recordDispatches();
 			VkCommandPool commandPool;
 			VkQueryPool timestampQueryPool;
+			Profiler *profiler = nullptr;
+			Profiler::Sample pending;
+			bool profiledSubmit = false;
+			bool profiledTimestamps();
 	};
 
 	const char* vkDeviceType(VkPhysicalDeviceType type);